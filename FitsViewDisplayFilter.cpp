@@ -0,0 +1,350 @@
+#include "FitsViewDisplayFilter.h"
+
+#include<vector>
+#include<algorithm>
+#include<cmath>
+#include<limits>
+
+
+FitsViewDisplayFilter::FitsViewDisplayFilter(FilterType type, double size):
+    type(type), size(size)
+{
+}
+
+
+int FitsViewDisplayFilter::radius() const
+{
+    int r = 0;
+
+    switch ( type ) {
+        case DF_BOX:
+        case DF_MEDIAN: {
+            r = static_cast<int>(std::floor(size+0.5))/2;
+            break;
+        }
+        case DF_GAUSSIAN: {
+            r = static_cast<int>(std::ceil(3.0*size));
+            break;
+        }
+        default: break;
+    }
+
+    return std::min(std::max(r,0),FITS_VIEW_FILTER_MAX_RADIUS);
+}
+
+
+bool FitsViewDisplayFilter::operator==(const FitsViewDisplayFilter &filter) const
+{
+    return (type == filter.type) && (size == filter.size);
+}
+
+
+bool FitsViewDisplayFilter::operator!=(const FitsViewDisplayFilter &filter) const
+{
+    return !(*this == filter);
+}
+
+
+static inline size_t clamp_index(long i, size_t n)
+{
+    if ( i < 0 ) return 0;
+    if ( i >= static_cast<long>(n) ) return n-1;
+    return i;
+}
+
+
+// NaNs and masked pixels (bit idx of the packed mask) do not contribute to the filtered values
+static inline bool is_valid(const double *image, const quint64 *mask, size_t idx)
+{
+    return std::isfinite(image[idx]) && !(mask && ((mask[idx >> 6] >> (idx & 63)) & 1));
+}
+
+
+// separable normalized convolution (box or Gaussian kernel): the weighted sum of valid pixels
+// is divided by the sum of their weights (NaN if there are no valid pixels in the window).
+// the horizontal pass is computed only at the sampled columns and for the rows
+// which are needed by the vertical pass. the inner loops run along rows, so they are vectorised
+static void separable_filter(const double *image, const quint64 *mask, size_t nx, size_t ny,
+                             size_t x0, size_t y0, size_t w, size_t h, size_t step,
+                             const std::vector<double> &kernel, double *out)
+{
+    long r = kernel.size()/2;
+    size_t ksize = kernel.size();
+
+    long ymin = std::max(static_cast<long>(y0) - r,0L);
+    long ymax = std::min(static_cast<long>(y0 + (h-1)*step) + r,static_cast<long>(ny)-1);
+
+    // rows needed by the vertical pass
+    std::vector<long> slot(ymax-ymin+1,-1);
+    long nrows = 0;
+    for ( size_t j = 0; j < h; ++j ) {
+        long y = y0 + j*step;
+        for ( long t = -r; t <= r; ++t ) {
+            long row = clamp_index(y+t,ny) - ymin;
+            if ( slot[row] < 0 ) slot[row] = nrows++;
+        }
+    }
+
+    std::vector<double> hpass(nrows*w,0.0);
+    std::vector<double> hweight(nrows*w,0.0);
+
+    // the row span of the kernel windows (the edge pixels are replicated):
+    // the values with zeros for invalid pixels and the validity as weight
+    long xs = static_cast<long>(x0) - r;
+    size_t span = (w-1)*step + ksize;
+    std::vector<double> values(span), valid(span);
+
+    for ( long row = 0; row < static_cast<long>(slot.size()); ++row ) {
+        if ( slot[row] < 0 ) continue;
+
+        size_t offset = (row+ymin)*nx;
+        for ( size_t t = 0; t < span; ++t ) {
+            size_t idx = offset + clamp_index(xs + static_cast<long>(t),nx);
+            bool ok = is_valid(image,mask,idx);
+            values[t] = ok ? image[idx] : 0.0;
+            valid[t] = ok ? 1.0 : 0.0;
+        }
+
+        double *acc = hpass.data() + slot[row]*w;
+        double *wacc = hweight.data() + slot[row]*w;
+        for ( size_t t = 0; t < ksize; ++t ) {
+            const double *s = values.data() + t;
+            const double *m = valid.data() + t;
+            double k = kernel[t];
+            for ( size_t i = 0; i < w; ++i ) {
+                acc[i] += k*s[i*step];
+                wacc[i] += k*m[i*step];
+            }
+        }
+    }
+
+    std::vector<double> weight(w);
+
+    for ( size_t j = 0; j < h; ++j ) {
+        long y = y0 + j*step;
+        double *o = out + j*w;
+
+        std::fill(o,o+w,0.0);
+        std::fill(weight.begin(),weight.end(),0.0);
+
+        for ( size_t t = 0; t < ksize; ++t ) {
+            size_t sl = slot[clamp_index(y + static_cast<long>(t) - r,ny) - ymin]*w;
+            const double *s = hpass.data() + sl;
+            const double *m = hweight.data() + sl;
+            double k = kernel[t];
+            for ( size_t i = 0; i < w; ++i ) {
+                o[i] += k*s[i];
+                weight[i] += k*m[i];
+            }
+        }
+
+        for ( size_t i = 0; i < w; ++i ) {
+            o[i] = ( weight[i] > 0.0 ) ? o[i]/weight[i] : std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+}
+
+
+// median of valid pixels of (2r+1)^2 window by selection
+static void direct_median(const double *image, const quint64 *mask, size_t nx, size_t ny,
+                          size_t x0, size_t y0, size_t w, size_t h, size_t step,
+                          long r, double *out)
+{
+    std::vector<double> window((2*r+1)*(2*r+1));
+
+    for ( size_t j = 0; j < h; ++j ) {
+        long y = y0 + j*step;
+        for ( size_t i = 0; i < w; ++i ) {
+            long x = x0 + i*step;
+            size_t n = 0;
+            for ( long dy = -r; dy <= r; ++dy ) {
+                size_t offset = clamp_index(y+dy,ny)*nx;
+                for ( long dx = -r; dx <= r; ++dx ) {
+                    size_t idx = offset + clamp_index(x+dx,nx);
+                    if ( is_valid(image,mask,idx) ) window[n++] = image[idx];
+                }
+            }
+
+            if ( n == 0 ) {
+                out[j*w + i] = std::numeric_limits<double>::quiet_NaN();
+                continue;
+            }
+
+            std::nth_element(window.begin(),window.begin()+n/2,window.begin()+n);
+            out[j*w + i] = window[n/2];
+        }
+    }
+}
+
+
+// Huang's running-histogram median for contiguous output (step = 1):
+// sliding the window along the row, one column is removed and one is added.
+// the histogram levels are the ranks of the distinct valid values of the input region,
+// so the median is exact and an outlier does not coarsen the levels of the other pixels.
+// two-level histogram (FITS_VIEW_MEDIAN_FINE_BINS per coarse bin) makes the median search short
+static void running_median(const double *image, const quint64 *mask, size_t nx, size_t ny,
+                           size_t x0, size_t y0, size_t w, size_t h,
+                           long r, double *out)
+{
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const long nfine = FITS_VIEW_MEDIAN_FINE_BINS;
+    const unsigned int invalid = ~0u;
+
+    // the input region (windows are clamped at the image edges)
+    size_t xmin = clamp_index(static_cast<long>(x0) - r,nx);
+    size_t xmax = clamp_index(static_cast<long>(x0 + w - 1) + r,nx);
+    size_t ymin = clamp_index(static_cast<long>(y0) - r,ny);
+    size_t ymax = clamp_index(static_cast<long>(y0 + h - 1) + r,ny);
+    size_t rw = xmax - xmin + 1;
+
+    // valid pixels by value, the ties share the level
+    std::vector<unsigned int> levels(rw*(ymax-ymin+1),invalid);
+    std::vector<std::pair<double,unsigned int> > pixels;
+    pixels.reserve(levels.size());
+    for ( size_t y = ymin; y <= ymax; ++y ) {
+        for ( size_t x = xmin; x <= xmax; ++x ) {
+            if ( is_valid(image,mask,x + y*nx) ) pixels.push_back(std::make_pair(image[x + y*nx],(x-xmin) + (y-ymin)*rw));
+        }
+    }
+
+    if ( pixels.empty() ) {
+        std::fill(out,out+w*h,nan);
+        return;
+    }
+
+    std::sort(pixels.begin(),pixels.end());
+
+    std::vector<double> sorted; // distinct values
+    sorted.reserve(pixels.size());
+    for ( size_t i = 0; i < pixels.size(); ++i ) {
+        if ( sorted.empty() || (pixels[i].first != sorted.back()) ) sorted.push_back(pixels[i].first);
+        levels[pixels[i].second] = sorted.size() - 1;
+    }
+    std::vector<std::pair<double,unsigned int> >().swap(pixels);
+
+    size_t nlevels = sorted.size();
+    std::vector<unsigned int> fine(nlevels,0);
+    std::vector<unsigned int> coarse(nlevels/nfine + 1,0);
+    unsigned int nvalid = 0;
+
+    auto update_column = [&](long x, long y, int inc) {
+        size_t cx = clamp_index(x,nx) - xmin;
+        for ( long dy = -r; dy <= r; ++dy ) {
+            unsigned int q = levels[cx + (clamp_index(y+dy,ny) - ymin)*rw];
+            if ( q == invalid ) continue;
+            fine[q] += inc;
+            coarse[q/nfine] += inc;
+            nvalid += inc;
+        }
+    };
+
+    for ( size_t j = 0; j < h; ++j ) {
+        long y = y0 + j;
+
+        for ( long dx = -r; dx <= r; ++dx ) update_column(static_cast<long>(x0)+dx,y,1);
+
+        for ( size_t i = 0; i < w; ++i ) {
+            long x = x0 + i;
+
+            if ( i ) {
+                update_column(x-1-r,y,-1);
+                update_column(x+r,y,1);
+            }
+
+            if ( nvalid == 0 ) {
+                out[j*w + i] = nan;
+                continue;
+            }
+
+            unsigned int target = nvalid/2 + 1; // rank of the median (as in direct_median)
+            unsigned int count = 0;
+            long c = 0;
+            while ( count + coarse[c] < target ) count += coarse[c++];
+
+            long q = c*nfine;
+            while ( count + fine[q] < target ) count += fine[q++];
+
+            out[j*w + i] = sorted[q];
+        }
+
+        // the histograms are empty again for the next row
+        for ( long dx = -r; dx <= r; ++dx ) update_column(static_cast<long>(x0 + w - 1)+dx,y,-1);
+    }
+}
+
+
+// mean of valid pixels of bin x bin block (aligned to the image origin) which contains the point
+static void block_mean(const double *image, const quint64 *mask, size_t nx, size_t ny,
+                       size_t x0, size_t y0, size_t w, size_t h, size_t step,
+                       size_t bin, double *out)
+{
+    for ( size_t j = 0; j < h; ++j ) {
+        size_t by = (y0 + j*step)/bin*bin;
+        size_t ey = std::min(by+bin,ny);
+        for ( size_t i = 0; i < w; ++i ) {
+            size_t bx = (x0 + i*step)/bin*bin;
+            size_t ex = std::min(bx+bin,nx);
+
+            double sum = 0.0;
+            size_t n = 0;
+            for ( size_t y = by; y < ey; ++y ) {
+                for ( size_t x = bx; x < ex; ++x ) {
+                    if ( !is_valid(image,mask,y*nx + x) ) continue;
+                    sum += image[y*nx + x];
+                    ++n;
+                }
+            }
+            out[j*w + i] = n ? sum/n : std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+}
+
+
+void fits_view_filter_region(const double *image, const quint64 *mask, size_t nx, size_t ny,
+                             size_t x0, size_t y0, size_t w, size_t h, size_t step,
+                             const FitsViewDisplayFilter &filter, double *out)
+{
+    long r = filter.radius();
+
+    switch ( filter.type ) {
+        case FitsViewDisplayFilter::DF_BOX: {
+            std::vector<double> kernel(2*r+1,1.0/(2*r+1));
+            separable_filter(image,mask,nx,ny,x0,y0,w,h,step,kernel,out);
+            break;
+        }
+        case FitsViewDisplayFilter::DF_GAUSSIAN: {
+            std::vector<double> kernel(2*r+1);
+            double sum = 0.0;
+            double s2 = (filter.size > 0.0) ? 2.0*filter.size*filter.size : 1.0;
+            for ( long t = -r; t <= r; ++t ) {
+                kernel[t+r] = std::exp(-t*t/s2);
+                sum += kernel[t+r];
+            }
+            for ( size_t t = 0; t < kernel.size(); ++t ) kernel[t] /= sum;
+            separable_filter(image,mask,nx,ny,x0,y0,w,h,step,kernel,out);
+            break;
+        }
+        case FitsViewDisplayFilter::DF_MEDIAN: {
+            if ( (2*r+1 <= FITS_VIEW_MEDIAN_DIRECT_SIZE) || (step > 1) ) {
+                direct_median(image,mask,nx,ny,x0,y0,w,h,step,r,out);
+            } else {
+                running_median(image,mask,nx,ny,x0,y0,w,h,r,out);
+            }
+            break;
+        }
+        case FitsViewDisplayFilter::DF_BIN2: {
+            block_mean(image,mask,nx,ny,x0,y0,w,h,step,2,out);
+            break;
+        }
+        case FitsViewDisplayFilter::DF_BIN4: {
+            block_mean(image,mask,nx,ny,x0,y0,w,h,step,4,out);
+            break;
+        }
+        default: { // no filter: just sampling
+            for ( size_t j = 0; j < h; ++j ) {
+                const double *src = image + (y0 + j*step)*nx + x0;
+                for ( size_t i = 0; i < w; ++i ) out[j*w + i] = src[i*step];
+            }
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef FITSVIEWDISPLAYFILTER_H
+#define FITSVIEWDISPLAYFILTER_H
+
+#include "fitsviewwidget_global.h"
+
+#include<cstddef>
+
+#define FITS_VIEW_FILTER_MAX_RADIUS 32 // the largest kernel is (2*radius+1)x(2*radius+1)
+#define FITS_VIEW_MEDIAN_DIRECT_SIZE 5 // smaller median windows are computed by direct selection
+#define FITS_VIEW_MEDIAN_FINE_BINS 256 // histogram levels per coarse bin of running-histogram median
+
+
+// smoothing/binning of the displayed image (pixel values themselves are not changed)
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewDisplayFilter
+{
+    enum FilterType {DF_NONE, DF_BOX, DF_GAUSSIAN, DF_MEDIAN, DF_BIN2, DF_BIN4};
+
+    FitsViewDisplayFilter(FilterType type = DF_NONE, double size = 3.0);
+
+    FilterType type;
+    double size; // box and median: window size in pixels (odd), Gaussian: sigma in pixels
+
+    int radius() const; // half-size of the kernel window
+
+    bool operator==(const FitsViewDisplayFilter &filter) const;
+    bool operator!=(const FitsViewDisplayFilter &filter) const;
+};
+
+
+// filtered values of the row-major image of dimension nx*ny at w*h points
+// (x0 + i*step, y0 + j*step), i < w, j < h (0-based buffer indices).
+// pixels outside the image are replicated from the edge. NaNs and masked pixels
+// (bit x + y*nx of the packed mask, mask may be nullptr) are skipped, the value is NaN
+// if the window has no valid pixels. out must have w*h elements
+void fits_view_filter_region(const double *image, const quint64 *mask, size_t nx, size_t ny,
+                             size_t x0, size_t y0, size_t w, size_t h, size_t step,
+                             const FitsViewDisplayFilter &filter, double *out);
+
+#endif // FITSVIEWDISPLAYFILTER_H
@@ -0,0 +1,175 @@
+#include "FitsViewMemoryGovernor.h"
+
+#include<vector>
+
+#ifdef Q_OS_UNIX
+#include<unistd.h>
+#endif
+
+// default budget is a half of physical memory (unlimited if it cannot be determined)
+static size_t default_budget()
+{
+#if defined(Q_OS_UNIX) && defined(_SC_PHYS_PAGES)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+
+    if ( (pages > 0) && (page_size > 0) ) return static_cast<size_t>(pages)/2*page_size;
+#endif
+    return 0;
+}
+
+
+FitsViewMemoryClient::~FitsViewMemoryClient()
+{
+}
+
+
+            /*  CONSTRUCTOR  */
+
+FitsViewMemoryGovernor::FitsViewMemoryGovernor():
+    budget(default_budget()), totalUsage(0)
+{
+    for ( int i = 0; i < FITS_VIEW_MEMORY_CATEGORIES; ++i ) categoryUsage[i] = 0;
+}
+
+
+            /*  PUBLIC METHODS  */
+
+FitsViewMemoryGovernor* FitsViewMemoryGovernor::instance()
+{
+    static FitsViewMemoryGovernor governor;
+
+    return &governor;
+}
+
+
+void FitsViewMemoryGovernor::setBudget(size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    budget = bytes;
+
+    // the clients shrink their caches to the new budget
+    if ( budget && (totalUsage > budget) ) makeRoom(nullptr,0,lock);
+}
+
+
+size_t FitsViewMemoryGovernor::getBudget() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return budget;
+}
+
+
+size_t FitsViewMemoryGovernor::getUsage() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return totalUsage;
+}
+
+
+size_t FitsViewMemoryGovernor::getUsage(const FitsViewMemoryClient *client) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = clientUsage.find(const_cast<FitsViewMemoryClient*>(client));
+    if ( it == clientUsage.end() ) return 0;
+
+    size_t usage = 0;
+    for ( int i = 0; i < FITS_VIEW_MEMORY_CATEGORIES; ++i ) usage += it->second[i];
+
+    return usage;
+}
+
+
+size_t FitsViewMemoryGovernor::getUsage(FitsViewMemoryGovernor::Category cat) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return categoryUsage[cat];
+}
+
+
+bool FitsViewMemoryGovernor::setUsage(FitsViewMemoryClient *client, FitsViewMemoryGovernor::Category cat, size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto it = clientUsage.find(client);
+    if ( it == clientUsage.end() ) {
+        std::array<size_t,FITS_VIEW_MEMORY_CATEGORIES> usage;
+        usage.fill(0);
+        it = clientUsage.insert(std::make_pair(client,usage)).first;
+    }
+
+    size_t old_bytes = it->second[cat];
+
+    if ( bytes > old_bytes ) {
+        if ( !makeRoom(client,bytes-old_bytes,lock) ) return false;
+        it = clientUsage.find(client); // the map could be changed while it was unlocked
+        old_bytes = it->second[cat];
+    }
+
+    it->second[cat] = bytes;
+    totalUsage = totalUsage - old_bytes + bytes;
+    categoryUsage[cat] = categoryUsage[cat] - old_bytes + bytes;
+
+    return true;
+}
+
+
+bool FitsViewMemoryGovernor::isAvailable(FitsViewMemoryClient *client, size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    return makeRoom(client,bytes,lock);
+}
+
+
+void FitsViewMemoryGovernor::unregisterClient(FitsViewMemoryClient *client)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = clientUsage.find(client);
+    if ( it == clientUsage.end() ) return;
+
+    for ( int i = 0; i < FITS_VIEW_MEMORY_CATEGORIES; ++i ) {
+        totalUsage -= it->second[i];
+        categoryUsage[i] -= it->second[i];
+    }
+
+    clientUsage.erase(it);
+}
+
+
+            /*  PRIVATE METHODS  */
+
+// ask clients to evict caches until 'bytes' fit into the budget. the requesting client is the last one,
+// the displayed pixmaps of the others could be rebinned. the lock is released while clients are called
+// since they update their usage
+bool FitsViewMemoryGovernor::makeRoom(FitsViewMemoryClient *client, size_t bytes, std::unique_lock<std::mutex> &lock)
+{
+    if ( !budget ) return true;
+    if ( totalUsage + bytes <= budget ) return true;
+
+    std::vector<FitsViewMemoryClient*> clients;
+    bool client_is_evictable = false;
+    for ( auto it = clientUsage.begin(); it != clientUsage.end(); ++it ) {
+        if ( !it->second[Cache] && !it->second[ScaledImage] && !it->second[DisplayPixmap] ) continue;
+        if ( it->first == client ) client_is_evictable = true; else clients.push_back(it->first);
+    }
+    if ( client_is_evictable ) clients.push_back(client);
+
+    for ( size_t i = 0; i < clients.size(); ++i ) {
+        size_t need = totalUsage + bytes - budget;
+
+        lock.unlock();
+        clients[i]->evictMemory(need);
+        lock.lock();
+
+        if ( totalUsage + bytes <= budget ) return true;
+    }
+
+    return totalUsage + bytes <= budget;
+}
@@ -0,0 +1,69 @@
+#ifndef FITSVIEWMEMORYGOVERNOR_H
+#define FITSVIEWMEMORYGOVERNOR_H
+
+#include "fitsviewwidget_global.h"
+
+#include<map>
+#include<array>
+#include<mutex>
+#include<cstddef>
+
+#define FITS_VIEW_MEMORY_CATEGORIES 5
+
+
+// a memory owner (e.g. FitsViewWidget instance).
+// evictMemory is called by the governor under memory pressure: the client should free
+// its caches (data which could be recomputed) up to 'bytes' and return number of freed bytes.
+// the client must update its usage (FitsViewMemoryGovernor::setUsage) for the freed memory.
+// the requesting client is asked too (the last one), i.e. evictMemory could be called from
+// inside of its own setUsage call
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewMemoryClient
+{
+public:
+    virtual ~FitsViewMemoryClient();
+
+    virtual size_t evictMemory(size_t bytes) = 0;
+};
+
+
+// memory budget shared by all FitsViewWidget instances of the process
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewMemoryGovernor
+{
+public:
+    enum Category {ImageData, ScaledImage, DisplayPixmap, Cache, Calibration};
+
+    static FitsViewMemoryGovernor* instance();
+
+    void setBudget(size_t bytes); // 0 means unlimited
+    size_t getBudget() const;
+
+    size_t getUsage() const;                                // all clients
+    size_t getUsage(const FitsViewMemoryClient *client) const;
+    size_t getUsage(FitsViewMemoryGovernor::Category cat) const;
+
+    // set number of bytes used by the client in the category.
+    // if the budget would be exceeded, clients are asked to evict their caches first (the requesting one last).
+    // returns false (and the usage is unchanged) if there is still no room for the new value.
+    bool setUsage(FitsViewMemoryClient *client, FitsViewMemoryGovernor::Category cat, size_t bytes);
+
+    // true if 'bytes' could be added to the current usage (after eviction if needed)
+    bool isAvailable(FitsViewMemoryClient *client, size_t bytes);
+
+    void unregisterClient(FitsViewMemoryClient *client);
+
+private:
+    FitsViewMemoryGovernor();
+    FitsViewMemoryGovernor(const FitsViewMemoryGovernor&) = delete;
+    FitsViewMemoryGovernor& operator=(const FitsViewMemoryGovernor&) = delete;
+
+    bool makeRoom(FitsViewMemoryClient *client, size_t bytes, std::unique_lock<std::mutex> &lock);
+
+    mutable std::mutex mutex;
+
+    size_t budget;
+    size_t totalUsage;
+    size_t categoryUsage[FITS_VIEW_MEMORY_CATEGORIES];
+    std::map<FitsViewMemoryClient*, std::array<size_t,FITS_VIEW_MEMORY_CATEGORIES> > clientUsage;
+};
+
+#endif // FITSVIEWMEMORYGOVERNOR_H
@@ -0,0 +1,488 @@
+#include "FitsViewPhotometry.h"
+#include "FitsViewTileCache.h"
+
+#include<QByteArray>
+
+#include<algorithm>
+#include<cmath>
+#include<limits>
+
+#include<fitsio.h>
+
+
+            /*  STRUCTURES  */
+
+FitsViewAperture::FitsViewAperture(double x, double y, double radius, double sky_inner, double sky_outer):
+    x(x), y(y), radius(radius), skyInner(sky_inner), skyOuter(sky_outer)
+{
+}
+
+
+FitsViewApertureMeasurement::FitsViewApertureMeasurement():
+    isValid(false), x(0.0), y(0.0), sky(0.0), skySigma(0.0), skyPixels(0),
+    area(0.0), flux(0.0), fluxError(0.0),
+    mag(std::numeric_limits<double>::quiet_NaN()), magError(std::numeric_limits<double>::quiet_NaN())
+{
+}
+
+
+FitsViewPhotometryFrame::FitsViewPhotometryFrame():
+    index(-1), filename(""), status(0), mjd(std::numeric_limits<double>::quiet_NaN()),
+    measurements(std::vector<FitsViewApertureMeasurement>())
+{
+}
+
+
+            /*  APERTURE PHOTOMETRY  */
+
+// median and robust sigma (1.4826*MAD) of finite pixels in the annulus [inner,outer] around (cx,cy).
+// cx and cy are window coordinates
+static bool annulus_sky(const double *window, size_t w, size_t h, double cx, double cy,
+                        double inner, double outer, double *sky, double *sigma, size_t *npix)
+{
+    long xl = std::max(static_cast<long>(std::floor(cx - outer)),0L);
+    long xr = std::min(static_cast<long>(std::ceil(cx + outer)),static_cast<long>(w)-1);
+    long yl = std::max(static_cast<long>(std::floor(cy - outer)),0L);
+    long yr = std::min(static_cast<long>(std::ceil(cy + outer)),static_cast<long>(h)-1);
+
+    double inner2 = inner*inner;
+    double outer2 = outer*outer;
+
+    std::vector<double> pixels;
+    for ( long y = yl; y <= yr; ++y ) {
+        double dy2 = (y - cy)*(y - cy);
+        for ( long x = xl; x <= xr; ++x ) {
+            double d2 = (x - cx)*(x - cx) + dy2;
+            double v = window[x + y*w];
+            if ( (d2 >= inner2) && (d2 <= outer2) && (v == v) ) pixels.push_back(v);
+        }
+    }
+
+    *npix = pixels.size();
+    if ( pixels.size() < 3 ) return false;
+
+    size_t mid = pixels.size()/2;
+    std::nth_element(pixels.begin(),pixels.begin()+mid,pixels.end());
+    *sky = pixels[mid];
+
+    for ( size_t i = 0; i < pixels.size(); ++i ) pixels[i] = std::abs(pixels[i] - *sky);
+    std::nth_element(pixels.begin(),pixels.begin()+mid,pixels.end());
+    *sigma = 1.4826*pixels[mid];
+
+    return true;
+}
+
+
+// weight of the pixel at distance d from the aperture center (linear over the border pixel)
+static inline double aperture_weight(double d, double radius)
+{
+    return std::min(std::max(radius + 0.5 - d,0.0),1.0);
+}
+
+
+int fits_view_aperture_photometry(const double *window, size_t w, size_t h, size_t x0, size_t y0,
+                                  const FitsViewAperture &aperture, bool recenter, double gain,
+                                  FitsViewApertureMeasurement &result)
+{
+    result = FitsViewApertureMeasurement();
+    result.x = aperture.x;
+    result.y = aperture.y;
+
+    double r = aperture.radius;
+    if ( (r <= 0.0) || (aperture.skyOuter <= aperture.skyInner) || (w == 0) || (h == 0) ) return 1;
+
+    // window coordinates of the center (pixel centers are at integer positions)
+    double cx0 = aperture.x - 1.0 - x0;
+    double cy0 = aperture.y - 1.0 - y0;
+    double cx = cx0, cy = cy0;
+
+    double sky, sigma;
+    size_t nsky;
+
+    if ( !annulus_sky(window,w,h,cx,cy,aperture.skyInner,aperture.skyOuter,&sky,&sigma,&nsky) ) return 1;
+
+    for ( int iter = 0; recenter && (iter < FITS_VIEW_PHOTOMETRY_RECENTER_ITER); ++iter ) {
+        long xl = std::max(static_cast<long>(std::floor(cx - r)),0L);
+        long xr = std::min(static_cast<long>(std::ceil(cx + r)),static_cast<long>(w)-1);
+        long yl = std::max(static_cast<long>(std::floor(cy - r)),0L);
+        long yr = std::min(static_cast<long>(std::ceil(cy + r)),static_cast<long>(h)-1);
+
+        double sum = 0.0, sx = 0.0, sy = 0.0;
+        for ( long y = yl; y <= yr; ++y ) {
+            for ( long x = xl; x <= xr; ++x ) {
+                double v = window[x + y*w] - sky;
+                if ( !(v > 0.0) || (std::hypot(x - cx,y - cy) > r) ) continue; // also NaN
+                sum += v;
+                sx += v*x;
+                sy += v*y;
+            }
+        }
+        if ( sum <= 0.0 ) break;
+
+        double xc = sx/sum, yc = sy/sum;
+        if ( std::hypot(xc - cx0,yc - cy0) > r ) { // it is not the same star
+            cx = cx0, cy = cy0;
+            break;
+        }
+
+        bool converged = std::hypot(xc - cx,yc - cy) < 0.01;
+        cx = xc, cy = yc;
+        if ( converged ) break;
+    }
+
+    if ( (cx != cx0) || (cy != cy0) ) {
+        if ( !annulus_sky(window,w,h,cx,cy,aperture.skyInner,aperture.skyOuter,&sky,&sigma,&nsky) ) return 1;
+    }
+
+    result.x = cx + 1.0 + x0;
+    result.y = cy + 1.0 + y0;
+    result.sky = sky;
+    result.skySigma = sigma;
+    result.skyPixels = nsky;
+
+    // the aperture must be entirely in the window, with no bad pixels
+    long xl = static_cast<long>(std::floor(cx - r - 0.5));
+    long xr = static_cast<long>(std::ceil(cx + r + 0.5));
+    long yl = static_cast<long>(std::floor(cy - r - 0.5));
+    long yr = static_cast<long>(std::ceil(cy + r + 0.5));
+
+    double flux = 0.0, area = 0.0;
+
+    for ( long y = yl; y <= yr; ++y ) {
+        for ( long x = xl; x <= xr; ++x ) {
+            double wgt = aperture_weight(std::hypot(x - cx,y - cy),r);
+            if ( wgt <= 0.0 ) continue;
+
+            if ( (x < 0) || (y < 0) || (x >= static_cast<long>(w)) || (y >= static_cast<long>(h)) ) return 1;
+
+            double v = window[x + y*w];
+            if ( !(v == v) ) return 1;
+
+            flux += wgt*(v - sky);
+            area += wgt;
+        }
+    }
+
+    if ( gain <= 0.0 ) gain = 1.0;
+
+    double var = std::max(flux,0.0)/gain + area*sigma*sigma + area*area*sigma*sigma/nsky;
+
+    result.area = area;
+    result.flux = flux;
+    result.fluxError = std::sqrt(var);
+    if ( flux > 0.0 ) {
+        result.mag = -2.5*std::log10(flux);
+        result.magError = 2.5/std::log(10.0)*result.fluxError/flux;
+    }
+    result.isValid = true;
+
+    return 0;
+}
+
+
+// MJD-OBS or the MJD of DATE-OBS, NaN if there are no keywords
+static double read_fits_mjd(fitsfile *FITS_fptr)
+{
+    int fits_status = 0;
+    double mjd;
+
+    fits_read_key(FITS_fptr, TDOUBLE, FITS_VIEW_MJD_KEY, &mjd, NULL, &fits_status);
+    if ( !fits_status ) return mjd;
+
+    char date[FLEN_VALUE];
+    int year, month, day, hour = 0, minute = 0;
+    double second = 0.0;
+
+    fits_status = 0;
+    fits_read_key(FITS_fptr, TSTRING, FITS_VIEW_DATE_KEY, date, NULL, &fits_status);
+    fits_str2time(date, &year, &month, &day, &hour, &minute, &second, &fits_status);
+    if ( fits_status ) return std::numeric_limits<double>::quiet_NaN();
+
+    // Julian day number of the Gregorian date, MJD = JD - 2400000.5
+    long a = (14 - month)/12;
+    long y = year + 4800 - a;
+    long m = month + 12*a - 3;
+    long jdn = day + (153*m + 2)/5 + 365*y + y/4 - y/100 + y/400 - 32045;
+
+    return jdn - 2400001.0 + (hour + (minute + second/60.0)/60.0)/24.0;
+}
+
+
+            /*  CONSTRUCTOR AND DESTRUCTOR  */
+
+FitsViewBatchPhotometry::FitsViewBatchPhotometry(QObject *parent): QObject(parent),
+    apertures(std::vector<FitsViewAperture>()), workers(0),
+    queueLength(FITS_VIEW_PHOTOMETRY_QUEUE_LENGTH), recenteringIsOn(true), gain(1.0),
+    files(QStringList()),
+    readingIsDone(true), nextFrame(0), frameIsEmitted(false), runningWorkers(0),
+    cancelFlag(false), running(false)
+{
+    qRegisterMetaType<FitsViewPhotometryFrame>("FitsViewPhotometryFrame");
+}
+
+
+FitsViewBatchPhotometry::~FitsViewBatchPhotometry()
+{
+    cancel();
+    join();
+}
+
+
+            /*  PUBLIC METHODS  */
+
+bool FitsViewBatchPhotometry::setApertures(const std::vector<FitsViewAperture> &apertures)
+{
+    if ( running ) return false;
+
+    this->apertures = apertures;
+    return true;
+}
+
+
+bool FitsViewBatchPhotometry::setWorkers(const int nthreads)
+{
+    if ( running || (nthreads < 0) ) return false;
+
+    workers = nthreads;
+    return true;
+}
+
+
+bool FitsViewBatchPhotometry::setQueueLength(const size_t nframes)
+{
+    if ( running || (nframes == 0) ) return false;
+
+    queueLength = nframes;
+    return true;
+}
+
+
+bool FitsViewBatchPhotometry::setRecentering(const bool on)
+{
+    if ( running ) return false;
+
+    recenteringIsOn = on;
+    return true;
+}
+
+
+bool FitsViewBatchPhotometry::setGain(const double gain)
+{
+    if ( running || (gain <= 0.0) ) return false;
+
+    this->gain = gain;
+    return true;
+}
+
+
+bool FitsViewBatchPhotometry::start(const QStringList &fits_filenames)
+{
+    if ( running ) return false;
+
+    join(); // threads of the previous batch
+
+    files = fits_filenames;
+    queue.clear();
+    readingIsDone = false;
+    pendingFrames.clear();
+    nextFrame = 0;
+    frameIsEmitted = false;
+    cancelFlag = false;
+    running = true;
+
+    int nthreads = workers;
+    if ( nthreads == 0 ) nthreads = std::max(std::thread::hardware_concurrency(),1u);
+    runningWorkers = nthreads;
+
+    readerThread = std::thread(&FitsViewBatchPhotometry::readFrames,this);
+    for ( int i = 0; i < nthreads; ++i ) workerThreads.push_back(std::thread(&FitsViewBatchPhotometry::measureFrames,this));
+
+    return true;
+}
+
+
+void FitsViewBatchPhotometry::cancel()
+{
+    cancelFlag = true;
+
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queueIsNotFull.notify_all();
+    queueIsNotEmpty.notify_all();
+}
+
+
+void FitsViewBatchPhotometry::wait()
+{
+    join();
+}
+
+
+bool FitsViewBatchPhotometry::isRunning() const
+{
+    return running;
+}
+
+
+            /*  PRIVATE METHODS  */
+
+// the reader thread: windows of the frames are put to the queue, at most queueLength frames ahead
+void FitsViewBatchPhotometry::readFrames()
+{
+    for ( int i = 0; (i < files.size()) && !cancelFlag; ++i ) {
+        Job job;
+        job.frame.index = i;
+        job.frame.filename = files[i];
+
+        readFrame(job);
+
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueIsNotFull.wait(lock,[this]{ return (queue.size() < queueLength) || cancelFlag; });
+        if ( cancelFlag ) break;
+
+        queue.push_back(std::move(job));
+        queueIsNotEmpty.notify_one();
+    }
+
+    std::lock_guard<std::mutex> lock(queueMutex);
+    readingIsDone = true;
+    queueIsNotEmpty.notify_all();
+}
+
+
+// a worker thread
+void FitsViewBatchPhotometry::measureFrames()
+{
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueIsNotEmpty.wait(lock,[this]{ return !queue.empty() || readingIsDone || cancelFlag; });
+            if ( cancelFlag || queue.empty() ) break;
+
+            job = std::move(queue.front());
+            queue.pop_front();
+            queueIsNotFull.notify_one();
+        }
+
+        FitsViewPhotometryFrame &frame = job.frame;
+        frame.measurements.resize(apertures.size());
+
+        for ( size_t k = 0; k < apertures.size(); ++k ) {
+            FitsViewApertureMeasurement &meas = frame.measurements[k];
+            meas.x = apertures[k].x;
+            meas.y = apertures[k].y;
+
+            if ( frame.status || (k >= job.windows.size()) ) continue;
+
+            const Window &win = job.windows[k];
+            fits_view_aperture_photometry(win.data.data(),win.w,win.h,win.x0,win.y0,
+                                          apertures[k],recenteringIsOn,gain,meas);
+        }
+
+        emitFrame(frame);
+    }
+
+    // the last worker reports the end of the batch (all frames are emitted by then,
+    // the emitting worker is still running). signals are emitted with no lock held
+    std::unique_lock<std::mutex> lock(resultMutex);
+    bool is_last = --runningWorkers == 0;
+    int nframes = nextFrame;
+    if ( is_last ) running = false;
+    lock.unlock();
+
+    if ( is_last ) emit batchIsFinished(nframes,cancelFlag);
+}
+
+
+// only the windows around the apertures are read
+void FitsViewBatchPhotometry::readFrame(Job &job)
+{
+    fitsfile *FITS_fptr;
+    int fits_status = 0;
+    int maxdim = 2;
+    long naxes[2] = {0,0};
+    int naxis, bitpix;
+
+    QByteArray fname = job.frame.filename.trimmed().toLocal8Bit();
+
+    FitsViewCfitsioLock cfitsio_lock; // the widgets read files in the GUI thread
+
+    fits_open_image(&FITS_fptr, fname.data(), READONLY, &fits_status);
+    if ( fits_status ) {
+        job.frame.status = fits_status;
+        return;
+    }
+
+    fits_read_imghdr(FITS_fptr, maxdim, NULL, &bitpix, &naxis, naxes, NULL, NULL, NULL, &fits_status);
+    if ( !fits_status && (naxis < 2) ) fits_status = BAD_DIMEN;
+
+    job.frame.mjd = read_fits_mjd(FITS_fptr);
+    job.windows.resize(apertures.size());
+
+    for ( size_t k = 0; (k < apertures.size()) && !fits_status; ++k ) {
+        const FitsViewAperture &ap = apertures[k];
+
+        // the annulus and the possible shift of recentered aperture
+        double half = std::max(ap.skyOuter,ap.radius + 1.0) + (recenteringIsOn ? ap.radius : 0.0) + 1.0;
+        double cx = ap.x - 1.0;
+        double cy = ap.y - 1.0;
+
+        double xl = std::max(std::floor(cx - half),0.0);
+        double xr = std::min(std::ceil(cx + half),naxes[0] - 1.0);
+        double yl = std::max(std::floor(cy - half),0.0);
+        double yr = std::min(std::ceil(cy + half),naxes[1] - 1.0);
+        if ( (xl > xr) || (yl > yr) ) continue; // off the image
+
+        Window &win = job.windows[k];
+        win.x0 = xl;
+        win.y0 = yl;
+        win.w = xr - xl + 1;
+        win.h = yr - yl + 1;
+        win.data.resize(win.w*win.h);
+
+        long fpixel[2] = {static_cast<long>(xl) + 1, static_cast<long>(yl) + 1};
+        long lpixel[2] = {static_cast<long>(xr) + 1, static_cast<long>(yr) + 1};
+        long inc[2] = {1,1};
+
+        fits_read_subset(FITS_fptr, TDOUBLE, fpixel, lpixel, inc, NULL, (void*) win.data.data(), NULL, &fits_status);
+    }
+
+    int status = 0;
+    fits_close_file(FITS_fptr, &status);
+
+    job.frame.status = fits_status;
+}
+
+
+// frames are emitted in order of the files. only one worker emits at a time and
+// the signal is emitted with no lock held, the other workers just leave their frames
+void FitsViewBatchPhotometry::emitFrame(FitsViewPhotometryFrame &frame)
+{
+    std::unique_lock<std::mutex> lock(resultMutex);
+
+    pendingFrames[frame.index] = std::move(frame);
+    if ( frameIsEmitted ) return;
+
+    frameIsEmitted = true;
+    for ( auto it = pendingFrames.find(nextFrame); it != pendingFrames.end(); it = pendingFrames.find(nextFrame) ) {
+        FitsViewPhotometryFrame next = std::move(it->second);
+        pendingFrames.erase(it);
+        ++nextFrame;
+
+        lock.unlock();
+        emit frameIsMeasured(next);
+        lock.lock();
+    }
+    frameIsEmitted = false;
+}
+
+
+void FitsViewBatchPhotometry::join()
+{
+    if ( readerThread.joinable() ) readerThread.join();
+
+    for ( size_t i = 0; i < workerThreads.size(); ++i ) {
+        if ( workerThreads[i].joinable() ) workerThreads[i].join();
+    }
+    workerThreads.clear();
+}
@@ -0,0 +1,150 @@
+#ifndef FITSVIEWPHOTOMETRY_H
+#define FITSVIEWPHOTOMETRY_H
+
+#include "fitsviewwidget_global.h"
+
+#include<QObject>
+#include<QString>
+#include<QStringList>
+
+#include<vector>
+#include<deque>
+#include<map>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<cstddef>
+
+#define FITS_VIEW_PHOTOMETRY_QUEUE_LENGTH 8 // frames read ahead of the workers
+#define FITS_VIEW_PHOTOMETRY_RECENTER_ITER 3
+#define FITS_VIEW_MJD_KEY "MJD-OBS"
+#define FITS_VIEW_DATE_KEY "DATE-OBS"   // if there is no MJD-OBS
+
+
+// circular aperture with sky annulus (FITS notation, the first pixel is [1,1])
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewAperture
+{
+    FitsViewAperture(double x = 0.0, double y = 0.0, double radius = 5.0, double sky_inner = 8.0, double sky_outer = 12.0);
+
+    double x, y;
+    double radius;
+    double skyInner, skyOuter;
+};
+
+
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewApertureMeasurement
+{
+    FitsViewApertureMeasurement();
+
+    bool isValid;       // false if the aperture is off the image, has bad pixels or the sky is undefined
+
+    double x, y;        // aperture center (after recentering), FITS notation
+    double sky;         // median of the annulus pixels (per pixel)
+    double skySigma;
+    size_t skyPixels;
+    double area;        // effective number of aperture pixels (border pixels are weighted)
+    double flux;        // sky-subtracted sum
+    double fluxError;
+    double mag, magError; // instrumental magnitude -2.5*lg(flux), NaN if flux <= 0
+};
+
+
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewPhotometryFrame
+{
+    FitsViewPhotometryFrame();
+
+    int index;          // in the list of files
+    QString filename;
+    int status;         // CFITSIO status of reading (0 on success)
+    double mjd;         // MJD-OBS (or from DATE-OBS), NaN if unknown
+    std::vector<FitsViewApertureMeasurement> measurements; // in order of apertures
+};
+
+
+// aperture photometry in the row-major window of dimension w*h which starts at
+// the pixel (x0,y0) (0-based) of the image. pixels out of the image must be NaN.
+// recentering moves the aperture to the intensity-weighted centroid (not farther than radius).
+// returns 0 on success, 1 if the measurement is not valid
+int fits_view_aperture_photometry(const double *window, size_t w, size_t h, size_t x0, size_t y0,
+                                  const FitsViewAperture &aperture, bool recenter, double gain,
+                                  FitsViewApertureMeasurement &result);
+
+
+// photometry of the same apertures across a sequence of FITS files.
+// a reader thread reads only the windows around the apertures (fits_read_subset) into
+// a bounded queue, worker threads measure them. frames are emitted by frameIsMeasured()
+// in the order of files (the signal is emitted from a worker thread, so the receiver
+// should use queued connection, the default one for receivers of the GUI thread).
+// if CFITSIO is not built reentrant (fits_is_reentrant() == 0), reading of a frame and
+// reading of files by the widgets are serialised (see FitsViewCfitsioLock)
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewBatchPhotometry: public QObject
+{
+    Q_OBJECT
+
+public:
+    FitsViewBatchPhotometry(QObject *parent = nullptr);
+    ~FitsViewBatchPhotometry();
+
+    // the settings could not be changed while the batch is running (false is returned)
+    bool setApertures(const std::vector<FitsViewAperture> &apertures);
+    bool setWorkers(const int nthreads); // 0 means the number of hardware threads
+    bool setQueueLength(const size_t nframes);
+    bool setRecentering(const bool on);
+    bool setGain(const double gain); // e-/ADU for the flux error
+
+    bool start(const QStringList &fits_filenames); // false if a batch is running
+    void cancel();
+    void wait();
+    bool isRunning() const;
+
+signals:
+    void frameIsMeasured(FitsViewPhotometryFrame frame);
+    void batchIsFinished(int nframes, bool cancelled);
+
+private:
+    struct Window {
+        std::vector<double> data;
+        size_t x0, y0, w, h;
+    };
+
+    struct Job {
+        FitsViewPhotometryFrame frame;
+        std::vector<Window> windows; // per aperture
+    };
+
+    std::vector<FitsViewAperture> apertures;
+    int workers;
+    size_t queueLength;
+    bool recenteringIsOn;
+    double gain;
+
+    QStringList files;
+
+    std::thread readerThread;
+    std::vector<std::thread> workerThreads;
+
+    std::mutex queueMutex;
+    std::condition_variable queueIsNotFull, queueIsNotEmpty;
+    std::deque<Job> queue;
+    bool readingIsDone;
+
+    std::mutex resultMutex;
+    std::map<int,FitsViewPhotometryFrame> pendingFrames; // measured out of order
+    int nextFrame;
+    bool frameIsEmitted; // a worker is emitting the frames in order
+    int runningWorkers;
+
+    std::atomic<bool> cancelFlag;
+    std::atomic<bool> running;
+
+    void readFrames();
+    void measureFrames();
+    void readFrame(Job &job);
+    void emitFrame(FitsViewPhotometryFrame &frame);
+    void join();
+};
+
+Q_DECLARE_METATYPE(FitsViewPhotometryFrame)
+
+#endif // FITSVIEWPHOTOMETRY_H
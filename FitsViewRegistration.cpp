@@ -0,0 +1,223 @@
+#include "FitsViewRegistration.h"
+
+#include<algorithm>
+#include<cmath>
+
+
+// iterative radix-2 FFT. twiddles are exp(-2*pi*i*k/n), k < n/2
+static void fft1d(std::complex<double> *a, size_t n, const std::vector<std::complex<double> > &twiddles, bool inverse)
+{
+    for ( size_t i = 1, j = 0; i < n; ++i ) { // bit-reversal permutation
+        size_t bit = n >> 1;
+        for ( ; j & bit; bit >>= 1 ) j ^= bit;
+        j ^= bit;
+        if ( i < j ) std::swap(a[i],a[j]);
+    }
+
+    for ( size_t len = 2; len <= n; len <<= 1 ) {
+        size_t half = len/2;
+        size_t step = n/len;
+        for ( size_t i = 0; i < n; i += len ) {
+            for ( size_t j = 0; j < half; ++j ) {
+                std::complex<double> w = inverse ? std::conj(twiddles[j*step]) : twiddles[j*step];
+                std::complex<double> u = a[i+j];
+                std::complex<double> v = a[i+j+half]*w;
+                a[i+j] = u + v;
+                a[i+j+half] = u - v;
+            }
+        }
+    }
+}
+
+
+void fits_view_fft2d(std::complex<double> *data, size_t n, bool inverse)
+{
+    if ( n < 2 ) return;
+
+    std::vector<std::complex<double> > twiddles(n/2);
+    for ( size_t k = 0; k < n/2; ++k ) twiddles[k] = std::polar(1.0,-2.0*M_PI*k/n);
+
+    long nn = n;
+
+#pragma omp parallel for
+    for ( long y = 0; y < nn; ++y ) fft1d(data + y*n,n,twiddles,inverse);
+
+#pragma omp parallel
+    {
+        std::vector<std::complex<double> > column(n);
+
+#pragma omp for
+        for ( long x = 0; x < nn; ++x ) {
+            for ( size_t y = 0; y < n; ++y ) column[y] = data[x + y*n];
+            fft1d(column.data(),n,twiddles,inverse);
+            for ( size_t y = 0; y < n; ++y ) data[x + y*n] = column[y];
+        }
+    }
+}
+
+
+void fits_view_registration_spectrum(const double *image, size_t nx, size_t x0, size_t y0, size_t n, size_t bin,
+                                     std::vector<std::complex<double> > &spectrum)
+{
+    std::vector<double> region(n*n);
+    long nn = n;
+
+    // block mean (the pass over all pixels of the region is the most expensive part)
+#pragma omp parallel for
+    for ( long j = 0; j < nn; ++j ) {
+        for ( size_t i = 0; i < n; ++i ) {
+            double sum = 0.0;
+            size_t count = 0;
+            for ( size_t y = y0 + j*bin; y < y0 + (j+1)*bin; ++y ) {
+                const double *row = image + y*nx + x0 + i*bin;
+                for ( size_t x = 0; x < bin; ++x ) {
+                    if ( row[x] == row[x] ) {
+                        sum += row[x];
+                        ++count;
+                    }
+                }
+            }
+            region[j*n + i] = count ? sum/count : std::nan("");
+        }
+    }
+
+    double mean = 0.0;
+    size_t count = 0;
+    for ( size_t i = 0; i < region.size(); ++i ) {
+        if ( region[i] == region[i] ) {
+            mean += region[i];
+            ++count;
+        }
+    }
+    if ( count ) mean /= count;
+
+    std::vector<double> hann(n);
+    for ( size_t i = 0; i < n; ++i ) hann[i] = 0.5 - 0.5*std::cos(2.0*M_PI*i/n);
+
+    spectrum.resize(n*n);
+    for ( size_t j = 0; j < n; ++j ) {
+        for ( size_t i = 0; i < n; ++i ) {
+            double v = region[j*n + i];
+            spectrum[j*n + i] = (v == v) ? (v - mean)*hann[i]*hann[j] : 0.0;
+        }
+    }
+
+    fits_view_fft2d(spectrum.data(),n,false);
+}
+
+
+// sub-pixel position of the peak from the parabola through the neighbours
+static double parabolic_peak(double left, double center, double right)
+{
+    double denom = left - 2.0*center + right;
+
+    return ( denom < 0.0 ) ? 0.5*(left - right)/denom : 0.0;
+}
+
+
+double fits_view_phase_correlation(const std::vector<std::complex<double> > &reference,
+                                   const std::vector<std::complex<double> > &spectrum, size_t n,
+                                   double *dx, double *dy)
+{
+    *dx = 0.0;
+    *dy = 0.0;
+
+    if ( (n < 2) || (reference.size() != n*n) || (spectrum.size() != n*n) ) return 0.0;
+
+    // normalized cross-power spectrum
+    std::vector<std::complex<double> > cross(n*n);
+    long npix = n*n;
+
+#pragma omp parallel for
+    for ( long i = 0; i < npix; ++i ) {
+        std::complex<double> c = spectrum[i]*std::conj(reference[i]);
+        double mod = std::abs(c);
+        cross[i] = ( mod > 0.0 ) ? c/mod : 0.0;
+    }
+
+    fits_view_fft2d(cross.data(),n,true);
+
+    size_t peak = 0;
+    for ( size_t i = 1; i < cross.size(); ++i ) {
+        if ( cross[i].real() > cross[peak].real() ) peak = i;
+    }
+
+    size_t px = peak % n;
+    size_t py = peak / n;
+
+    auto value = [&](size_t x, size_t y) -> double { return cross[(x % n) + (y % n)*n].real(); };
+
+    double sx = px + parabolic_peak(value(px+n-1,py),value(px,py),value(px+1,py));
+    double sy = py + parabolic_peak(value(px,py+n-1),value(px,py),value(px,py+1));
+
+    // the correlation is periodic: the second half of the range is negative shifts
+    *dx = ( sx > n/2 ) ? sx - n : sx;
+    *dy = ( sy > n/2 ) ? sy - n : sy;
+
+    return std::min(std::max(cross[peak].real()/npix,0.0),1.0);
+}
+
+
+// central square region of the image for registration: n*n blocks of bin*bin pixels (n is a power of 2)
+static void registration_geometry(const size_t dim[2], size_t *n, size_t *bin, size_t *x0, size_t *y0)
+{
+    size_t side = std::min(dim[0],dim[1]);
+
+    *n = FITS_VIEW_REGISTRATION_SIZE;
+    while ( (*n > 1) && (*n > side) ) *n /= 2;
+
+    *bin = side / *n;
+    *x0 = (dim[0] - *n * *bin)/2;
+    *y0 = (dim[1] - *n * *bin)/2;
+}
+
+
+void fits_view_registration_reference(const double *image, const size_t dim[2],
+                                      std::vector<std::complex<double> > &coarse,
+                                      std::vector<std::complex<double> > &fine)
+{
+    size_t n, bin, x0, y0;
+    registration_geometry(dim,&n,&bin,&x0,&y0);
+
+    fits_view_registration_spectrum(image,dim[0],x0,y0,n,bin,coarse);
+    fits_view_registration_spectrum(image,dim[0],(dim[0]-n)/2,(dim[1]-n)/2,n,1,fine);
+}
+
+
+double fits_view_register(const double *image, const size_t dim[2],
+                          const std::vector<std::complex<double> > &coarse,
+                          const std::vector<std::complex<double> > &fine,
+                          double *dx, double *dy)
+{
+    size_t n, bin, x0, y0;
+    registration_geometry(dim,&n,&bin,&x0,&y0);
+
+    std::vector<std::complex<double> > spectrum;
+    double sx, sy;
+
+    // coarse offset from the downsampled region
+    fits_view_registration_spectrum(image,dim[0],x0,y0,n,bin,spectrum);
+    double quality = fits_view_phase_correlation(coarse,spectrum,n,&sx,&sy);
+
+    *dx = sx*bin;
+    *dy = sy*bin;
+
+    // refinement at full resolution: the region of the image is moved by the coarse offset
+    if ( bin > 1 ) {
+        long xs = (dim[0]-n)/2 + std::lround(*dx);
+        long ys = (dim[1]-n)/2 + std::lround(*dy);
+
+        if ( (xs >= 0) && (ys >= 0) && (xs + n <= dim[0]) && (ys + n <= dim[1]) ) {
+            fits_view_registration_spectrum(image,dim[0],xs,ys,n,1,spectrum);
+            double fine_quality = fits_view_phase_correlation(fine,spectrum,n,&sx,&sy);
+
+            if ( (std::abs(sx) <= bin) && (std::abs(sy) <= bin) ) { // the residual of the coarse estimate
+                *dx = std::lround(*dx) + sx;
+                *dy = std::lround(*dy) + sy;
+                quality = fine_quality;
+            }
+        }
+    }
+
+    return quality;
+}
@@ -0,0 +1,48 @@
+#ifndef FITSVIEWREGISTRATION_H
+#define FITSVIEWREGISTRATION_H
+
+#include "fitsviewwidget_global.h"
+
+#include<vector>
+#include<complex>
+#include<cstddef>
+
+#define FITS_VIEW_REGISTRATION_SIZE 512 // the largest side of downsampled region (power of 2)
+
+
+// 2D complex FFT of the row-major n*n array in place (n is a power of 2).
+// rows and columns are transformed in parallel. the inverse transform is not normalized
+void fits_view_fft2d(std::complex<double> *data, size_t n, bool inverse);
+
+
+// spectrum of the region [x0, x0 + n*bin) x [y0, y0 + n*bin) (0-based) of the row-major image
+// of width nx: mean of bin x bin blocks, mean subtraction and Hann window (NaNs are the mean).
+// spectrum has n*n elements
+void fits_view_registration_spectrum(const double *image, size_t nx, size_t x0, size_t y0, size_t n, size_t bin,
+                                     std::vector<std::complex<double> > &spectrum);
+
+
+// translation of the image relative to the reference by phase correlation of their spectra
+// (in downsampled pixels, the feature at (x,y) of reference is at (x+dx,y+dy) of the image).
+// returns the correlation peak in [0,1], a measure of the registration quality
+double fits_view_phase_correlation(const std::vector<std::complex<double> > &reference,
+                                   const std::vector<std::complex<double> > &spectrum, size_t n,
+                                   double *dx, double *dy);
+
+
+// spectra of the reference image of size dim: the central region downsampled to at most
+// FITS_VIEW_REGISTRATION_SIZE pixels (coarse) and the central region at full resolution (fine)
+void fits_view_registration_reference(const double *image, const size_t dim[2],
+                                      std::vector<std::complex<double> > &coarse,
+                                      std::vector<std::complex<double> > &fine);
+
+
+// translation of the image (of the reference size) relative to the reference in image pixels:
+// the coarse estimate is refined at full resolution around the moved center. the feature at (x,y)
+// of reference is at (x+dx,y+dy) of the image. returns the registration quality in [0,1]
+double fits_view_register(const double *image, const size_t dim[2],
+                          const std::vector<std::complex<double> > &coarse,
+                          const std::vector<std::complex<double> > &fine,
+                          double *dx, double *dy);
+
+#endif // FITSVIEWREGISTRATION_H
@@ -0,0 +1,183 @@
+#include "FitsViewResample.h"
+
+#include<vector>
+#include<algorithm>
+#include<cmath>
+#include<limits>
+
+
+            /*  FitsViewAffineMap  */
+
+FitsViewAffineMap::FitsViewAffineMap(double x0, double y0, double dxi, double dyi, double dxj, double dyj):
+    x0(x0), y0(y0), dxi(dxi), dyi(dyi), dxj(dxj), dyj(dyj)
+{
+}
+
+
+double FitsViewAffineMap::scale() const
+{
+    return std::max(std::hypot(dxi,dyi),std::hypot(dxj,dyj));
+}
+
+
+            /*  RESAMPLING  */
+
+// bilinear values at n points (x + i*dx, y + i*dy), the positions are clamped to the image.
+// there are no branches, so the loop could be vectorised by compiler
+static void bilinear_row(const double *image, size_t nx, size_t ny,
+                         double x, double y, double dx, double dy, size_t n, double *out)
+{
+    const double xmax = nx - 1.0;
+    const double ymax = ny - 1.0;
+    const long ix_max = ( nx > 1 ) ? nx - 2 : 0; // the last cell of the image
+    const long iy_max = ( ny > 1 ) ? ny - 2 : 0;
+    const size_t sx = ( nx > 1 ) ? 1 : 0;        // offsets of the right and the upper neighbours
+    const size_t sy = ( ny > 1 ) ? nx : 0;
+
+    for ( size_t i = 0; i < n; ++i ) {
+        double xc = std::min(std::max(x + i*dx,0.0),xmax);
+        double yc = std::min(std::max(y + i*dy,0.0),ymax);
+        long ix = std::min(static_cast<long>(xc),ix_max);
+        long iy = std::min(static_cast<long>(yc),iy_max);
+        double fx = xc - ix;
+        double fy = yc - iy;
+
+        const double *p = image + iy*nx + ix;
+        out[i] = (1.0-fy)*((1.0-fx)*p[0] + fx*p[sx]) + fy*((1.0-fx)*p[sy] + fx*p[sy+sx]);
+    }
+}
+
+
+// NaN for the points (x + i*dx, y + i*dy) which are outside the image pixels
+static void outside_to_nan(size_t nx, size_t ny, double x, double y, double dx, double dy, size_t n, double *out)
+{
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const double xmax = nx - 0.5;
+    const double ymax = ny - 0.5;
+
+    for ( size_t i = 0; i < n; ++i ) {
+        double px = x + i*dx;
+        double py = y + i*dy;
+        bool inside = (px >= -0.5) & (px < xmax) & (py >= -0.5) & (py < ymax);
+        out[i] = inside ? out[i] : nan;
+    }
+}
+
+
+void fits_view_resample_bilinear(const double *image, size_t nx, size_t ny,
+                                 const FitsViewAffineMap &map, size_t w, size_t h, double *out)
+{
+    if ( (nx == 0) || (ny == 0) ) return;
+
+    // a minified output pixel covers several image pixels: average a regular grid of samples
+    int nsamples = std::min(std::max(static_cast<int>(std::ceil(map.scale() - 1.0e-6)),1),FITS_VIEW_MAX_SUPERSAMPLING);
+    double norm = 1.0/(nsamples*nsamples);
+    std::vector<double> samples(nsamples > 1 ? w : 0);
+
+    for ( size_t j = 0; j < h; ++j ) {
+        double *row = out + j*w;
+        double x = map.x0 + j*map.dxj;
+        double y = map.y0 + j*map.dyj;
+
+        if ( nsamples == 1 ) {
+            bilinear_row(image,nx,ny,x,y,map.dxi,map.dyi,w,row);
+        } else {
+            std::fill(row,row+w,0.0);
+            for ( int b = 0; b < nsamples; ++b ) {
+                double v = (b + 0.5)/nsamples - 0.5;
+                for ( int a = 0; a < nsamples; ++a ) {
+                    double u = (a + 0.5)/nsamples - 0.5;
+                    bilinear_row(image,nx,ny,x + u*map.dxi + v*map.dxj,y + u*map.dyi + v*map.dyj,
+                                 map.dxi,map.dyi,w,samples.data());
+                    for ( size_t i = 0; i < w; ++i ) row[i] += samples[i];
+                }
+            }
+            for ( size_t i = 0; i < w; ++i ) row[i] *= norm;
+        }
+
+        outside_to_nan(nx,ny,x,y,map.dxi,map.dyi,w,row);
+    }
+}
+
+
+// normalized weights of 2*FITS_VIEW_LANCZOS_RADIUS taps for the fractional positions
+// f = p/FITS_VIEW_LANCZOS_PHASES. the tap k is at the distance f - (k - radius + 1)
+static std::vector<double> lanczos_table()
+{
+    const int radius = FITS_VIEW_LANCZOS_RADIUS;
+    const int ntaps = 2*radius;
+
+    std::vector<double> table((FITS_VIEW_LANCZOS_PHASES+1)*ntaps);
+
+    for ( int p = 0; p <= FITS_VIEW_LANCZOS_PHASES; ++p ) {
+        double f = static_cast<double>(p)/FITS_VIEW_LANCZOS_PHASES;
+        double *weights = table.data() + p*ntaps;
+        double sum = 0.0;
+
+        for ( int k = 0; k < ntaps; ++k ) {
+            double d = M_PI*(f - (k - radius + 1));
+            weights[k] = ( std::abs(d) < 1.0e-9 ) ? 1.0 : radius*std::sin(d)*std::sin(d/radius)/(d*d);
+            sum += weights[k];
+        }
+        for ( int k = 0; k < ntaps; ++k ) weights[k] /= sum;
+    }
+
+    return table;
+}
+
+
+void fits_view_resample_lanczos(const double *image, size_t nx, size_t ny,
+                                const FitsViewAffineMap &map, size_t w, size_t h, double *out)
+{
+    if ( (nx == 0) || (ny == 0) ) return;
+
+    // the kernel is not widened for minification (it would need too many taps)
+    if ( map.scale() > 1.0 + 1.0e-6 ) {
+        fits_view_resample_bilinear(image,nx,ny,map,w,h,out);
+        return;
+    }
+
+    static const std::vector<double> table = lanczos_table(); // initialization is thread-safe
+
+    const long radius = FITS_VIEW_LANCZOS_RADIUS;
+    const long ntaps = 2*radius;
+    const long xmax = nx - 1;
+    const long ymax = ny - 1;
+
+    long xtaps[2*FITS_VIEW_LANCZOS_RADIUS];
+    const double *row_ptr[2*FITS_VIEW_LANCZOS_RADIUS];
+
+    for ( size_t j = 0; j < h; ++j ) {
+        double *row = out + j*w;
+        double x0 = map.x0 + j*map.dxj;
+        double y0 = map.y0 + j*map.dyj;
+
+        for ( size_t i = 0; i < w; ++i ) {
+            double x = x0 + i*map.dxi;
+            double y = y0 + i*map.dyi;
+            double fx = std::floor(x);
+            double fy = std::floor(y);
+            long ix = static_cast<long>(fx);
+            long iy = static_cast<long>(fy);
+
+            // edge pixels are replicated
+            for ( long k = 0; k < ntaps; ++k ) {
+                xtaps[k] = std::min(std::max(ix - radius + 1 + k,0L),xmax);
+                row_ptr[k] = image + std::min(std::max(iy - radius + 1 + k,0L),ymax)*nx;
+            }
+
+            const double *wx = table.data() + std::lround((x - fx)*FITS_VIEW_LANCZOS_PHASES)*ntaps;
+            const double *wy = table.data() + std::lround((y - fy)*FITS_VIEW_LANCZOS_PHASES)*ntaps;
+
+            double sum = 0.0;
+            for ( long m = 0; m < ntaps; ++m ) {
+                double row_sum = 0.0;
+                for ( long k = 0; k < ntaps; ++k ) row_sum += wx[k]*row_ptr[m][xtaps[k]];
+                sum += wy[m]*row_sum;
+            }
+            row[i] = sum;
+        }
+
+        outside_to_nan(nx,ny,x0,y0,map.dxi,map.dyi,w,row);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef FITSVIEWRESAMPLE_H
+#define FITSVIEWRESAMPLE_H
+
+#include "fitsviewwidget_global.h"
+
+#include<cstddef>
+
+#define FITS_VIEW_LANCZOS_RADIUS 3         // Lanczos-3 kernel: 6x6 taps
+#define FITS_VIEW_LANCZOS_PHASES 1024      // tabulated sub-pixel positions of the kernel
+#define FITS_VIEW_MAX_SUPERSAMPLING 4      // the largest number of samples per axis of minified output pixel
+
+
+// affine mapping of the output pixel (i,j) to the source position
+// (x0 + i*dxi + j*dxj, y0 + i*dyi + j*dyj) in 0-based buffer coordinates of pixel centers
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewAffineMap
+{
+    FitsViewAffineMap(double x0 = 0.0, double y0 = 0.0,
+                      double dxi = 1.0, double dyi = 0.0, double dxj = 0.0, double dyj = 1.0);
+
+    double x0, y0;
+    double dxi, dyi; // step along the output row
+    double dxj, dyj; // step along the output column
+
+    double scale() const; // the largest source step per output pixel (> 1 if the image is minified)
+};
+
+
+// bilinear resampling of the row-major image of dimension nx*ny into w*h output pixels.
+// minified output pixels are the mean of up to FITS_VIEW_MAX_SUPERSAMPLING^2 samples.
+// pixels outside the image are replicated from the edge, output pixels whose
+// centers are outside the image are NaN. out must have w*h elements
+void fits_view_resample_bilinear(const double *image, size_t nx, size_t ny,
+                                 const FitsViewAffineMap &map, size_t w, size_t h, double *out);
+
+
+// the same by Lanczos-3 kernel (sharper, but the ringing around stars is possible).
+// minified output is resampled by fits_view_resample_bilinear
+void fits_view_resample_lanczos(const double *image, size_t nx, size_t ny,
+                                const FitsViewAffineMap &map, size_t w, size_t h, double *out);
+
+#endif // FITSVIEWRESAMPLE_H
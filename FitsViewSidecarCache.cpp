@@ -0,0 +1,200 @@
+#include "FitsViewSidecarCache.h"
+
+#include<QFile>
+#include<QSaveFile>
+#include<QFileInfo>
+#include<QDir>
+#include<QDateTime>
+#include<QByteArray>
+#include<QCryptographicHash>
+
+#include<cstring>
+
+
+static const char sidecar_magic[4] = {'F','V','S','C'};
+
+
+template<class T>
+static bool write_value(QIODevice &dev, const T &value)
+{
+    return dev.write(reinterpret_cast<const char*>(&value),sizeof(T)) == sizeof(T);
+}
+
+
+template<class T>
+static bool read_value(QIODevice &dev, T &value)
+{
+    return dev.read(reinterpret_cast<char*>(&value),sizeof(T)) == sizeof(T);
+}
+
+
+static bool write_vector(QIODevice &dev, const std::vector<double> &vec)
+{
+    quint64 n = vec.size();
+    if ( !write_value(dev,n) ) return false;
+
+    qint64 bytes = n*sizeof(double);
+    return (n == 0) || (dev.write(reinterpret_cast<const char*>(vec.data()),bytes) == bytes);
+}
+
+
+static bool read_vector(QIODevice &dev, std::vector<double> &vec, quint64 max_elem)
+{
+    quint64 n;
+    if ( !read_value(dev,n) || (n > max_elem) ) return false;
+
+    vec.resize(n);
+    qint64 bytes = n*sizeof(double);
+    return (n == 0) || (dev.read(reinterpret_cast<char*>(vec.data()),bytes) == bytes);
+}
+
+
+            /*  FitsViewSidecarData  */
+
+FitsViewSidecarData::FitsViewSidecarData():
+    sourceStep(1), minVal(0.0), maxVal(0.0),
+    hasAutocut(false), lowCutSigmas(0.0), highCutSigmas(0.0), sampleLength(0), lowCut(0.0), highCut(0.0),
+    histogram(std::vector<double>()), histogramMin(0.0), histogramStep(1.0),
+    overview(std::vector<double>())
+{
+    overviewDim[0] = 0, overviewDim[1] = 0;
+}
+
+
+            /*  FitsViewSidecarCache  */
+
+FitsViewSidecarCache::FitsViewSidecarCache(const QString &dir):
+    directory(dir)
+{
+}
+
+
+void FitsViewSidecarCache::setDirectory(const QString &dir)
+{
+    directory = dir;
+}
+
+
+QString FitsViewSidecarCache::getDirectory() const
+{
+    return directory;
+}
+
+
+bool FitsViewSidecarCache::isEnabled() const
+{
+    return !directory.isEmpty();
+}
+
+
+bool FitsViewSidecarCache::read(const QString &fits_filename, FitsViewSidecarData &data) const
+{
+    if ( !isEnabled() ) return false;
+
+    QString key = fileKey(fits_filename);
+    if ( key.isEmpty() ) return false;
+
+    QFile file(recordPath(key));
+    if ( !file.open(QIODevice::ReadOnly) ) return false;
+
+    // the header: magic, version and the full key (the record name is its hash only)
+    char magic[4];
+    quint32 version;
+    quint32 key_len;
+
+    if ( (file.read(magic,4) != 4) || std::memcmp(magic,sidecar_magic,4) ) return false;
+    if ( !read_value(file,version) || (version != FITS_VIEW_SIDECAR_VERSION) ) return false;
+
+    QByteArray key_bytes = key.toUtf8();
+    if ( !read_value(file,key_len) || (key_len != static_cast<quint32>(key_bytes.size())) ) return false;
+
+    std::vector<char> stored_key(key_len);
+    if ( (file.read(stored_key.data(),key_len) != key_len) ||
+         std::memcmp(stored_key.data(),key_bytes.constData(),key_len) ) return false;
+
+    quint64 step, sample_len, dim[2];
+    quint8 has_autocut;
+    bool ok = true;
+
+    ok = ok && read_value(file,step) && read_value(file,data.minVal) && read_value(file,data.maxVal);
+    ok = ok && read_value(file,has_autocut) && read_value(file,data.lowCutSigmas) && read_value(file,data.highCutSigmas);
+    ok = ok && read_value(file,sample_len) && read_value(file,data.lowCut) && read_value(file,data.highCut);
+    ok = ok && read_value(file,data.histogramMin) && read_value(file,data.histogramStep);
+    ok = ok && read_vector(file,data.histogram,file.size()/sizeof(double));
+    ok = ok && read_value(file,dim[0]) && read_value(file,dim[1]);
+    ok = ok && read_vector(file,data.overview,file.size()/sizeof(double));
+
+    if ( !ok || (data.overview.size() != dim[0]*dim[1]) ) return false;
+
+    data.sourceStep = step;
+    data.hasAutocut = has_autocut;
+    data.sampleLength = sample_len;
+    data.overviewDim[0] = dim[0];
+    data.overviewDim[1] = dim[1];
+
+    return true;
+}
+
+
+// the record is replaced atomically, so a concurrent reader never sees a partial one
+bool FitsViewSidecarCache::write(const QString &fits_filename, const FitsViewSidecarData &data) const
+{
+    if ( !isEnabled() ) return false;
+
+    QString key = fileKey(fits_filename);
+    if ( key.isEmpty() ) return false;
+
+    if ( !QDir().mkpath(directory) ) return false;
+
+    QSaveFile file(recordPath(key));
+    if ( !file.open(QIODevice::WriteOnly) ) return false;
+
+    QByteArray key_bytes = key.toUtf8();
+    quint32 version = FITS_VIEW_SIDECAR_VERSION;
+    quint32 key_len = key_bytes.size();
+
+    quint64 step = data.sourceStep;
+    quint64 sample_len = data.sampleLength;
+    quint64 dim[2] = {data.overviewDim[0], data.overviewDim[1]};
+    quint8 has_autocut = data.hasAutocut;
+
+    bool ok = file.write(sidecar_magic,4) == 4;
+
+    ok = ok && write_value(file,version) && write_value(file,key_len);
+    ok = ok && (file.write(key_bytes.constData(),key_len) == key_len);
+    ok = ok && write_value(file,step) && write_value(file,data.minVal) && write_value(file,data.maxVal);
+    ok = ok && write_value(file,has_autocut) && write_value(file,data.lowCutSigmas) && write_value(file,data.highCutSigmas);
+    ok = ok && write_value(file,sample_len) && write_value(file,data.lowCut) && write_value(file,data.highCut);
+    ok = ok && write_value(file,data.histogramMin) && write_value(file,data.histogramStep);
+    ok = ok && write_vector(file,data.histogram);
+    ok = ok && write_value(file,dim[0]) && write_value(file,dim[1]);
+    ok = ok && write_vector(file,data.overview);
+
+    return ok && file.commit();
+}
+
+
+QString FitsViewSidecarCache::fileKey(const QString &fits_filename)
+{
+    // "file.fits[1]" or "file.fits[SCI]": the HDU specification is a part of the key
+    QString filename = fits_filename.trimmed();
+    int bracket = filename.indexOf("[");
+    QString path = (bracket < 0) ? filename : filename.left(bracket);
+    QString hdu = (bracket < 0) ? QString() : filename.mid(bracket);
+
+    QFileInfo info(path);
+    if ( !info.exists() ) return QString();
+
+    return info.canonicalFilePath() + "|" + QString::number(info.size()) + "|" +
+           QString::number(info.lastModified().toMSecsSinceEpoch()) + "|" + hdu;
+}
+
+
+            /*  PRIVATE METHODS  */
+
+QString FitsViewSidecarCache::recordPath(const QString &key) const
+{
+    QByteArray hash = QCryptographicHash::hash(key.toUtf8(),QCryptographicHash::Sha1).toHex();
+
+    return QDir(directory).filePath(QString::fromLatin1(hash) + FITS_VIEW_SIDECAR_SUFFIX);
+}
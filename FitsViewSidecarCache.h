@@ -0,0 +1,62 @@
+#ifndef FITSVIEWSIDECARCACHE_H
+#define FITSVIEWSIDECARCACHE_H
+
+#include "fitsviewwidget_global.h"
+
+#include<QString>
+
+#include<vector>
+#include<cstddef>
+
+#define FITS_VIEW_SIDECAR_VERSION 1
+#define FITS_VIEW_SIDECAR_SUFFIX ".fvsc"
+
+
+// derived products of the FITS image which are expensive to recompute.
+// the statistics are computed from every sourceStep-th pixel of the image
+// (1 for the whole image, the overview binning for out-of-core image)
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewSidecarData
+{
+    FitsViewSidecarData();
+
+    size_t sourceStep;
+    double minVal, maxVal;
+
+    bool hasAutocut;
+    double lowCutSigmas, highCutSigmas; // the autocut parameters
+    size_t sampleLength;
+    double lowCut, highCut;
+
+    std::vector<double> histogram; // cumulative one, see FitsViewStretch
+    double histogramMin, histogramStep;
+
+    size_t overviewDim[2]; // every sourceStep-th pixel of the image (if sourceStep > 1)
+    std::vector<double> overview;
+};
+
+
+// on-disk cache of FitsViewSidecarData in a directory.
+// a record is keyed by the canonical path, the size, the modification time of the file
+// and the HDU specification (CFITSIO extended filename syntax), so a changed file is never matched.
+// records are in native byte order (the cache is local to the machine)
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewSidecarCache
+{
+public:
+    FitsViewSidecarCache(const QString &dir = QString()); // empty directory disables the cache
+
+    void setDirectory(const QString &dir);
+    QString getDirectory() const;
+    bool isEnabled() const;
+
+    bool read(const QString &fits_filename, FitsViewSidecarData &data) const;
+    bool write(const QString &fits_filename, const FitsViewSidecarData &data) const;
+
+    static QString fileKey(const QString &fits_filename); // empty if the file does not exist
+
+private:
+    QString directory;
+
+    QString recordPath(const QString &key) const;
+};
+
+#endif // FITSVIEWSIDECARCACHE_H
@@ -0,0 +1,394 @@
+#include "FitsViewStarMeasurement.h"
+
+#include<algorithm>
+#include<cmath>
+#include<limits>
+
+// PSF model parameters:
+//   Gaussian: [background, amplitude, x0, y0, sigma_x, sigma_y]
+//   Moffat:   [background, amplitude, x0, y0, alpha, beta]
+
+static const double GAUSS_SIGMA2FWHM = 2.0*std::sqrt(2.0*std::log(2.0));
+
+
+FitsViewStarMeasurement::FitsViewStarMeasurement():
+    isValid(false), background(0.0), backgroundSigma(0.0),
+    xc(0.0), yc(0.0), peak(0.0), flux(0.0), fwhm(0.0),
+    radialProfile(std::vector<double>()),
+    psfModel(FitsViewStarMeasurement::PSF_GAUSSIAN),
+    fitIsConverged(false), fitIterations(0), fitChi2(0.0),
+    fitBackground(0.0), fitAmplitude(0.0), fitXc(0.0), fitYc(0.0),
+    fitFWHMx(0.0), fitFWHMy(0.0), fitBeta(0.0)
+{
+}
+
+
+// model value and (if grad != nullptr) its partial derivatives with respect to parameters
+static inline double psf_model(const double *pars, double x, double y,
+                               FitsViewStarMeasurement::PSFModel model, double *grad)
+{
+    double dx = x - pars[2];
+    double dy = y - pars[3];
+
+    if ( model == FitsViewStarMeasurement::PSF_MOFFAT ) {
+        double a2 = pars[4]*pars[4];
+        double r2 = dx*dx + dy*dy;
+        double u = 1.0 + r2/a2;
+        double e = std::pow(u,-pars[5]);
+
+        if ( grad != nullptr ) {
+            double q = 2.0*pars[1]*pars[5]*e/u/a2;
+            grad[0] = 1.0;
+            grad[1] = e;
+            grad[2] = q*dx;
+            grad[3] = q*dy;
+            grad[4] = q*r2/pars[4];
+            grad[5] = -pars[1]*e*std::log(u);
+        }
+
+        return pars[0] + pars[1]*e;
+    }
+
+    double sx2 = pars[4]*pars[4];
+    double sy2 = pars[5]*pars[5];
+    double e = std::exp(-0.5*(dx*dx/sx2 + dy*dy/sy2));
+
+    if ( grad != nullptr ) {
+        double g = pars[1]*e;
+        grad[0] = 1.0;
+        grad[1] = e;
+        grad[2] = g*dx/sx2;
+        grad[3] = g*dy/sy2;
+        grad[4] = g*dx*dx/sx2/pars[4];
+        grad[5] = g*dy*dy/sy2/pars[5];
+    }
+
+    return pars[0] + pars[1]*e;
+}
+
+
+// sum of squared residuals over finite pixels. if alpha and beta are not nullptr then
+// normal matrix (J^T*J) and right-hand side (J^T*r) are accumulated too
+static double psf_chi2(const double *image, size_t nx,
+                       size_t xl, size_t yl, size_t xr, size_t yr,
+                       const double *pars, FitsViewStarMeasurement::PSFModel model,
+                       double alpha[][FITS_VIEW_PSF_FIT_NPARS], double *beta)
+{
+    const int np = FITS_VIEW_PSF_FIT_NPARS;
+    double grad[np];
+    double chi2 = 0.0;
+
+    if ( alpha != nullptr ) {
+        for ( int i = 0; i < np; ++i ) {
+            beta[i] = 0.0;
+            for ( int j = 0; j < np; ++j ) alpha[i][j] = 0.0;
+        }
+    }
+
+    for ( size_t y = yl; y <= yr; ++y ) {
+        const double *row = image + y*nx;
+        for ( size_t x = xl; x <= xr; ++x ) {
+            if ( !std::isfinite(row[x]) ) continue;
+
+            double r = row[x] - psf_model(pars,x,y,model,(alpha != nullptr) ? grad : nullptr);
+            chi2 += r*r;
+
+            if ( alpha != nullptr ) {
+                for ( int i = 0; i < np; ++i ) {
+                    beta[i] += grad[i]*r;
+                    for ( int j = 0; j <= i; ++j ) alpha[i][j] += grad[i]*grad[j];
+                }
+            }
+        }
+    }
+
+    if ( alpha != nullptr ) {
+        for ( int i = 0; i < np; ++i ) {
+            for ( int j = i+1; j < np; ++j ) alpha[i][j] = alpha[j][i];
+        }
+    }
+
+    return chi2;
+}
+
+
+// solve symmetric positive-definite system by Cholesky decomposition (in place, no allocations)
+static int cholesky_solve(double a[][FITS_VIEW_PSF_FIT_NPARS], double *b)
+{
+    const int np = FITS_VIEW_PSF_FIT_NPARS;
+
+    for ( int j = 0; j < np; ++j ) {
+        double s = a[j][j];
+        for ( int k = 0; k < j; ++k ) s -= a[j][k]*a[j][k];
+        if ( s <= 0.0 ) return 1;
+        a[j][j] = std::sqrt(s);
+
+        for ( int i = j+1; i < np; ++i ) {
+            s = a[i][j];
+            for ( int k = 0; k < j; ++k ) s -= a[i][k]*a[j][k];
+            a[i][j] = s/a[j][j];
+        }
+    }
+
+    for ( int i = 0; i < np; ++i ) { // L*z = b
+        for ( int k = 0; k < i; ++k ) b[i] -= a[i][k]*b[k];
+        b[i] /= a[i][i];
+    }
+
+    for ( int i = np-1; i >= 0; --i ) { // L^T*x = z
+        for ( int k = i+1; k < np; ++k ) b[i] -= a[k][i]*b[k];
+        b[i] /= a[i][i];
+    }
+
+    return 0;
+}
+
+
+static bool psf_pars_are_valid(const double *pars, FitsViewStarMeasurement::PSFModel model)
+{
+    if ( pars[1] <= 0.0 ) return false;
+    if ( pars[4] <= 0.0 ) return false;
+    if ( model == FitsViewStarMeasurement::PSF_MOFFAT ) return (pars[5] > 0.5) && (pars[5] < 50.0);
+    return pars[5] > 0.0;
+}
+
+
+// Levenberg-Marquardt fit. all work arrays are on the stack
+static bool psf_fit(const double *image, size_t nx,
+                    size_t xl, size_t yl, size_t xr, size_t yr,
+                    FitsViewStarMeasurement::PSFModel model, double *pars,
+                    int *niter, double *chi2)
+{
+    const int np = FITS_VIEW_PSF_FIT_NPARS;
+    const double tol = 1.0E-6;
+
+    double alpha[np][np], a[np][np];
+    double beta[np], delta[np], trial[np];
+    double lambda = 1.0E-3;
+
+    *chi2 = psf_chi2(image,nx,xl,yl,xr,yr,pars,model,alpha,beta);
+
+    for ( *niter = 1; *niter <= FITS_VIEW_PSF_FIT_MAX_ITER; ++(*niter) ) {
+        for ( int i = 0; i < np; ++i ) {
+            for ( int j = 0; j < np; ++j ) a[i][j] = alpha[i][j];
+            a[i][i] *= 1.0 + lambda;
+            delta[i] = beta[i];
+        }
+
+        bool ok = cholesky_solve(a,delta) == 0;
+        if ( ok ) {
+            for ( int i = 0; i < np; ++i ) trial[i] = pars[i] + delta[i];
+            ok = psf_pars_are_valid(trial,model);
+        }
+
+        double new_chi2 = ok ? psf_chi2(image,nx,xl,yl,xr,yr,trial,model,nullptr,nullptr) : 0.0;
+
+        if ( ok && (new_chi2 <= *chi2) ) {
+            bool converged = (*chi2 - new_chi2) <= tol*(*chi2);
+
+            std::copy(trial,trial+np,pars);
+            *chi2 = psf_chi2(image,nx,xl,yl,xr,yr,pars,model,alpha,beta);
+            lambda = std::max(lambda/10.0,1.0E-10);
+
+            if ( converged ) return true;
+        } else {
+            lambda *= 10.0;
+            if ( lambda > 1.0E10 ) return false;
+        }
+    }
+
+    return false;
+}
+
+
+int fits_view_measure_star(const double *image, size_t nx, size_t ny,
+                           size_t xl, size_t yl, size_t xr, size_t yr,
+                           FitsViewStarMeasurement::PSFModel model,
+                           FitsViewStarMeasurement &result)
+{
+    result = FitsViewStarMeasurement();
+    result.psfModel = model;
+
+    if ( xr >= nx ) xr = nx-1;
+    if ( yr >= ny ) yr = ny-1;
+    if ( (xl+2 > xr) || (yl+2 > yr) ) return 1; // too small region
+
+    // background: median and MAD of the region border pixels
+
+    std::vector<double> border;
+    border.reserve(2*(xr-xl+yr-yl+2));
+
+    auto push_finite = [&border](double v) { if ( std::isfinite(v) ) border.push_back(v); };
+
+    for ( size_t x = xl; x <= xr; ++x ) {
+        push_finite(image[x + yl*nx]);
+        push_finite(image[x + yr*nx]);
+    }
+    for ( size_t y = yl+1; y < yr; ++y ) {
+        push_finite(image[xl + y*nx]);
+        push_finite(image[xr + y*nx]);
+    }
+
+    if ( border.size() < FITS_VIEW_STAR_MIN_BORDER_PIXELS ) return 1;
+
+    size_t half = border.size()/2;
+    std::nth_element(border.begin(),border.begin()+half,border.end());
+    result.background = border[half];
+    for ( size_t i = 0; i < border.size(); ++i ) border[i] = std::abs(border[i]-result.background);
+    std::nth_element(border.begin(),border.begin()+half,border.end());
+    result.backgroundSigma = 1.4826*border[half];
+
+    double bg = result.background;
+    double thresh = 3.0*result.backgroundSigma;
+
+    // peak pixel
+
+    size_t xp = xl, yp = yl;
+    size_t npix = 0; // usable (finite) pixels
+    double peak = -std::numeric_limits<double>::infinity();
+    for ( size_t y = yl; y <= yr; ++y ) {
+        const double *row = image + y*nx;
+        for ( size_t x = xl; x <= xr; ++x ) {
+            if ( !std::isfinite(row[x]) ) continue;
+            ++npix;
+            if ( row[x] > peak ) {
+                peak = row[x];
+                xp = x;
+                yp = y;
+            }
+        }
+    }
+
+    if ( npix < FITS_VIEW_STAR_MIN_PIXELS ) return 1;
+
+    result.peak = peak - bg;
+    if ( result.peak <= thresh ) return 1;
+
+    // centroid: iterative weighted mean within a circular window around the current center
+
+    double rad = 0.5*std::min(xr-xl,yr-yl);
+    if ( rad < 2.0 ) rad = 2.0;
+    double rad2 = rad*rad;
+
+    double xc = xp, yc = yp;
+    for ( int iter = 0; iter < 10; ++iter ) {
+        double sw = 0.0, sx = 0.0, sy = 0.0;
+
+        for ( size_t y = yl; y <= yr; ++y ) {
+            const double *row = image + y*nx;
+            double dy2 = (y-yc)*(y-yc);
+            for ( size_t x = xl; x <= xr; ++x ) {
+                double w = row[x] - bg; // NaN is not greater than the threshold
+                if ( (w > thresh) && ((x-xc)*(x-xc) + dy2 <= rad2) ) {
+                    sw += w;
+                    sx += w*x;
+                    sy += w*y;
+                }
+            }
+        }
+
+        if ( sw <= 0.0 ) return 1;
+
+        double dx = sx/sw - xc;
+        double dy = sy/sw - yc;
+        xc += dx;
+        yc += dy;
+
+        if ( (dx*dx + dy*dy) < 1.0E-4 ) break;
+    }
+
+    // radial profile and flux
+
+    double rmax = std::max(std::max(xc-xl,xr-xc),std::max(yc-yl,yr-yc));
+    size_t nbins = static_cast<size_t>(std::ceil(rmax*std::sqrt(2.0))) + 1;
+
+    std::vector<double> bin_r(nbins,0.0), bin_n(nbins,0.0);
+    result.radialProfile.assign(nbins,0.0);
+
+    for ( size_t y = yl; y <= yr; ++y ) {
+        const double *row = image + y*nx;
+        for ( size_t x = xl; x <= xr; ++x ) {
+            if ( !std::isfinite(row[x]) ) continue;
+
+            double v = row[x] - bg;
+            double r = std::sqrt((x-xc)*(x-xc) + (y-yc)*(y-yc));
+            size_t i = static_cast<size_t>(r);
+
+            result.radialProfile[i] += v;
+            bin_r[i] += r;
+            bin_n[i] += 1.0;
+            result.flux += v;
+        }
+    }
+
+    for ( size_t i = 0; i < nbins; ++i ) {
+        if ( bin_n[i] > 0.0 ) {
+            result.radialProfile[i] /= bin_n[i];
+            bin_r[i] /= bin_n[i];
+        } else {
+            bin_r[i] = i + 0.5;
+        }
+    }
+
+    // FWHM: radius where the profile falls to half of the peak
+
+    double hmax = 0.5*result.peak;
+    double prev_r = 0.0, prev_v = result.peak;
+    for ( size_t i = 0; i < nbins; ++i ) {
+        if ( bin_n[i] == 0.0 ) continue;
+        double v = result.radialProfile[i];
+        if ( v <= hmax ) {
+            double r = (prev_v > v) ? prev_r + (prev_v-hmax)/(prev_v-v)*(bin_r[i]-prev_r) : bin_r[i];
+            result.fwhm = 2.0*r;
+            break;
+        }
+        prev_r = bin_r[i];
+        prev_v = v;
+    }
+
+    result.xc = xc + 1.0; // to FITS notation
+    result.yc = yc + 1.0;
+
+    // PSF fit
+
+    double pars[FITS_VIEW_PSF_FIT_NPARS];
+    double fwhm = (result.fwhm > 0.0) ? result.fwhm : 2.0;
+
+    pars[0] = bg;
+    pars[1] = result.peak;
+    pars[2] = xc;
+    pars[3] = yc;
+    if ( model == FitsViewStarMeasurement::PSF_MOFFAT ) {
+        pars[5] = 2.5;
+        pars[4] = 0.5*fwhm/std::sqrt(std::pow(2.0,1.0/pars[5])-1.0);
+    } else {
+        pars[4] = fwhm/GAUSS_SIGMA2FWHM;
+        pars[5] = pars[4];
+    }
+
+    double chi2;
+    result.fitIsConverged = psf_fit(image,nx,xl,yl,xr,yr,model,pars,&result.fitIterations,&chi2);
+
+    double dof = static_cast<double>(npix) - FITS_VIEW_PSF_FIT_NPARS;
+    result.fitChi2 = chi2/dof;
+    if ( result.backgroundSigma > 0.0 ) result.fitChi2 /= result.backgroundSigma*result.backgroundSigma;
+
+    result.fitBackground = pars[0];
+    result.fitAmplitude = pars[1];
+    result.fitXc = pars[2] + 1.0;
+    result.fitYc = pars[3] + 1.0;
+    if ( model == FitsViewStarMeasurement::PSF_MOFFAT ) {
+        result.fitFWHMx = 2.0*pars[4]*std::sqrt(std::pow(2.0,1.0/pars[5])-1.0);
+        result.fitFWHMy = result.fitFWHMx;
+        result.fitBeta = pars[5];
+    } else {
+        result.fitFWHMx = GAUSS_SIGMA2FWHM*pars[4];
+        result.fitFWHMy = GAUSS_SIGMA2FWHM*pars[5];
+    }
+
+    if ( !result.fitIsConverged || !std::isfinite(result.fitChi2) ) return 1;
+
+    result.isValid = true;
+
+    return 0;
+}
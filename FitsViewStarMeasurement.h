@@ -0,0 +1,56 @@
+#ifndef FITSVIEWSTARMEASUREMENT_H
+#define FITSVIEWSTARMEASUREMENT_H
+
+#include "fitsviewwidget_global.h"
+
+#include<vector>
+#include<cstddef>
+
+#define FITS_VIEW_PSF_FIT_MAX_ITER 50
+#define FITS_VIEW_PSF_FIT_NPARS 6
+#define FITS_VIEW_STAR_MIN_BORDER_PIXELS 8 // finite border pixels for the background
+#define FITS_VIEW_STAR_MIN_PIXELS 16       // finite pixels of the region for the PSF fit (> FITS_VIEW_PSF_FIT_NPARS)
+
+
+struct FITSVIEWWIDGETSHARED_EXPORT FitsViewStarMeasurement
+{
+    enum PSFModel {PSF_GAUSSIAN, PSF_MOFFAT};
+
+    FitsViewStarMeasurement();
+
+    bool isValid;         // false if there is no star-like signal, too few usable pixels or the fit did not converge
+
+    // all coordinates are in FITS notation (the first pixel is [1,1])
+
+    double background;    // median of the region border pixels
+    double backgroundSigma;
+
+    double xc, yc;        // intensity-weighted centroid
+    double peak;          // maximal value above the background
+    double flux;          // sum of background-subtracted pixels
+    double fwhm;          // from the radial profile
+
+    std::vector<double> radialProfile; // background-subtracted, one pixel bins from the centroid
+
+    // PSF fit
+    PSFModel psfModel;
+    bool fitIsConverged;
+    int fitIterations;
+    double fitChi2;       // reduced chi-square
+    double fitBackground, fitAmplitude;
+    double fitXc, fitYc;
+    double fitFWHMx, fitFWHMy; // Moffat is circular: fitFWHMx = fitFWHMy
+    double fitBeta;            // Moffat power index (0 for Gaussian)
+};
+
+
+// measure star in the region [xl,xr]x[yl,yr] (inclusive, 0-based buffer indices)
+// of the row-major image of dimension nx*ny. non-finite pixels are skipped
+// (the caller sets masked pixels to NaN).
+// returns 0 on success, 1 if the measurement is not valid (see isValid).
+int fits_view_measure_star(const double *image, size_t nx, size_t ny,
+                           size_t xl, size_t yl, size_t xr, size_t yr,
+                           FitsViewStarMeasurement::PSFModel model,
+                           FitsViewStarMeasurement &result);
+
+#endif // FITSVIEWSTARMEASUREMENT_H
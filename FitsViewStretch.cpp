@@ -0,0 +1,221 @@
+#include "FitsViewStretch.h"
+
+#include<algorithm>
+#include<cmath>
+
+
+FitsViewStretch::FitsViewStretch():
+    type(FitsViewStretch::ST_LINEAR), parameter(0.0),
+    cumulative(std::vector<double>()), histogramMin(0.0), histogramStep(1.0),
+    lut(std::vector<unsigned char>()), lutIsValid(false),
+    lowCut(0.0), highCut(0.0), lutIsInteger(false),
+    levelOffset(0.0), levelScale(0.0)
+{
+}
+
+
+void FitsViewStretch::setType(FitsViewStretch::StretchType type, double parameter)
+{
+    if ( parameter <= 0.0 ) {
+        switch ( type ) {
+            case FitsViewStretch::ST_LOG: parameter = FITS_VIEW_STRETCH_LOG_EXPONENT; break;
+            case FitsViewStretch::ST_POWER: parameter = FITS_VIEW_STRETCH_POWER_EXPONENT; break;
+            case FitsViewStretch::ST_ASINH: parameter = FITS_VIEW_STRETCH_ASINH_SOFTENING; break;
+            default: parameter = 0.0;
+        }
+    }
+
+    this->type = type;
+    this->parameter = parameter;
+
+    lutIsValid = false;
+}
+
+
+FitsViewStretch::StretchType FitsViewStretch::getType() const
+{
+    return type;
+}
+
+
+double FitsViewStretch::getParameter() const
+{
+    return parameter;
+}
+
+
+void FitsViewStretch::computeHistogram(const double *image, size_t n, double min, double max, bool integer,
+                                       const quint64 *mask)
+{
+    size_t nbins = FITS_VIEW_STRETCH_LEVELS;
+
+    if ( integer && (max - min < FITS_VIEW_STRETCH_LEVELS) ) { // a bin per value
+        nbins = static_cast<size_t>(max - min) + 1;
+        histogramMin = min - 0.5;
+        histogramStep = 1.0;
+    } else {
+        histogramMin = min;
+        histogramStep = (max > min) ? (max - min)/nbins : 1.0;
+    }
+
+    std::vector<double> hist(nbins,0.0);
+    double inv_step = 1.0/histogramStep;
+
+    for ( size_t i = 0; i < n; ++i ) {
+        double v = image[i];
+        if ( !(v == v) ) continue;
+        if ( mask && ((mask[i >> 6] >> (i & 63)) & 1) ) continue;
+
+        double p = std::min(std::max((v - histogramMin)*inv_step,0.0),nbins-1.0);
+        hist[static_cast<size_t>(p)] += 1.0;
+    }
+
+    cumulative.assign(nbins+1,0.0);
+    for ( size_t i = 0; i < nbins; ++i ) cumulative[i+1] = cumulative[i] + hist[i];
+
+    lutIsValid = false;
+}
+
+
+void FitsViewStretch::clearHistogram()
+{
+    cumulative.clear();
+    lutIsValid = false;
+}
+
+
+bool FitsViewStretch::hasHistogram() const
+{
+    return !cumulative.empty();
+}
+
+
+void FitsViewStretch::getHistogram(std::vector<double> &cumulative, double *min, double *step) const
+{
+    cumulative = this->cumulative;
+    *min = histogramMin;
+    *step = histogramStep;
+}
+
+
+void FitsViewStretch::setHistogram(const std::vector<double> &cumulative, double min, double step)
+{
+    if ( (cumulative.size() < 2) || !(step > 0.0) ) return;
+
+    this->cumulative = cumulative;
+    histogramMin = min;
+    histogramStep = step;
+
+    lutIsValid = false;
+}
+
+
+void FitsViewStretch::build(double lcut, double hcut, bool integer)
+{
+    integer = integer && (std::ceil(hcut) - std::floor(lcut) < FITS_VIEW_STRETCH_LEVELS);
+
+    if ( lutIsValid && (lcut == lowCut) && (hcut == highCut) && (integer == lutIsInteger) ) return;
+
+    lowCut = lcut;
+    highCut = hcut;
+    lutIsInteger = integer;
+
+    if ( type == FitsViewStretch::ST_LINEAR ) return; // computed directly, no table is needed
+
+    // a constant image (e.g. bias or zero frame) has lcut == hcut, the stretch of (v-lcut)/0 is
+    // undefined: such cuts (or NaN ones) are mapped linearly, i.e. the values above lcut are white
+    if ( !(hcut > lcut) ) {
+        lutIsValid = false;
+        return;
+    }
+
+    double center; // value of the level l is offset + (l + center)/scale
+    size_t nlevels;
+
+    if ( integer ) {
+        levelOffset = std::floor(lcut);
+        levelScale = 1.0;
+        center = 0.0;
+        nlevels = static_cast<size_t>(std::ceil(hcut) - levelOffset) + 1;
+    } else {
+        levelOffset = lcut;
+        levelScale = FITS_VIEW_STRETCH_LEVELS/(hcut - lcut);
+        center = 0.5;
+        nlevels = FITS_VIEW_STRETCH_LEVELS;
+    }
+
+    bool histeq = (type == FitsViewStretch::ST_HISTEQ) && hasHistogram();
+    double rank_low = 0.0, rank_range = 0.0;
+    if ( histeq ) {
+        rank_low = histogramRank(lcut);
+        rank_range = histogramRank(hcut) - rank_low;
+        histeq = rank_range > 0.0;
+    }
+
+    const double max_val = 255.0; // 8-bit indexed image
+    double range = hcut - lcut;
+
+    lut.resize(nlevels);
+    for ( size_t l = 0; l < nlevels; ++l ) {
+        double v = levelOffset + (l + center)/levelScale;
+        double y;
+
+        if ( histeq ) {
+            y = (histogramRank(v) - rank_low)/rank_range;
+        } else {
+            y = stretch(std::min(std::max((v - lcut)/range,0.0),1.0));
+        }
+
+        lut[l] = static_cast<unsigned char>(std::min(std::max(y,0.0),1.0)*max_val + 0.5);
+    }
+
+    lutIsValid = true;
+}
+
+
+void FitsViewStretch::apply(const double *values, size_t n, unsigned char *index) const
+{
+    if ( (type == FitsViewStretch::ST_LINEAR) || !lutIsValid ) { // [lcut,hcut] -> [0,255]
+        const double max_val = 255.0;
+        double scale = max_val/(highCut-lowCut);
+
+        for ( size_t i = 0; i < n; ++i ) {
+            double v = std::min(std::max((values[i]-lowCut)*scale,0.0),max_val);
+            index[i] = static_cast<unsigned char>((v == v) ? v+0.5 : 0.0); // NaN is the lowest level
+        }
+        return;
+    }
+
+    const double max_level = lut.size() - 1.0;
+    const unsigned char *table = lut.data();
+
+    for ( size_t i = 0; i < n; ++i ) {
+        double q = std::min(std::max((values[i]-levelOffset)*levelScale,0.0),max_level);
+        index[i] = (q == q) ? table[static_cast<size_t>(q)] : 0;
+    }
+}
+
+
+double FitsViewStretch::stretch(double x) const
+{
+    switch ( type ) {
+        case FitsViewStretch::ST_LOG: return std::log(parameter*x + 1.0)/std::log(parameter + 1.0);
+        case FitsViewStretch::ST_SQRT: return std::sqrt(x);
+        case FitsViewStretch::ST_POWER: return std::pow(x,parameter);
+        case FitsViewStretch::ST_ASINH: return std::asinh(x/parameter)/std::asinh(1.0/parameter);
+        default: return x;
+    }
+}
+
+
+// number of pixels below the value (linear interpolation within the bin)
+double FitsViewStretch::histogramRank(double value) const
+{
+    double nbins = cumulative.size() - 1.0;
+    double p = std::min(std::max((value - histogramMin)/histogramStep,0.0),nbins);
+
+    size_t i = static_cast<size_t>(p);
+    if ( i >= cumulative.size() - 1 ) return cumulative.back();
+
+    return cumulative[i] + (p - i)*(cumulative[i+1] - cumulative[i]);
+}
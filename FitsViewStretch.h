@@ -0,0 +1,64 @@
+#ifndef FITSVIEWSTRETCH_H
+#define FITSVIEWSTRETCH_H
+
+#include "fitsviewwidget_global.h"
+
+#include<vector>
+#include<cstddef>
+
+#define FITS_VIEW_STRETCH_LEVELS 65536 // pixel values between cuts are quantized to 16 bits
+#define FITS_VIEW_STRETCH_LOG_EXPONENT 1000.0 // log: log(a*x+1)/log(a+1)
+#define FITS_VIEW_STRETCH_POWER_EXPONENT 2.0  // power: x^a
+#define FITS_VIEW_STRETCH_ASINH_SOFTENING 0.1 // asinh: asinh(x/a)/asinh(1/a)
+
+
+// mapping of pixel values between cuts to 8-bit color table indices.
+// non-linear stretches are precomputed into a lookup table for the current cuts,
+// so the conversion of the image is a quantization of value and a table gather.
+// integer pixels are the exact table index if the cuts range is not longer than the table.
+// histogram equalization uses the histogram of the image which is computed once
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewStretch
+{
+public:
+    enum StretchType {ST_LINEAR, ST_LOG, ST_SQRT, ST_POWER, ST_ASINH, ST_HISTEQ};
+
+    FitsViewStretch();
+
+    void setType(StretchType type, double parameter = 0.0); // parameter <= 0 means the default one
+    StretchType getType() const;
+    double getParameter() const;
+
+    // histogram of values in [min,max] (NaNs and masked pixels are skipped)
+    void computeHistogram(const double *image, size_t n, double min, double max, bool integer,
+                          const quint64 *mask = nullptr);
+    void clearHistogram();
+    bool hasHistogram() const;
+
+    // the histogram as number of pixels below bins [min + i*step, min + (i+1)*step) (e.g. to store it)
+    void getHistogram(std::vector<double> &cumulative, double *min, double *step) const;
+    void setHistogram(const std::vector<double> &cumulative, double min, double step);
+
+    // the table for the cuts (it is not rebuilt if nothing was changed)
+    void build(double lcut, double hcut, bool integer);
+
+    // convert values to color table indices. NaN is the lowest level
+    void apply(const double *values, size_t n, unsigned char *index) const;
+
+private:
+    StretchType type;
+    double parameter;
+
+    std::vector<double> cumulative; // histogram: number of pixels below the bin
+    double histogramMin, histogramStep;
+
+    std::vector<unsigned char> lut;
+    bool lutIsValid;
+    double lowCut, highCut;
+    bool lutIsInteger;
+    double levelOffset, levelScale; // level = (value - offset)*scale
+
+    double stretch(double x) const; // [0,1] -> [0,1]
+    double histogramRank(double value) const;
+};
+
+#endif // FITSVIEWSTRETCH_H
@@ -0,0 +1,311 @@
+#include "FitsViewTileCache.h"
+
+#include<algorithm>
+#include<cstring>
+#include<limits>
+#include<new>
+
+
+            /*  CFITSIO LOCK  */
+
+static std::recursive_mutex& cfitsio_mutex()
+{
+    static std::recursive_mutex mutex;
+    return mutex;
+}
+
+
+FitsViewCfitsioLock::FitsViewCfitsioLock(): locked(false)
+{
+    static const bool reentrant = fits_is_reentrant() != 0;
+
+    if ( !reentrant ) {
+        cfitsio_mutex().lock();
+        locked = true;
+    }
+}
+
+
+FitsViewCfitsioLock::~FitsViewCfitsioLock()
+{
+    unlock();
+}
+
+
+void FitsViewCfitsioLock::unlock()
+{
+    if ( locked ) {
+        cfitsio_mutex().unlock();
+        locked = false;
+    }
+}
+
+
+            /*  CONSTRUCTOR AND DESTRUCTOR  */
+
+FitsViewTileCache::FitsViewTileCache(const size_t tile_size, const size_t capacity):
+    FITS_fptr(nullptr), tileSize(tile_size), capacity(capacity), usage(0),
+    tiles(std::unordered_map<size_t,Tile>()), lru(std::list<size_t>())
+{
+    imageDim[0] = 0, imageDim[1] = 0;
+    tilesDim[0] = 0, tilesDim[1] = 0;
+}
+
+
+FitsViewTileCache::~FitsViewTileCache()
+{
+    close();
+}
+
+
+            /*  PUBLIC METHODS  */
+
+int FitsViewTileCache::open(const QString &filename)
+{
+    close();
+
+    int fits_status = 0;
+    int maxdim = 2;
+    long naxes[2] = {0,0};
+    int naxis, bitpix;
+
+    QByteArray fname = filename.trimmed().toLocal8Bit();
+
+    FitsViewCfitsioLock cfitsio_lock;
+
+    fits_open_image(&FITS_fptr, fname.data(), READONLY, &fits_status);
+    if ( fits_status ) {
+        FITS_fptr = nullptr;
+        return fits_status;
+    }
+
+    fits_read_imghdr(FITS_fptr, maxdim, NULL, &bitpix, &naxis, naxes, NULL, NULL, NULL, &fits_status);
+    if ( fits_status ) {
+        close();
+        return fits_status;
+    }
+
+    imageDim[0] = naxes[0];
+    imageDim[1] = naxes[1];
+    tilesDim[0] = (imageDim[0] + tileSize - 1)/tileSize;
+    tilesDim[1] = (imageDim[1] + tileSize - 1)/tileSize;
+
+    return 0;
+}
+
+
+void FitsViewTileCache::close()
+{
+    tiles.clear();
+    lru.clear();
+    usage = 0;
+
+    if ( FITS_fptr ) {
+        FitsViewCfitsioLock cfitsio_lock;
+        int fits_status = 0;
+        fits_close_file(FITS_fptr, &fits_status);
+        FITS_fptr = nullptr;
+    }
+
+    imageDim[0] = 0, imageDim[1] = 0;
+    tilesDim[0] = 0, tilesDim[1] = 0;
+}
+
+
+bool FitsViewTileCache::isOpen() const
+{
+    return FITS_fptr != nullptr;
+}
+
+
+size_t FitsViewTileCache::getWidth() const
+{
+    return imageDim[0];
+}
+
+
+size_t FitsViewTileCache::getHeight() const
+{
+    return imageDim[1];
+}
+
+
+size_t FitsViewTileCache::getTileSize() const
+{
+    return tileSize;
+}
+
+
+void FitsViewTileCache::setCapacity(const size_t bytes)
+{
+    capacity = bytes;
+    shrink(capacity);
+}
+
+
+size_t FitsViewTileCache::getCapacity() const
+{
+    return capacity;
+}
+
+
+size_t FitsViewTileCache::getUsage() const
+{
+    return usage;
+}
+
+
+void FitsViewTileCache::shrink(const size_t bytes)
+{
+    while ( (usage > bytes) && !lru.empty() ) {
+        size_t idx = lru.back();
+        usage -= tileBytes(idx);
+        tiles.erase(idx);
+        lru.pop_back();
+    }
+}
+
+
+const double* FitsViewTileCache::getTile(const size_t tx, const size_t ty, int *status)
+{
+    *status = 0;
+    if ( !FITS_fptr || (tx >= tilesDim[0]) || (ty >= tilesDim[1]) ) {
+        *status = BAD_PIX_NUM;
+        return nullptr;
+    }
+
+    size_t idx = tx + ty*tilesDim[0];
+
+    auto it = tiles.find(idx);
+    if ( it != tiles.end() ) {
+        lru.splice(lru.begin(),lru,it->second.lruPos); // the most recently used now
+        return it->second.data.get();
+    }
+
+    size_t bytes = tileBytes(idx);
+    shrink((capacity > bytes) ? capacity - bytes : 0);
+
+    long fpixel[2] = {static_cast<long>(tx*tileSize + 1), static_cast<long>(ty*tileSize + 1)};
+    long lpixel[2] = {static_cast<long>(std::min((tx+1)*tileSize,imageDim[0])),
+                      static_cast<long>(std::min((ty+1)*tileSize,imageDim[1]))};
+    long inc[2] = {1,1};
+
+    // under memory pressure all cached tiles are dropped and the allocation is retried once
+    Tile tile;
+    for ( int attempt = 0; !tile.data; ++attempt ) {
+        try {
+            tile.data = std::unique_ptr<double[]>(new double[bytes/sizeof(double)]);
+        } catch (std::bad_alloc &ex) {
+            if ( attempt > 0 ) {
+                *status = MEMORY_ALLOCATION;
+                return nullptr;
+            }
+            shrink(0);
+        }
+    }
+
+    {
+        FitsViewCfitsioLock cfitsio_lock;
+        fits_read_subset(FITS_fptr, TDOUBLE, fpixel, lpixel, inc, NULL, (void*) tile.data.get(), NULL, status);
+    }
+    if ( *status ) return nullptr;
+
+    const double *data = tile.data.get();
+    try {
+        lru.push_front(idx);
+        tile.lruPos = lru.begin();
+        tiles[idx] = std::move(tile);
+    } catch (std::bad_alloc &ex) {
+        if ( !lru.empty() && (lru.front() == idx) ) lru.pop_front();
+        tiles.erase(idx);
+        *status = MEMORY_ALLOCATION;
+        return nullptr;
+    }
+    usage += bytes;
+
+    return data;
+}
+
+
+double FitsViewTileCache::getValue(const size_t x, const size_t y, int *status)
+{
+    size_t tx = x/tileSize;
+    size_t ty = y/tileSize;
+
+    const double *tile = getTile(tx,ty,status);
+    if ( *status ) return std::numeric_limits<double>::quiet_NaN();
+
+    size_t tile_width = std::min((tx+1)*tileSize,imageDim[0]) - tx*tileSize;
+
+    return tile[(x - tx*tileSize) + (y - ty*tileSize)*tile_width];
+}
+
+
+int FitsViewTileCache::getRegion(const size_t xl, const size_t yl, const size_t xr, const size_t yr, double *region)
+{
+    if ( (xr >= imageDim[0]) || (yr >= imageDim[1]) || (xl > xr) || (yl > yr) ) return BAD_PIX_NUM;
+
+    int status = 0;
+    size_t width = xr - xl + 1;
+
+    for ( size_t ty = yl/tileSize; ty <= yr/tileSize; ++ty ) {
+        for ( size_t tx = xl/tileSize; tx <= xr/tileSize; ++tx ) {
+            const double *tile = getTile(tx,ty,&status);
+            if ( status ) return status;
+
+            size_t tile_x0 = tx*tileSize;
+            size_t tile_y0 = ty*tileSize;
+            size_t tile_width = std::min(tile_x0 + tileSize,imageDim[0]) - tile_x0;
+
+            // intersection of the tile and the region
+            size_t x0 = std::max(xl,tile_x0);
+            size_t x1 = std::min(xr,tile_x0 + tileSize - 1);
+            size_t y0 = std::max(yl,tile_y0);
+            size_t y1 = std::min(yr,tile_y0 + tileSize - 1);
+
+            for ( size_t y = y0; y <= y1; ++y ) {
+                std::memcpy(region + (y-yl)*width + (x0-xl),
+                            tile + (y-tile_y0)*tile_width + (x0-tile_x0),
+                            (x1-x0+1)*sizeof(double));
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+int FitsViewTileCache::readDecimated(const size_t step, std::vector<double> &image, size_t dim[2])
+{
+    if ( !FITS_fptr ) return BAD_PIX_NUM;
+
+    int status = 0;
+
+    dim[0] = (imageDim[0] + step - 1)/step;
+    dim[1] = (imageDim[1] + step - 1)/step;
+
+    long fpixel[2] = {1,1};
+    long lpixel[2] = {static_cast<long>(imageDim[0]), static_cast<long>(imageDim[1])};
+    long inc[2] = {static_cast<long>(step), static_cast<long>(step)};
+
+    image.resize(dim[0]*dim[1]);
+
+    FitsViewCfitsioLock cfitsio_lock;
+    fits_read_subset(FITS_fptr, TDOUBLE, fpixel, lpixel, inc, NULL, (void*) image.data(), NULL, &status);
+
+    return status;
+}
+
+
+            /*  PRIVATE METHODS  */
+
+size_t FitsViewTileCache::tileBytes(const size_t idx) const
+{
+    size_t tx = idx % tilesDim[0];
+    size_t ty = idx / tilesDim[0];
+
+    size_t w = std::min((tx+1)*tileSize,imageDim[0]) - tx*tileSize;
+    size_t h = std::min((ty+1)*tileSize,imageDim[1]) - ty*tileSize;
+
+    return w*h*sizeof(double);
+}
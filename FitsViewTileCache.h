@@ -0,0 +1,98 @@
+#ifndef FITSVIEWTILECACHE_H
+#define FITSVIEWTILECACHE_H
+
+#include "fitsviewwidget_global.h"
+
+#include<QString>
+
+#include<list>
+#include<unordered_map>
+#include<memory>
+#include<vector>
+#include<mutex>
+#include<cstddef>
+
+#include<fitsio.h>
+
+#define FITS_VIEW_DEFAULT_TILE_CACHE_SIZE 268435456 // 256 MBytes
+
+
+// CFITSIO calls from different threads (the batch photometry reads its frames in its own
+// thread) are serialised by this lock if CFITSIO is not built reentrant (fits_is_reentrant() == 0),
+// otherwise the lock does nothing. the lock is recursive, it is released by destructor or unlock()
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewCfitsioLock
+{
+public:
+    FitsViewCfitsioLock();
+    ~FitsViewCfitsioLock();
+
+    void unlock();
+
+private:
+    bool locked;
+
+    FitsViewCfitsioLock(const FitsViewCfitsioLock&) = delete;
+    FitsViewCfitsioLock& operator=(const FitsViewCfitsioLock&) = delete;
+};
+
+
+// out-of-core access to 2D FITS image: square tiles of the image are read
+// by fits_read_subset on demand and kept in a bounded LRU cache.
+// the image is never read entirely into memory.
+// all methods return CFITSIO status (0 on success), MEMORY_ALLOCATION if a tile
+// cannot be allocated even after all cached tiles are dropped.
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewTileCache
+{
+public:
+    FitsViewTileCache(const size_t tile_size, const size_t capacity = FITS_VIEW_DEFAULT_TILE_CACHE_SIZE);
+    ~FitsViewTileCache();
+
+    int open(const QString &filename);
+    void close();
+    bool isOpen() const;
+
+    size_t getWidth() const;
+    size_t getHeight() const;
+    size_t getTileSize() const;
+
+    void setCapacity(const size_t bytes);
+    size_t getCapacity() const;
+    size_t getUsage() const; // bytes
+
+    void shrink(const size_t bytes); // drop the least recently used tiles until the usage is not greater than bytes
+
+    // tile (tx,ty) covers pixels [tx*tile_size, (tx+1)*tile_size) (clipped at the image edges),
+    // the row length of returned data is tile width. the pointer is valid until the next call
+    // of the non-const methods
+    const double* getTile(const size_t tx, const size_t ty, int *status);
+
+    // 0-based pixel coordinates, NaN on error
+    double getValue(const size_t x, const size_t y, int *status);
+
+    // copy region [xl,xr]x[yl,yr] (inclusive, 0-based) into row-major 'region'
+    int getRegion(const size_t xl, const size_t yl, const size_t xr, const size_t yr, double *region);
+
+    // every step-th pixel in both directions, read directly from the file (not cached)
+    int readDecimated(const size_t step, std::vector<double> &image, size_t dim[2]);
+
+private:
+    struct Tile {
+        std::unique_ptr<double[]> data;
+        std::list<size_t>::iterator lruPos;
+    };
+
+    fitsfile *FITS_fptr;
+    size_t imageDim[2];
+    size_t tilesDim[2];
+    size_t tileSize;
+
+    size_t capacity;
+    size_t usage;
+
+    std::unordered_map<size_t,Tile> tiles;
+    std::list<size_t> lru; // the most recently used tile is at the front
+
+    size_t tileBytes(const size_t idx) const;
+};
+
+#endif // FITSVIEWTILECACHE_H
@@ -1,21 +1,35 @@
 #include "FitsViewWidget.h"
+#include "FitsViewTileCache.h"
 
 #include<random>
+#include<functional>
 #include<algorithm>
 #include<cmath>
+#include<limits>
 
 #include<QImage>
+#include<QPainter>
 #include<QDebug>
 #include<QPointF>
 #include<QVBoxLayout>
+#include<QElapsedTimer>
 
 #include<fitsio.h>
 
+#ifdef Q_OS_UNIX
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
 static void random_sample(std::vector<double> &sample, size_t max_nelem)
 {
+    if ( sample.size() <= max_nelem ) return;
+
     std::random_device rd;
     std::mt19937 gen(rd());
-    std::uniform_int_distribution<size_t> dis(0, sample.size());
+    std::uniform_int_distribution<size_t> dis(0, sample.size()-1);
 
     std::vector<double> new_sample;
 
@@ -108,20 +122,474 @@ static int robust_sigma(std::vector<double> &sample, double *sigma, double *medi
 }
 
 
+// pixel accessors for line_profile
+struct BufferPixels {
+    const double *image;
+    size_t width;
+    double operator()(size_t x, size_t y) const { return image[x + y*width]; }
+};
+
+// the last used tile is kept, so the taps of neighbouring samples do not look up the cache.
+// after the first error (CFITSIO status is kept) the cache is not read, the pixels are NaN
+struct CachedPixels {
+    FitsViewTileCache *cache;
+    mutable const double *tile;
+    mutable size_t tx, ty, width;
+    mutable int status;
+
+    double operator()(size_t x, size_t y) const {
+        size_t n = cache->getTileSize();
+        if ( !tile || (x/n != tx) || (y/n != ty) ) {
+            if ( status ) return std::numeric_limits<double>::quiet_NaN();
+            tx = x/n, ty = y/n;
+            tile = cache->getTile(tx,ty,&status);
+            if ( status ) {
+                tile = nullptr;
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+            width = std::min((tx+1)*n,cache->getWidth()) - tx*n;
+        }
+        return tile[(x - tx*n) + (y - ty*n)*width];
+    }
+};
+
+
+// sample image along the line (x0,y0)-(x1,y1) with unit step.
+// coordinates are buffer indices (integer coordinate is at the center of pixel).
+// the profile is averaged over 'width' parallel lines (unit spacing, perpendicular to the line).
+// 'profile' must have at least 'nsamples' elements, nothing is allocated here
+template<class Pixels>
+static void line_profile(const Pixels &image, const size_t dim[2],
+                         double x0, double y0, double x1, double y1,
+                         int width, bool bilinear, double *profile, size_t nsamples)
+{
+    const double xmax = dim[0]-1.0;
+    const double ymax = dim[1]-1.0;
+
+    double dx = x1-x0;
+    double dy = y1-y0;
+    double len = std::sqrt(dx*dx+dy*dy);
+
+    double sx = (nsamples > 1) ? dx/(nsamples-1) : 0.0;
+    double sy = (nsamples > 1) ? dy/(nsamples-1) : 0.0;
+
+    // unit vector perpendicular to the line
+    double px = 0.0, py = 0.0;
+    if ( len > 0.0 ) {
+        px = -dy/len;
+        py = dx/len;
+    }
+
+    if ( (dim[0] < 2) || (dim[1] < 2) ) bilinear = false;
+
+    std::fill(profile,profile+nsamples,0.0);
+
+    for ( int k = 0; k < width; ++k ) {
+        double off = k - 0.5*(width-1);
+        double xs = x0 + off*px;
+        double ys = y0 + off*py;
+
+        if ( bilinear ) {
+            for ( size_t i = 0; i < nsamples; ++i ) {
+                double x = std::min(std::max(xs + i*sx,0.0),xmax);
+                double y = std::min(std::max(ys + i*sy,0.0),ymax);
+
+                // the upper-right node is clamped to the last but one pixel
+                size_t ix = std::min(static_cast<size_t>(x),dim[0]-2);
+                size_t iy = std::min(static_cast<size_t>(y),dim[1]-2);
+                double tx = x - ix;
+                double ty = y - iy;
+
+                double p00 = image(ix,iy), p10 = image(ix+1,iy);
+                double p01 = image(ix,iy+1), p11 = image(ix+1,iy+1);
+                double v0 = p00 + tx*(p10-p00);
+                double v1 = p01 + tx*(p11-p01);
+
+                profile[i] += v0 + ty*(v1-v0);
+            }
+        } else {
+            for ( size_t i = 0; i < nsamples; ++i ) {
+                double x = std::min(std::max(xs + i*sx,0.0),xmax);
+                double y = std::min(std::max(ys + i*sy,0.0),ymax);
+
+                size_t ix = static_cast<size_t>(x+0.5);
+                size_t iy = static_cast<size_t>(y+0.5);
+
+                profile[i] += image(ix,iy);
+            }
+        }
+    }
+
+    if ( width > 1 ) {
+        double norm = 1.0/width;
+        for ( size_t i = 0; i < nsamples; ++i ) profile[i] *= norm;
+    }
+}
+
+
+// exposure time from the header of opened file, 0 if the keyword is absent
+static double read_fits_exptime(fitsfile *FITS_fptr)
+{
+    int fits_status = 0;
+    double exptime = 0.0;
+
+    fits_read_key(FITS_fptr, TDOUBLE, FITS_VIEW_EXPTIME_KEY, &exptime, NULL, &fits_status);
+
+    return fits_status ? 0.0 : exptime;
+}
+
+
+// rotation (degrees, counter-clockwise) and flip which put north up and east left from the WCS
+// of the opened file: CDi_j matrix or CDELTi with PCi_j or CROTA2. returns false if there is no WCS
+static bool read_fits_north(fitsfile *FITS_fptr, double *angle, bool *flip)
+{
+    const char *cd_keys[4] = {"CD1_1","CD1_2","CD2_1","CD2_2"};
+    const char *pc_keys[4] = {"PC1_1","PC1_2","PC2_1","PC2_2"};
+    double cd[4] = {0.0, 0.0, 0.0, 0.0}; // missing elements are 0
+    double value;
+    bool has_cd = false;
+
+    for ( int i = 0; i < 4; ++i ) {
+        int fits_status = 0;
+        fits_read_key(FITS_fptr, TDOUBLE, cd_keys[i], &value, NULL, &fits_status);
+        if ( !fits_status ) {
+            cd[i] = value;
+            has_cd = true;
+        }
+    }
+
+    if ( !has_cd ) {
+        int fits_status = 0;
+        double cdelt[2];
+        fits_read_key(FITS_fptr, TDOUBLE, "CDELT1", &cdelt[0], NULL, &fits_status);
+        fits_read_key(FITS_fptr, TDOUBLE, "CDELT2", &cdelt[1], NULL, &fits_status);
+        if ( fits_status ) return false;
+
+        double pc[4] = {1.0, 0.0, 0.0, 1.0};
+        bool has_pc = false;
+
+        for ( int i = 0; i < 4; ++i ) {
+            fits_status = 0;
+            fits_read_key(FITS_fptr, TDOUBLE, pc_keys[i], &value, NULL, &fits_status);
+            if ( !fits_status ) {
+                pc[i] = value;
+                has_pc = true;
+            }
+        }
+
+        if ( has_pc ) {
+            for ( int i = 0; i < 4; ++i ) cd[i] = cdelt[i/2]*pc[i];
+        } else {
+            double crota = 0.0;
+            fits_status = 0;
+            fits_read_key(FITS_fptr, TDOUBLE, "CROTA2", &crota, NULL, &fits_status);
+
+            double c = std::cos(crota*M_PI/180.0);
+            double s = std::sin(crota*M_PI/180.0);
+            cd[0] = cdelt[0]*c, cd[1] = -cdelt[1]*s;
+            cd[2] = cdelt[0]*s, cd[3] = cdelt[1]*c;
+        }
+    }
+
+    double det = cd[0]*cd[3] - cd[1]*cd[2];
+    if ( (det == 0.0) || (det != det) ) return false;
+
+    // north in pixels is the inverse CD applied to (0,1). east is on the right
+    // of north for the positive determinant, so the image is mirrored
+    double north_x = -cd[1]/det;
+    double north_y = cd[0]/det;
+
+    *flip = det > 0.0;
+    if ( *flip ) north_x = -north_x;
+    *angle = 90.0 - std::atan2(north_y,north_x)*180.0/M_PI;
+
+    return true;
+}
+
+
+// read 2D image or a plane of 3D cube (planes start from 1). 'reserve' is called with the image
+// dimensions before the buffer is allocated (the memory budget), its non-zero result is returned.
+// returns CFITSIO status, std::bad_alloc is propagated to the caller
+static int read_fits_image(const QString &filename, const long plane, std::unique_ptr<double[]> &buffer, size_t dim[2],
+                           double *exptime = nullptr, const std::function<int(size_t,size_t)> &reserve = nullptr)
+{
+    fitsfile *FITS_fptr;
+    int fits_status = 0;
+
+    const int maxdim = 3;
+    long naxes[maxdim] = {1,1,1};
+    int naxis, bitpix;
+
+    QByteArray fname = filename.trimmed().toLocal8Bit();
+
+    FitsViewCfitsioLock cfitsio_lock;
+
+    fits_open_image(&FITS_fptr, fname.data(), READONLY, &fits_status);
+    if ( fits_status ) return fits_status;
+
+    fits_read_imghdr(FITS_fptr, maxdim, NULL, &bitpix, &naxis, naxes, NULL, NULL, NULL, &fits_status);
+    if ( !fits_status && ((plane < 1) || (plane > naxes[2])) ) fits_status = BAD_PIX_NUM;
+    if ( !fits_status && exptime ) *exptime = read_fits_exptime(FITS_fptr);
+    if ( !fits_status && reserve ) fits_status = reserve(naxes[0],naxes[1]);
+
+    if ( !fits_status ) {
+        size_t nelem = naxes[0]*naxes[1];
+        long fpixel[maxdim] = {1,1,plane};
+
+        try {
+            buffer = std::unique_ptr<double[]>(new double[nelem]);
+        } catch (std::bad_alloc &ex) {
+            fits_close_file(FITS_fptr, &fits_status);
+            throw;
+        }
+
+        fits_read_pix(FITS_fptr, TDOUBLE, fpixel, nelem, NULL, (void*) buffer.get(), NULL, &fits_status);
+
+        dim[0] = naxes[0];
+        dim[1] = naxes[1];
+    }
+
+    int status = 0;
+    fits_close_file(FITS_fptr, &status);
+
+    return fits_status ? fits_status : status;
+}
+
+
+// bit idx of packed bad pixel mask
+static inline bool is_masked(const quint64 *mask, size_t idx)
+{
+    return (mask[idx >> 6] >> (idx & 63)) & 1;
+}
+
+
+// dst = (src - bias - dark_scale*dark)*inv_flat and min/max of the result in the same pass.
+// src may be of any pixel type (the conversion is fused) and may coincide with dst.
+// NaNs and masked pixels are not counted in min/max.
+// absent frames and mask are excluded at compile time, so the loop body has no branches.
+// if !STORE only min/max of src are computed
+template<class T, bool BIAS, bool DARK, bool FLAT, bool MASK, bool STORE>
+static void calibrate_pass(const T *src, double *dst, size_t n, const double *bias, const double *dark, double dark_scale,
+                           const double *inv_flat, const quint64 *mask, double *min_val, double *max_val)
+{
+    double vmin = std::numeric_limits<double>::max();
+    double vmax = -std::numeric_limits<double>::max();
+    long nn = n;
+
+#pragma omp parallel for reduction(min:vmin) reduction(max:vmax)
+    for ( long i = 0; i < nn; ++i ) {
+        double v = static_cast<double>(src[i]);
+        if ( BIAS ) v -= bias[i];
+        if ( DARK ) v -= dark_scale*dark[i];
+        if ( FLAT ) v *= inv_flat[i];
+        if ( STORE ) dst[i] = v;
+        if ( MASK ) {
+            bool bad = is_masked(mask,i);
+            vmin = std::min(vmin,bad ? vmin : v);
+            vmax = std::max(vmax,bad ? vmax : v);
+        } else {
+            vmin = std::min(vmin,v); // NaN is never less or greater, so it is skipped
+            vmax = std::max(vmax,v);
+        }
+    }
+
+    *min_val = vmin;
+    *max_val = vmax;
+}
+
+
+template<class T, bool MASK>
+static void calibrate_image(const T *src, double *dst, size_t n, const double *bias, const double *dark, double dark_scale,
+                            const double *inv_flat, const quint64 *mask, double *min_val, double *max_val)
+{
+    if ( dst == nullptr ) {
+        calibrate_pass<T,false,false,false,MASK,false>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val);
+        return;
+    }
+
+    int mode = (bias ? 1 : 0) | (dark ? 2 : 0) | (inv_flat ? 4 : 0);
+
+    switch ( mode ) {
+    case 0: calibrate_pass<T,false,false,false,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    case 1: calibrate_pass<T,true,false,false,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    case 2: calibrate_pass<T,false,true,false,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    case 3: calibrate_pass<T,true,true,false,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    case 4: calibrate_pass<T,false,false,true,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    case 5: calibrate_pass<T,true,false,true,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    case 6: calibrate_pass<T,false,true,true,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val); break;
+    default: calibrate_pass<T,true,true,true,MASK,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val);
+    }
+}
+
+
+// nullptr frame is not applied. dst == nullptr: min/max of src only (the frames are ignored)
+template<class T>
+static void calibrate_image(const T *src, double *dst, size_t n, const double *bias, const double *dark, double dark_scale,
+                            const double *inv_flat, const quint64 *mask, double *min_val, double *max_val)
+{
+    if ( mask ) {
+        calibrate_image<T,true>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val);
+    } else {
+        calibrate_image<T,false>(src,dst,n,bias,dark,dark_scale,inv_flat,mask,min_val,max_val);
+    }
+}
+
+
+// map POSIX shared memory segment read-only. returns nullptr on failure
+static void* map_shared_memory(const QString &name, size_t *size)
+{
+#ifdef Q_OS_UNIX
+    QByteArray shm_name = name.trimmed().toLocal8Bit();
+
+    int fd = shm_open(shm_name.data(), O_RDONLY, 0);
+    if ( fd < 0 ) return nullptr;
+
+    struct stat st;
+    if ( (fstat(fd,&st) != 0) || (st.st_size <= 0) ) {
+        close(fd);
+        return nullptr;
+    }
+
+    *size = st.st_size;
+    void *mapping = mmap(nullptr, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping stays valid
+
+    return ( mapping == MAP_FAILED ) ? nullptr : mapping;
+#else
+    Q_UNUSED(name);
+    Q_UNUSED(size);
+    return nullptr;
+#endif
+}
+
+
+static void unmap_shared_memory(void *mapping, size_t size)
+{
+#ifdef Q_OS_UNIX
+    munmap(mapping,size);
+#else
+    Q_UNUSED(mapping);
+    Q_UNUSED(size);
+#endif
+}
+
+
+// every n-th element of buffer, so sample has at most max_nelem elements.
+// NaNs and masked pixels are skipped
+static void strided_sample(const double *buffer, size_t npix, size_t max_nelem, std::vector<double> &sample,
+                           const quint64 *mask = nullptr)
+{
+    size_t step = npix/max_nelem + 1;
+
+    sample.clear();
+    sample.reserve(npix/step + 1);
+    for ( size_t i = 0; i < npix; i += step ) {
+        if ( (buffer[i] == buffer[i]) && !(mask && is_masked(mask,i)) ) sample.push_back(buffer[i]);
+    }
+}
+
+
+// color table by linear interpolation between nodes {position in [0,255], red, green, blue}.
+// the first node is at 0 and the last one is at 255
+static void interpolate_color_table(const int nodes[][4], int nnodes, QVector<QRgb> &ct)
+{
+    qreal ct_step = 255.0/(ct.size()-1);
+    int k = 0;
+
+    for ( int i = 0; i < ct.size(); ++i ) {
+        qreal pos = i*ct_step;
+        while ( (k < nnodes-2) && (pos > nodes[k+1][0]) ) ++k;
+
+        qreal t = (pos - nodes[k][0])/(nodes[k+1][0] - nodes[k][0]);
+        int rgb[3];
+        for ( int c = 0; c < 3; ++c ) rgb[c] = static_cast<int>(nodes[k][c+1] + t*(nodes[k+1][c+1] - nodes[k][c+1]) + 0.5);
+
+        ct[i] = qRgb(rgb[0],rgb[1],rgb[2]);
+    }
+}
+
+
+// width and height of the bounding box of the image rotated by angle (degrees)
+static void rotated_extent(const size_t dim[2], double angle, double *w, double *h)
+{
+    double c = std::abs(std::cos(angle*M_PI/180.0));
+    double s = std::abs(std::sin(angle*M_PI/180.0));
+
+    *w = dim[0]*c + dim[1]*s;
+    *h = dim[0]*s + dim[1]*c;
+}
+
+
+// the color over the pixel with the color's alpha
+static inline QRgb blend_rgb(QRgb pixel, QRgb color)
+{
+    int a = qAlpha(color);
+
+    return qRgba((qRed(color)*a + qRed(pixel)*(255-a))/255,
+                 (qGreen(color)*a + qGreen(pixel)*(255-a))/255,
+                 (qBlue(color)*a + qBlue(pixel)*(255-a))/255,
+                 qAlpha(pixel));
+}
+
+
+// blend three channels into ARGB32 pixels taking every step-th input pixel.
+// lcut and scale (255/(hcut-lcut)) are per channel.
+// there are no branches, so the loop is vectorised by compiler
+static void composite_row(const double *red, const double *green, const double *blue, size_t n, size_t step,
+                          const double lcut[3], const double scale[3], QRgb *out)
+{
+    for ( size_t i = 0; i < n; ++i ) {
+        double r = std::min(std::max((red[i*step]-lcut[0])*scale[0],0.0),255.0);
+        double g = std::min(std::max((green[i*step]-lcut[1])*scale[1],0.0),255.0);
+        double b = std::min(std::max((blue[i*step]-lcut[2])*scale[2],0.0),255.0);
+
+        out[i] = 0xff000000u |
+                 (static_cast<quint32>(r+0.5) << 16) |
+                 (static_cast<quint32>(g+0.5) << 8) |
+                  static_cast<quint32>(b+0.5);
+    }
+}
+
+
             /*  CONSTRUCTOR AND DESTRUCTOR  */
 
 FitsViewWidget::FitsViewWidget(QWidget *parent): QGraphicsView(parent),
     rubberBand(nullptr), rubberBandOrigin(QPointF(0,0)), rubberBandEnd(QPointF(0,0)),
     rubberBandPen(QPen(QBrush(Qt::SolidPattern),0,Qt::DashLine)),
     rubberBandIsActive(false), rubberBandIsShown(false),
+    currentRegionTool(FitsViewWidget::RT_RECTANGLE),
+    profileLine(nullptr), profileLineOrigin(QPointF(0,0)), profileLineEnd(QPointF(0,0)),
+    profileLinePen(QPen(QBrush(Qt::SolidPattern),0,Qt::SolidLine)),
+    profileLineIsActive(false), profileInterpolation(FitsViewWidget::PI_BILINEAR), profileWidth(1),
+    profileBuffer(QVector<double>()),
+    starMeasurementIsOn(false), starPSFModel(FitsViewStarMeasurement::PSF_MOFFAT),
+    starMeasurementRadius(FITS_VIEW_DEFAULT_STAR_RADIUS),
     currentError(FitsViewWidget::OK),
     currentFilename(""), imageIsLoaded(false),
-    currentImage_buffer(std::unique_ptr<double[]>()), currentScaledImage_buffer(std::unique_ptr<uchar[]>()),
-    currentImage_npix(0),
+    currentImage_buffer(std::unique_ptr<double[]>()), currentImage_pixels(nullptr), currentScaledImage_buffer(std::unique_ptr<uchar[]>()),
+    currentImage_npix(0), currentImageIsInteger(false), memoryIsRequested(false),
     lowCutSigmas(2.0), highCutSigmas(5.0),
     currentLowCut(0.0), currentHighCut(0.0),
     currentCT(QVector<QRgb>(FITS_VIEW_COLOR_TABLE_LENGTH)), currentCT_name(FitsViewWidget::CT_NEGBW),
-    currentPixmap(QPixmap()),
+    currentStretch(FitsViewStretch()),
+    compositeIsOn(false), displayTileIsDirty(std::vector<char>()),
+    outOfCoreIsOn(false), tileCache(new FitsViewTileCache(FITS_VIEW_TILE_SIZE)),
+    overviewImage_buffer(std::vector<double>()), detailTiles(std::map<size_t,QGraphicsPixmapItem*>()),
+    detailTilesUsage(0),
+    calibrationIsOn(true), calibrationBias(std::unique_ptr<double[]>()), calibrationDark(std::unique_ptr<double[]>()),
+    calibrationFlat(std::unique_ptr<double[]>()), calibrationDarkExptime(0.0),
+    badPixelMask(std::vector<quint64>()), badPixelMaskColor(QColor(255,0,0)), badPixelMaskItem(nullptr),
+    sharedMemory_ptr(nullptr), sharedMemory_size(0),
+    sidecarCache(FitsViewSidecarCache()), sidecarData(FitsViewSidecarData()), sidecarFilename(""), sidecarIsModified(false),
+    registrationCoarse(std::vector<std::complex<double> >()), registrationFine(std::vector<std::complex<double> >()),
+    registrationOffset(QPointF(0,0)), autoRegistrationIsOn(false),
+    displayRotation(0.0), displayFlip(false), resampleInterpolation(FitsViewWidget::RI_BILINEAR),
+    currentNorthAngle(std::numeric_limits<double>::quiet_NaN()), currentNorthFlip(false),
+    resampledTiles(ResampledTiles()), resampledZoom(0.0), resampledTilesUsage(0),
+    displayFilter(FitsViewDisplayFilter()), filterCache(std::vector<std::pair<FitsViewDisplayFilter,FilterTiles> >()),
+    filterCacheUsage(0),
+    renderFlags(0), renderRequests(0), imageGeneration(0), renderGeneration(0), renderCount(0), renderMergedCount(0), renderCancelledCount(0),
+    currentPixmap(QPixmap()), displayBinning(1),
     fitsImagePixmapItem(nullptr),
     currentZoomFactor(0.0), zoomIncrement(2.0),
     maxSampleLength(FITS_VIEW_MAX_SAMPLE_LENGTH),
@@ -129,6 +597,12 @@ FitsViewWidget::FitsViewWidget(QWidget *parent): QGraphicsView(parent),
 {
 
     currentImage_dim[0] = 0, currentImage_dim[1] = 0;
+    displayTiles_dim[0] = 0, displayTiles_dim[1] = 0;
+    overviewImage_dim[0] = 0, overviewImage_dim[1] = 0;
+    calibration_dim[0] = 0, calibration_dim[1] = 0;
+    badPixelMask_dim[0] = 0, badPixelMask_dim[1] = 0;
+
+    qRegisterMetaType<FitsViewStarMeasurement>("FitsViewStarMeasurement");
 
     generateCT(currentCT_name);
 //    generateCT(CT_BW);
@@ -150,16 +624,20 @@ FitsViewWidget::FitsViewWidget(QWidget *parent): QGraphicsView(parent),
     setSizeAdjustPolicy(QAbstractScrollArea::AdjustToContentsOnFirstShow);
 
     rubberBandPen.setColor("red");
+    profileLinePen.setColor("green");
 
     resizeTimer = new QTimer(this);
     connect(resizeTimer,SIGNAL(timeout()),this,SLOT(resizeTimeout()));
 
     //    connect(this,SIGNAL(ColorTableIsChanged(FitsViewWidget::ColorTable)),this,SLOT(showImage()));
-    connect(this,SIGNAL(ColorTableIsChanged(FitsViewWidget::ColorTable)),this,SLOT(updateFitsPixmap()));
 //    connect(view,SIGNAL(zoomWasChanged(qreal)),this,SLOT(changeZoom(qreal)));
     connect(this,SIGNAL(zoomIsChanged(qreal)),this,SLOT(changeZoom(qreal)));
 //    connect(view,SIGNAL(cursorPos(QPointF)),this,SLOT(changeCursorPos(QPointF)));
-    connect(this,SIGNAL(cutsAreChanged(double,double)),this,SLOT(updateFitsPixmap()));
+    // cuts, color table and filter changes are merged into a render per display frame
+    renderTimer = new QTimer(this);
+    renderTimer->setSingleShot(true);
+    renderTimer->setInterval(FITS_VIEW_RENDER_INTERVAL);
+    connect(renderTimer,SIGNAL(timeout()),this,SLOT(renderImage()));
 
 //    QVBoxLayout *layout = new QVBoxLayout(this);
 //    layout->addWidget(view);
@@ -173,6 +651,7 @@ FitsViewWidget::FitsViewWidget(QWidget *parent): QGraphicsView(parent),
 
 FitsViewWidget::~FitsViewWidget()
 {
+    FitsViewMemoryGovernor::instance()->unregisterClient(this);
 }
 
 
@@ -180,6 +659,7 @@ FitsViewWidget::~FitsViewWidget()
 
 void FitsViewWidget::load(const QString fits_filename, const bool autoscale)
 {
+    cancelRender(); // the previous image is not rendered after the load started
     imageIsLoaded = false;
 
     QString str = fits_filename.trimmed();
@@ -190,624 +670,3217 @@ void FitsViewWidget::load(const QString fits_filename, const bool autoscale)
     int fits_status = 0;
     currentError = FitsViewWidget::OK;
 
-    // THE ONLY 2D-images is support now!!!
-    int maxdim = 2;
-    long naxes[maxdim];
-    int naxis, bitpix;
-    LONGLONG nelem = 1;
-
-    char* filename = fits_filename.toLocal8Bit().data();
-
-    try {
-        fits_open_image(&FITS_fptr, filename, READONLY, &fits_status);
-        if ( fits_status ) throw fits_status;
-
-        fits_read_imghdr(FITS_fptr, maxdim, NULL, &bitpix, &naxis, naxes, NULL, NULL, NULL, &fits_status);
-        if ( fits_status ) throw fits_status;
-
-        for ( int i = 0; i < maxdim; ++i ) {
-            nelem *= naxes[i];
-            currentImage_dim[i] = naxes[i];
-        }
-
-        currentImage_npix = nelem;
-        currentImage_buffer = std::unique_ptr<double[]>(new double[currentImage_npix]);
-        double *buffer = currentImage_buffer.get();
+    double exptime = 0.0;
 
-        fits_read_img(FITS_fptr, TDOUBLE, 1, nelem, NULL, (void*) buffer, NULL, &fits_status);
-        if ( fits_status ) throw fits_status;
+    QByteArray fname = str.toLocal8Bit();
+    char* filename = fname.data();
 
-        fits_close_file(FITS_fptr, &fits_status);
-        if ( fits_status ) throw fits_status;
+    releaseImage(); // previous image does not count against the memory budget
 
-    } catch (std::bad_alloc &ex) {
-        currentImage_buffer = nullptr;
-        currentError = FitsViewWidget::MemoryError;
-        throw currentError;
-    } catch (int err) {
-        currentError = err;
+    {
+        FitsViewCfitsioLock cfitsio_lock;
+        fits_open_image(&FITS_fptr, filename, READONLY, &fits_status);
+    }
+    if ( fits_status ) {
+        currentError = fits_status;
         emit fitsViewError(currentError);
-        fits_close_file(FITS_fptr, &fits_status);
-
-        currentImage_npix = 0;
-
         return;
     }
 
-    imageIsLoaded = true;
-
-    double *buffer = currentImage_buffer.get();
-    auto minmax = std::minmax_element(buffer,buffer+currentImage_npix);
-    currentImageMinVal = *minmax.first;
-    currentImageMaxVal = *minmax.second;
-
-    currentLowCut = currentImageMinVal;
-    currentHighCut = currentImageMaxVal;
-
-    if ( autoscale ) {
-//        double lcut,hcut;
-        std::vector<double> sample(buffer,buffer+currentImage_npix);
-
-        computeCuts(sample,&currentLowCut,&currentHighCut);
-        rescale(currentLowCut,currentHighCut);
+    try {
+        fits_status = readImage(FITS_fptr,&exptime);
+    } catch (std::bad_alloc &ex) { // the image does not fit the memory: view it from disk
+        loadOutOfCore(str,autoscale);
+        return;
     }
 
-    // convert to pixmap
-    QImage im = QImage(currentScaledImage_buffer.get(),currentImage_dim[0],currentImage_dim[1],currentImage_dim[0],QImage::Format_Indexed8);
-    im.setColorTable(currentCT);
-
-    currentPixmap = QPixmap::fromImage(im);
+    if ( fits_status ) {
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        releaseImage();
+        return;
+    }
 
-    // redefine scene size
-    scene->setSceneRect(-1.0*currentImage_dim[0],-1.0*currentImage_dim[1],2.0*currentImage_dim[0],2.0*currentImage_dim[1]);
+    currentFilename = str;
 
-//    // compute zoom factor for entire image viewing
-////    qDebug() << view->viewport()->width();
-    qreal xzoom = 1.0*(this->viewport()->width()-2.0*FITS_VIEW_IMAGE_MARGIN)/currentImage_dim[0];
-    qreal yzoom = 1.0*(this->viewport()->height()-2.0*FITS_VIEW_IMAGE_MARGIN)/currentImage_dim[1];
-    currentZoomFactor = ( xzoom < yzoom ) ? xzoom : yzoom;
+    // the statistics of the raw file could be taken from the cache
+    bool raw = !calibrationIsApplied(currentImage_dim[0],currentImage_dim[1]) && !activeBadPixelMask();
+    FitsViewSidecarData cached;
+    bool is_cached = raw && sidecarCache.read(str,cached) && (cached.sourceStep == 1);
 
-//    qDebug() << xzoom << yzoom;
+    ingestImage(currentImage_buffer.get(),exptime,autoscale,is_cached ? &cached : nullptr);
 
-    currentViewedSubImage.setWidth(currentImage_dim[0]);
-    currentViewedSubImage.setHeight(currentImage_dim[1]);
-    currentViewedSubImageCenter = QPointF(0.5*currentImage_dim[0]+0.5,0.5*currentImage_dim[1]+0.5);
-//    currentZoomFactor = 0.0; // full image
+    if ( imageIsLoaded && raw && sidecarCache.isEnabled() ) {
+        sidecarFilename = str;
+        storeSidecar();
+    }
 
 //    qDebug() << "cuts: " << currentLowCut << ", " << currentHighCut;
 }
 
 
-void FitsViewWidget::rescale(const double lcuts, const double hcuts)
+void FitsViewWidget::loadMemory(const QByteArray fits_data, const bool autoscale)
 {
-    if ( (currentImage_buffer == nullptr) || (currentImage_npix == 0) ) return;
+    cancelRender();
+    imageIsLoaded = false;
+
+    fitsfile *FITS_fptr;
 
+    int fits_status = 0;
     currentError = FitsViewWidget::OK;
 
-    if ( lcuts >= hcuts ) {
-        currentError = FitsViewWidget::BadCutValue;
-        emit fitsViewError(currentError);
-        return;
-    }
+    double exptime = 0.0;
 
-    if ( lcuts >= currentImageMaxVal ) {
-        currentError = FitsViewWidget::BadCutValue;
-        emit fitsViewError(currentError);
-        return;
+    releaseImage();
 
-    }
+    // READONLY memory file is never reallocated by CFITSIO, so the data are not copied
+    void *ptr = const_cast<char*>(fits_data.constData());
+    size_t size = fits_data.size();
 
-    if ( hcuts <= currentImageMinVal ) {
-        currentError = FitsViewWidget::BadCutValue;
+    {
+        FitsViewCfitsioLock cfitsio_lock;
+        fits_open_memfile(&FITS_fptr, "memory", READONLY, &ptr, &size, 0, NULL, &fits_status);
+    }
+    if ( fits_status ) {
+        currentError = fits_status;
         emit fitsViewError(currentError);
         return;
-
     }
 
     try {
-        currentScaledImage_buffer = std::unique_ptr<uchar[]>(new uchar[currentImage_npix]);
+        fits_status = readImage(FITS_fptr,&exptime);
     } catch (std::bad_alloc &ex) {
+        releaseImage();
         currentError = FitsViewWidget::MemoryError;
         emit fitsViewError(currentError);
         return;
     }
 
-    if ( lcuts < currentImageMinVal ) currentLowCut = currentImageMinVal; else currentLowCut = lcuts;
-    if ( hcuts > currentImageMaxVal ) currentHighCut = currentImageMaxVal; else currentHighCut = hcuts;
-
-
-    double range = currentHighCut-currentLowCut;
-    double scaled_val;
-    uchar max_val = 255; // 8-bit indexed image
-
-    for ( size_t i = 0; i < currentImage_npix; ++i ) {
-        if ( currentImage_buffer[i] <= currentLowCut ) {
-            currentScaledImage_buffer[i] = 0;
-            continue;
-        }
-        if ( currentImage_buffer[i] >= currentHighCut ) {
-            currentScaledImage_buffer[i] = max_val;
-            continue;
-        }
-        scaled_val = (currentImage_buffer[i]-currentLowCut)/range;
-        currentScaledImage_buffer[i] = static_cast<uchar>(std::lround(scaled_val*max_val));
-//        if ( (i > 5000) && (i < 5030) ) qDebug() << currentScaledImage_buffer[i];
+    if ( fits_status ) {
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        releaseImage();
+        return;
     }
 
-    emit cutsAreChanged(currentLowCut,currentHighCut);
+    currentFilename = "";
+
+    ingestImage(currentImage_buffer.get(),exptime,autoscale);
 }
 
 
-void FitsViewWidget::showImage()
+void FitsViewWidget::loadSharedMemory(const QString shm_name, const bool autoscale)
 {
-    if ( !currentImage_buffer ) return;
-
-    scene->clear();
-    fitsImagePixmapItem = scene->addPixmap(currentPixmap);
-    QPointF cen = currentViewedSubImageCenter - QPointF(-0.5,-0.5);
-    fitsImagePixmapItem->setPos(-cen);
+    cancelRender();
 
-//    view->fitInView(fitsImagePixmapItem,Qt::KeepAspectRatio);
+    size_t size;
+    void *mapping = map_shared_memory(shm_name,&size);
+    if ( !mapping ) {
+        imageIsLoaded = false;
+        currentError = FitsViewWidget::SharedMemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
 
-    centerOn(currentViewedSubImageCenter);
-    setZoom(currentZoomFactor);
+    // the pixels are read into own buffer, so the segment is not needed after loading
+    loadMemory(QByteArray::fromRawData(static_cast<const char*>(mapping),size),autoscale);
 
-//    currentZoomFactor = view->transform().m11();
-//    view->scale(currentZoomFactor,currentZoomFactor);
-//    scale(0.66348,0.66348);
+    unmap_shared_memory(mapping,size);
 
+    if ( imageIsLoaded ) currentFilename = shm_name;
 }
 
 
-            /*  PUBLIC METHODS  */
-
-int FitsViewWidget::getError() const
+void FitsViewWidget::loadSharedMemory(const QString shm_name, FitsViewWidget::PixelType type,
+                                      const size_t nx, const size_t ny, const bool autoscale)
 {
-    return currentError;
-}
+    cancelRender();
 
+    size_t size;
+    void *mapping = map_shared_memory(shm_name,&size);
+    if ( !mapping ) {
+        imageIsLoaded = false;
+        currentError = FitsViewWidget::SharedMemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    const size_t pixel_size[] = {sizeof(quint8),sizeof(qint16),sizeof(quint16),sizeof(qint32),sizeof(float),sizeof(double)};
+    if ( size < nx*ny*pixel_size[type] ) {
+        unmap_shared_memory(mapping,size);
+        imageIsLoaded = false;
+        currentError = FitsViewWidget::SharedMemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    switch ( type ) {
+        case FitsViewWidget::PT_UINT8: loadBuffer(static_cast<const quint8*>(mapping),nx,ny,autoscale); break;
+        case FitsViewWidget::PT_INT16: loadBuffer(static_cast<const qint16*>(mapping),nx,ny,autoscale); break;
+        case FitsViewWidget::PT_UINT16: loadBuffer(static_cast<const quint16*>(mapping),nx,ny,autoscale); break;
+        case FitsViewWidget::PT_INT32: loadBuffer(static_cast<const qint32*>(mapping),nx,ny,autoscale); break;
+        case FitsViewWidget::PT_FLOAT: loadBuffer(static_cast<const float*>(mapping),nx,ny,autoscale); break;
+        default: loadBuffer(static_cast<const double*>(mapping),nx,ny,autoscale,true);
+    }
+
+    if ( imageIsLoaded && (currentImage_pixels == mapping) ) { // displayed directly from the segment
+        sharedMemory_ptr = mapping;     // it is unmapped by releaseImage()
+        sharedMemory_size = size;
+    } else {
+        unmap_shared_memory(mapping,size);
+    }
+
+    if ( imageIsLoaded ) currentFilename = shm_name;
+}
+
+
+void FitsViewWidget::loadBuffer(const double *pixels, const size_t nx, const size_t ny,
+                                const bool autoscale, const bool keep_pointer)
+{
+    if ( !prepareBuffer(nx,ny,keep_pointer && !calibrationIsApplied(nx,ny) ? pixels : nullptr) ) return;
+
+    ingestImage(pixels,0.0,autoscale);
+}
+
+
+void FitsViewWidget::loadBuffer(const float *pixels, const size_t nx, const size_t ny, const bool autoscale)
+{
+    if ( !prepareBuffer(nx,ny,nullptr) ) return;
+
+    ingestImage(pixels,0.0,autoscale);
+}
+
+
+void FitsViewWidget::loadBuffer(const qint32 *pixels, const size_t nx, const size_t ny, const bool autoscale)
+{
+    if ( !prepareBuffer(nx,ny,nullptr) ) return;
+
+    ingestImage(pixels,0.0,autoscale);
+}
+
+
+void FitsViewWidget::loadBuffer(const quint16 *pixels, const size_t nx, const size_t ny, const bool autoscale)
+{
+    if ( !prepareBuffer(nx,ny,nullptr) ) return;
+
+    ingestImage(pixels,0.0,autoscale);
+}
+
+
+void FitsViewWidget::loadBuffer(const qint16 *pixels, const size_t nx, const size_t ny, const bool autoscale)
+{
+    if ( !prepareBuffer(nx,ny,nullptr) ) return;
+
+    ingestImage(pixels,0.0,autoscale);
+}
+
+
+void FitsViewWidget::loadBuffer(const quint8 *pixels, const size_t nx, const size_t ny, const bool autoscale)
+{
+    if ( !prepareBuffer(nx,ny,nullptr) ) return;
+
+    ingestImage(pixels,0.0,autoscale);
+}
+
+
+void FitsViewWidget::loadOutOfCore(const QString fits_filename, const bool autoscale)
+{
+    cancelRender();
+    imageIsLoaded = false;
+
+    QString str = fits_filename.trimmed();
+    if ( str.isEmpty() || str.isNull() ) return;
+
+    releaseImage();
+
+    currentError = FitsViewWidget::OK;
+
+    int fits_status = tileCache->open(str);
+    if ( fits_status ) {
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    currentImage_dim[0] = tileCache->getWidth();
+    currentImage_dim[1] = tileCache->getHeight();
+    currentImage_npix = currentImage_dim[0]*currentImage_dim[1];
+
+    // WCS for the north up rotation
+    fitsfile *FITS_fptr;
+    int status = 0;
+    QByteArray fname = str.toLocal8Bit();
+    FitsViewCfitsioLock cfitsio_lock;
+    if ( !fits_open_image(&FITS_fptr, fname.data(), READONLY, &status) ) {
+        read_fits_north(FITS_fptr,&currentNorthAngle,&currentNorthFlip);
+        fits_close_file(FITS_fptr, &status);
+    }
+    cfitsio_lock.unlock();
+
+    // overview resolution: not larger than FITS_VIEW_MAX_OVERVIEW_SIZE and fits the memory budget
+    size_t max_dim = std::max(currentImage_dim[0],currentImage_dim[1]);
+    size_t bin = 1;
+    while ( (max_dim+bin-1)/bin > FITS_VIEW_MAX_OVERVIEW_SIZE ) bin *= 2;
+
+    for ( ; bin <= max_dim; bin *= 2 ) {
+        size_t npix = ((currentImage_dim[0]+bin-1)/bin)*((currentImage_dim[1]+bin-1)/bin);
+        if ( setMemoryUsage(FitsViewMemoryGovernor::ImageData,npix*sizeof(double)) &&
+             setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,npix*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL) ) break;
+    }
+
+    // the cached overview is shown without reading the file
+    FitsViewSidecarData cached;
+    bool is_cached = sidecarCache.read(str,cached) && (cached.sourceStep == bin) &&
+                     (cached.overviewDim[0] == (currentImage_dim[0]+bin-1)/bin) &&
+                     (cached.overviewDim[1] == (currentImage_dim[1]+bin-1)/bin);
+
+    try {
+        if ( bin > max_dim ) throw std::bad_alloc();
+
+        if ( is_cached ) {
+            overviewImage_buffer.swap(cached.overview);
+            overviewImage_dim[0] = cached.overviewDim[0];
+            overviewImage_dim[1] = cached.overviewDim[1];
+        } else { // strided read directly from the file, it serves for the display and the autocut
+            fits_status = tileCache->readDecimated(bin,overviewImage_buffer,overviewImage_dim);
+        }
+    } catch (std::bad_alloc &ex) {
+        releaseImage();
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    if ( fits_status ) {
+        releaseImage();
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    displayBinning = bin;
+    outOfCoreIsOn = true;
+    imageIsLoaded = true;
+
+    profileBuffer.reserve(static_cast<int>(std::hypot(currentImage_dim[0],currentImage_dim[1])) + 2);
+
+    sidecarData.sourceStep = bin;
+    if ( sidecarCache.isEnabled() ) sidecarFilename = str;
+    sidecarIsModified = !is_cached;
+
+    // the range of the overview pixels (an approximation of the whole image range)
+    double *buffer = overviewImage_buffer.data();
+    if ( is_cached ) {
+        currentImageMinVal = cached.minVal;
+        currentImageMaxVal = cached.maxVal;
+        currentStretch.setHistogram(cached.histogram,cached.histogramMin,cached.histogramStep);
+    } else {
+        calibrate_image(buffer,nullptr,overviewImage_buffer.size(),nullptr,nullptr,1.0,nullptr,nullptr,&currentImageMinVal,&currentImageMaxVal);
+    }
+
+    currentLowCut = currentImageMinVal;
+    currentHighCut = currentImageMaxVal;
+
+    if ( autoscale ) autoCuts(buffer,overviewImage_buffer.size(),nullptr,is_cached ? &cached : nullptr);
+    rescale(currentLowCut,currentHighCut);
+    flushRender(RENDER_SCALE);
+
+    if ( currentPixmap.isNull() ) {
+        releaseImage();
+        imageIsLoaded = false;
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    storeSidecar();
+
+    resetView();
+}
+
+
+void FitsViewWidget::loadComposite(const QString red_filename, const QString green_filename, const QString blue_filename,
+                                   const bool autoscale)
+{
+    QString filename[3] = {red_filename, green_filename, blue_filename};
+    long plane[3] = {1, 1, 1};
+
+    loadComposite(filename,plane,autoscale);
+}
+
+
+void FitsViewWidget::loadComposite(const QString cube_filename, const int red_plane, const int green_plane, const int blue_plane,
+                                   const bool autoscale)
+{
+    QString filename[3] = {cube_filename, cube_filename, cube_filename};
+    long plane[3] = {red_plane, green_plane, blue_plane};
+
+    loadComposite(filename,plane,autoscale);
+}
+
+
+void FitsViewWidget::rescale(const double lcuts, const double hcuts)
+{
+    // the overview is displayed for out-of-core image
+    const double *image = outOfCoreIsOn ? overviewImage_buffer.data() : currentImage_pixels;
+    size_t npix = outOfCoreIsOn ? overviewImage_buffer.size() : currentImage_npix;
+
+    if ( (image == nullptr) || (npix == 0) ) return;
+
+    if ( compositeIsOn ) { // the same cuts for all channels
+        bool ok = true;
+        for ( int i = 0; i < 3; ++i ) ok &= setChannelCuts(i,lcuts,hcuts);
+        if ( !ok ) return;
+
+        requestRender(RENDER_SCALE);
+        for ( int i = 0; i < 3; ++i ) {
+            emit channelCutsAreChanged(static_cast<RGBChannel>(i),compositeLowCut[i],compositeHighCut[i]);
+        }
+        return;
+    }
+
+    currentError = FitsViewWidget::OK;
+
+    if ( lcuts >= hcuts ) {
+        currentError = FitsViewWidget::BadCutValue;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    if ( lcuts >= currentImageMaxVal ) {
+        currentError = FitsViewWidget::BadCutValue;
+        emit fitsViewError(currentError);
+        return;
+
+    }
+
+    if ( hcuts <= currentImageMinVal ) {
+        currentError = FitsViewWidget::BadCutValue;
+        emit fitsViewError(currentError);
+        return;
+
+    }
+
+    if ( lcuts < currentImageMinVal ) currentLowCut = currentImageMinVal; else currentLowCut = lcuts;
+    if ( hcuts > currentImageMaxVal ) currentHighCut = currentImageMaxVal; else currentHighCut = hcuts;
+
+    // the image is scaled by the next render, a burst of cut changes gives the single conversion
+    requestRender(RENDER_SCALE);
+
+    emit cutsAreChanged(currentLowCut,currentHighCut);
+}
+
+
+void FitsViewWidget::rescaleChannel(FitsViewWidget::RGBChannel ch, const double lcuts, const double hcuts)
+{
+    if ( !compositeIsOn ) return;
+
+    if ( !setChannelCuts(ch,lcuts,hcuts) ) return;
+
+    requestRender(RENDER_SCALE);
+
+    emit channelCutsAreChanged(ch,compositeLowCut[ch],compositeHighCut[ch]);
+}
+
+
+void FitsViewWidget::loadMasterBias(const QString fits_filename)
+{
+    loadCalibrationFrame(fits_filename,calibrationBias,nullptr);
+}
+
+
+void FitsViewWidget::loadMasterDark(const QString fits_filename, const double exptime)
+{
+    double header_exptime;
+
+    if ( !loadCalibrationFrame(fits_filename,calibrationDark,&header_exptime) ) return;
+
+    calibrationDarkExptime = ( exptime > 0.0 ) ? exptime : header_exptime;
+
+    if ( !(calibrationDarkExptime > 0.0) ) { // the dark is loaded, but it will not be scaled
+        calibrationDarkExptime = 0.0;
+        currentError = FitsViewWidget::UnknownExposureTime;
+        emit fitsViewError(currentError);
+    }
+}
+
+
+void FitsViewWidget::loadMasterFlat(const QString fits_filename)
+{
+    if ( !loadCalibrationFrame(fits_filename,calibrationFlat,nullptr) ) return;
+
+    // store the inverse of normalized flat, so calibration is multiplication only.
+    // the mean is over finite positive pixels, the other flat pixels are zeroed
+    double *flat = calibrationFlat.get();
+    long npix = calibration_dim[0]*calibration_dim[1];
+    double sum = 0.0;
+    long count = 0;
+
+#pragma omp parallel for reduction(+:sum,count)
+    for ( long i = 0; i < npix; ++i ) {
+        if ( std::isfinite(flat[i]) && (flat[i] > 0.0) ) {
+            sum += flat[i];
+            ++count;
+        }
+    }
+
+    double mean = ( count > 0 ) ? sum/count : 0.0;
+    if ( !(mean > 0.0) || !std::isfinite(mean) ) {
+        calibrationFlat = nullptr;
+        updateCalibrationUsage();
+        currentError = FitsViewWidget::BadCalibrationFrame;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+#pragma omp parallel for
+    for ( long i = 0; i < npix; ++i ) flat[i] = ( std::isfinite(flat[i]) && (flat[i] > 0.0) ) ? mean/flat[i] : 0.0;
+}
+
+
+void FitsViewWidget::clearCalibration()
+{
+    calibrationBias = nullptr;
+    calibrationDark = nullptr;
+    calibrationFlat = nullptr;
+    calibrationDarkExptime = 0.0;
+
+    updateCalibrationUsage();
+}
+
+
+void FitsViewWidget::loadBadPixelMask(const QString fits_filename, const int bad_flags)
+{
+    currentError = FitsViewWidget::OK;
+
+    fitsfile *FITS_fptr;
+    int fits_status = 0;
+
+    int maxdim = 2;
+    long naxes[2] = {0,0};
+    int naxis, bitpix;
+
+    QByteArray fname = fits_filename.trimmed().toLocal8Bit();
+
+    std::vector<quint64> mask;
+
+    FitsViewCfitsioLock cfitsio_lock;
+
+    fits_open_image(&FITS_fptr, fname.data(), READONLY, &fits_status); // extension syntax is accepted
+    if ( fits_status ) {
+        cfitsio_lock.unlock();
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    fits_read_imghdr(FITS_fptr, maxdim, NULL, &bitpix, &naxis, naxes, NULL, NULL, NULL, &fits_status);
+
+    size_t width = naxes[0];
+    size_t height = naxes[1];
+    size_t nframes = (calibrationBias ? 1 : 0) + (calibrationDark ? 1 : 0) + (calibrationFlat ? 1 : 0);
+    size_t frames_bytes = nframes*calibration_dim[0]*calibration_dim[1]*sizeof(double);
+
+    try {
+        size_t nwords = (width*height + 63)/64;
+
+        if ( !fits_status ) {
+            if ( !setMemoryUsage(FitsViewMemoryGovernor::Calibration,frames_bytes + nwords*sizeof(quint64)) ) throw std::bad_alloc();
+            mask.assign(nwords,0);
+        }
+
+        // read row by row and pack
+        std::vector<int> row(width);
+        long fpixel[2] = {1,1};
+
+        for ( size_t y = 0; !fits_status && (y < height); ++y ) {
+            fpixel[1] = y + 1;
+            fits_read_pix(FITS_fptr, TINT, fpixel, width, NULL, (void*) row.data(), NULL, &fits_status);
+
+            size_t offset = y*width;
+            for ( size_t x = 0; x < width; ++x ) {
+                size_t idx = offset + x;
+                mask[idx >> 6] |= static_cast<quint64>((row[x] & bad_flags) != 0) << (idx & 63);
+            }
+        }
+    } catch (std::bad_alloc &ex) {
+        fits_status = 0;
+        fits_close_file(FITS_fptr, &fits_status);
+        cfitsio_lock.unlock();
+        updateCalibrationUsage();
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    int status = 0;
+    fits_close_file(FITS_fptr, &status);
+    cfitsio_lock.unlock();
+
+    if ( fits_status ) {
+        updateCalibrationUsage();
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    badPixelMask = std::move(mask);
+    badPixelMask_dim[0] = width;
+    badPixelMask_dim[1] = height;
+
+    updateBadPixelMaskItem();
+    redrawResampledTiles();
+
+    if ( displayFilterIsOn() ) { // the filtered values skip masked pixels
+        clearFilterCache();
+        requestRender(RENDER_PIXMAP);
+    }
+}
+
+
+void FitsViewWidget::clearBadPixelMask()
+{
+    std::vector<quint64>().swap(badPixelMask);
+    badPixelMask_dim[0] = 0, badPixelMask_dim[1] = 0;
+
+    updateCalibrationUsage();
+    updateBadPixelMaskItem();
+    redrawResampledTiles();
+
+    if ( displayFilterIsOn() ) {
+        clearFilterCache();
+        requestRender(RENDER_PIXMAP);
+    }
+}
+
+
+void FitsViewWidget::showImage()
+{
+    if ( !imageIsLoaded ) return;
+
+    detailTiles.clear(); // the items are deleted by the scene
+    detailTilesUsage = 0;
+    resampledTiles.clear();
+    resampledTilesUsage = 0;
+    badPixelMaskItem = nullptr;
+    scene->clear();
+    rubberBand = nullptr;
+    rubberBandIsActive = false;
+    rubberBandIsShown = false;
+    profileLine = nullptr;
+    profileLineIsActive = false;
+
+    fitsImagePixmapItem = scene->addPixmap(currentPixmap);
+    fitsImagePixmapItem->setScale(displayBinning);
+    QPointF cen = currentViewedSubImageCenter - QPointF(-0.5,-0.5);
+    fitsImagePixmapItem->setPos(-cen);
+    updateImageTransform(); // the registered image is aligned with the reference, the rotation
+
+//    view->fitInView(fitsImagePixmapItem,Qt::KeepAspectRatio);
+
+    updateBadPixelMaskItem();
+
+    centerOn(currentViewedSubImageCenter);
+    setZoom(currentZoomFactor);
+
+    updateVisibleTiles();
+
+//    currentZoomFactor = view->transform().m11();
+//    view->scale(currentZoomFactor,currentZoomFactor);
+//    scale(0.66348,0.66348);
+
+}
+
+
+void FitsViewWidget::measureStar(const QRectF region)
+{
+    if ( !imageIsLoaded ) return;
+
+    QRectF area = region.normalized();
+
+    // from FITS notation to buffer indices
+    qreal xl = std::floor(area.left()-0.5);
+    qreal yl = std::floor(area.top()-0.5);
+    qreal xr = std::ceil(area.right()-0.5);
+    qreal yr = std::ceil(area.bottom()-0.5);
+
+    if ( xl < 0 ) xl = 0;
+    if ( yl < 0 ) yl = 0;
+    if ( xr >= currentImage_dim[0] ) xr = currentImage_dim[0]-1;
+    if ( yr >= currentImage_dim[1] ) yr = currentImage_dim[1]-1;
+
+    if ( (xl >= xr) || (yl >= yr) ) {
+        currentError = FitsViewWidget::BadRegion;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    FitsViewStarMeasurement result;
+    const quint64 *mask = activeBadPixelMask();
+
+    if ( outOfCoreIsOn || mask ) { // measure in the region copy and shift coordinates back
+        size_t w = static_cast<size_t>(xr-xl) + 1;
+        size_t h = static_cast<size_t>(yr-yl) + 1;
+        std::vector<double> sub(w*h);
+
+        if ( outOfCoreIsOn ) {
+            int fits_status = tileCache->getRegion(xl,yl,xr,yr,sub.data());
+            syncCacheUsage();
+            if ( fits_status ) {
+                currentError = fits_status;
+                emit fitsViewError(currentError);
+                return;
+            }
+        } else {
+            for ( size_t y = 0; y < h; ++y ) {
+                const double *row = currentImage_pixels + (static_cast<size_t>(yl)+y)*currentImage_dim[0] + static_cast<size_t>(xl);
+                std::copy(row,row+w,sub.data() + y*w);
+            }
+        }
+
+        // masked pixels are NaNs and they are skipped by the measurement
+        if ( mask ) {
+            const double nan = std::numeric_limits<double>::quiet_NaN();
+            for ( size_t y = 0; y < h; ++y ) {
+                size_t offset = (static_cast<size_t>(yl)+y)*currentImage_dim[0] + static_cast<size_t>(xl);
+                for ( size_t x = 0; x < w; ++x ) {
+                    if ( is_masked(mask,offset + x) ) sub[x + y*w] = nan;
+                }
+            }
+        }
+
+        fits_view_measure_star(sub.data(),w,h,0,0,w-1,h-1,starPSFModel,result);
+
+        result.xc += xl;
+        result.yc += yl;
+        result.fitXc += xl;
+        result.fitYc += yl;
+    } else {
+        fits_view_measure_star(currentImage_pixels,currentImage_dim[0],currentImage_dim[1],
+                               static_cast<size_t>(xl),static_cast<size_t>(yl),
+                               static_cast<size_t>(xr),static_cast<size_t>(yr),
+                               starPSFModel,result);
+    }
+
+    emit starWasMeasured(result);
+}
+
+
+void FitsViewWidget::measureStar(const QPointF pos)
+{
+    measureStar(QRectF(pos.x()-starMeasurementRadius,pos.y()-starMeasurementRadius,
+                       2.0*starMeasurementRadius,2.0*starMeasurementRadius));
+}
+
+
+            /*  PUBLIC METHODS  */
+
+int FitsViewWidget::getError() const
+{
+    return currentError;
+}
+
+
+bool FitsViewWidget::isImageLoaded() const
+{
+    return imageIsLoaded;
+}
+
+
+bool FitsViewWidget::isCompositeImage() const
+{
+    return compositeIsOn;
+}
+
+
+bool FitsViewWidget::isOutOfCore() const
+{
+    return outOfCoreIsOn;
+}
+
+
+QString FitsViewWidget::getCurrentFilename() const
+{
+    return currentFilename;
+}
+
+
+void FitsViewWidget::getCuts(double *lcuts, double *hcuts)
+{
+    if ( lcuts != nullptr ) *lcuts = currentLowCut;
+    if ( hcuts != nullptr ) *hcuts = currentHighCut;
+}
+
+
+void FitsViewWidget::getChannelCuts(FitsViewWidget::RGBChannel ch, double *lcuts, double *hcuts)
+{
+    if ( lcuts != nullptr ) *lcuts = compositeLowCut[ch];
+    if ( hcuts != nullptr ) *hcuts = compositeHighCut[ch];
+}
+
+
+void FitsViewWidget::setCutSigma(const double lcut_sigmas, const double hcut_sigmas)
+{
+    if ( lcut_sigmas > 0.0 ) lowCutSigmas = lcut_sigmas;
+    if ( hcut_sigmas > 0.0 ) highCutSigmas = hcut_sigmas;
+}
+
+
+void FitsViewWidget::setColorTable(FitsViewWidget::ColorTable ct)
+{
+    generateCT(ct);
+    if ( currentError != FitsViewWidget::OK ) return;
+    currentCT_name = ct;
+
+    if ( !imageIsLoaded ) return;
+
+//    QImage im = QImage(currentScaledImage_buffer.get(),currentImage_dim[0],currentImage_dim[1],currentImage_dim[0],QImage::Format_Indexed8);
+//    im.setColorTable(currentCT);
+
+//    currentPixmap = QPixmap::fromImage(im);
+//    fitsImagePixmapItem->setPixmap(currentPixmap);
+
+    requestRender(RENDER_PIXMAP);
+
+    emit ColorTableIsChanged(ct);
+}
+
+
+FitsViewWidget::ColorTable FitsViewWidget::getColorTable() const
+{
+    return currentCT_name;
+}
+
+
+void FitsViewWidget::setStretch(FitsViewStretch::StretchType type, const double parameter)
+{
+    currentStretch.setType(type,parameter);
+
+    if ( imageIsLoaded && !compositeIsOn ) requestRender(RENDER_SCALE);
+
+    emit stretchIsChanged(currentStretch.getType(),currentStretch.getParameter());
+}
+
+
+FitsViewStretch::StretchType FitsViewWidget::getStretch() const
+{
+    return currentStretch.getType();
+}
+
+
+double FitsViewWidget::getStretchParameter() const
+{
+    return currentStretch.getParameter();
+}
+
+
+void FitsViewWidget::setMaxSampleLength(size_t nelem)
+{
+    maxSampleLength = nelem;
+}
+
+
+void FitsViewWidget::centerOn(qreal x, qreal y)
+{
+    currentViewedSubImageCenter.setX(x);
+    currentViewedSubImageCenter.setY(y);
+
+    // convert from FITS image pixel cordinates to the scene ones
+    QPointF cen = QPointF(x-0.5,y-0.5);
+    cen = mapImageToScene(currentViewedSubImageCenter);
+
+//    view->centerOn(x,y);
+    QGraphicsView::centerOn(cen);
+//    qDebug() << "recentering: " << cen;
+
+    updateVisibleTiles();
+}
+
+
+void FitsViewWidget::centerOn(QPointF &pos)
+{
+    centerOn(pos.x(),pos.y());
+}
+
+
+QPointF FitsViewWidget::getImageCenter() const
+{
+    return currentViewedSubImageCenter;
+}
+
+
+void FitsViewWidget::setRubberBandPen(const QPen &pen)
+{
+    if ( rubberBand ) rubberBand->setPen(pen);
+}
+
+
+void FitsViewWidget::setRegionTool(FitsViewWidget::RegionTool tool)
+{
+    currentRegionTool = tool;
+}
+
+
+FitsViewWidget::RegionTool FitsViewWidget::getRegionTool() const
+{
+    return currentRegionTool;
+}
+
+
+void FitsViewWidget::setLineProfilePen(const QPen &pen)
+{
+    profileLinePen = pen;
+    if ( profileLine ) profileLine->setPen(pen);
+}
+
+
+void FitsViewWidget::setLineProfileInterpolation(FitsViewWidget::ProfileInterpolation interp)
+{
+    profileInterpolation = interp;
+}
+
+
+void FitsViewWidget::setLineProfileWidth(const int width)
+{
+    if ( width > 0 ) profileWidth = width;
+}
+
+
+void FitsViewWidget::setStarMeasurement(const bool on)
+{
+    starMeasurementIsOn = on;
+}
+
+
+void FitsViewWidget::setStarPSFModel(FitsViewStarMeasurement::PSFModel model)
+{
+    starPSFModel = model;
+}
+
+
+void FitsViewWidget::setStarMeasurementRadius(const int radius)
+{
+    if ( radius > 1 ) starMeasurementRadius = radius;
+}
+
+
+void FitsViewWidget::setZoom(const qreal zoom_factor)
+{
+    if ( !imageIsLoaded ) return;
+
+    if ( zoom_factor <= 0.0 ) return;
+
+    currentZoomFactor = zoom_factor;
+    QTransform tr(zoom_factor,0.0,0.0,-zoom_factor,0.0,0.0);
+    this->setTransform(tr);
+
+    updateVisibleTiles();
+}
+
+
+void FitsViewWidget::incrementZoom(const qreal zoom_inc)
+{
+    if ( !imageIsLoaded ) return;
+
+    if ( zoom_inc <= 0.0 ) return;
+
+//    qDebug() << "inc: " << zoom_inc;
+
+    this->scale(zoom_inc,zoom_inc);
+
+    emit zoomIsChanged(zoom_inc);
+
+//    currentZoomFactor *= zoom_inc;
+
+//    // recompute current viewed sub-image
+//    currentViewedSubImage = view->mapToScene(view->viewport()->rect()).boundingRect();
+//    if ( currentViewedSubImage.width() > currentImage_dim[0] ) currentViewedSubImage.setWidth(currentImage_dim[0]);
+//    if ( currentViewedSubImage.height() > currentImage_dim[1] ) currentViewedSubImage.setHeight(currentImage_dim[1]);
+
+//    qDebug() << view->transform();
+}
+
+
+qreal FitsViewWidget::getZoom() const
+{
+    return currentZoomFactor;
+}
+
+
+void FitsViewWidget::setMemoryBudget(size_t bytes)
+{
+    FitsViewMemoryGovernor::instance()->setBudget(bytes);
+}
+
+
+size_t FitsViewWidget::getMemoryBudget()
+{
+    return FitsViewMemoryGovernor::instance()->getBudget();
+}
+
+
+size_t FitsViewWidget::getTotalMemoryUsage()
+{
+    return FitsViewMemoryGovernor::instance()->getUsage();
+}
+
+
+void FitsViewWidget::setTileCacheSize(size_t bytes)
+{
+    tileCache->setCapacity(bytes);
+    syncCacheUsage();
+}
+
+
+void FitsViewWidget::setSidecarCacheDir(const QString &dir)
+{
+    sidecarCache.setDirectory(dir);
+}
+
+
+QString FitsViewWidget::getSidecarCacheDir() const
+{
+    return sidecarCache.getDirectory();
+}
+
+
+void FitsViewWidget::setCalibration(const bool on)
+{
+    calibrationIsOn = on;
+}
+
+
+bool FitsViewWidget::isCalibrationOn() const
+{
+    return calibrationIsOn;
+}
+
+
+void FitsViewWidget::setBadPixelMaskColor(const QColor &color)
+{
+    badPixelMaskColor = color;
+
+    updateBadPixelMaskItem();
+    redrawResampledTiles();
+}
+
+
+bool FitsViewWidget::isBadPixelMaskApplied() const
+{
+    return activeBadPixelMask() != nullptr;
+}
+
+
+void FitsViewWidget::setDisplayFilter(const FitsViewDisplayFilter &filter)
+{
+    if ( filter == displayFilter ) return;
+
+    displayFilter = filter;
+
+    if ( !imageIsLoaded || compositeIsOn || outOfCoreIsOn ) return;
+
+    displayTileIsDirty.clear();
+    requestRender(RENDER_PIXMAP);
+}
+
+
+FitsViewDisplayFilter FitsViewWidget::getDisplayFilter() const
+{
+    return displayFilter;
+}
+
+
+bool FitsViewWidget::setRegistrationReference()
+{
+    currentError = FitsViewWidget::OK;
+
+    if ( !imageIsLoaded || outOfCoreIsOn ) {
+        currentError = FitsViewWidget::BadRegistration;
+        emit fitsViewError(currentError);
+        return false;
+    }
+
+    fits_view_registration_reference(currentImage_pixels,currentImage_dim,registrationCoarse,registrationFine);
+
+    registration_dim[0] = currentImage_dim[0];
+    registration_dim[1] = currentImage_dim[1];
+
+    setRegistrationOffset(QPointF(0,0)); // the reference is aligned with itself
+
+    return true;
+}
+
+
+void FitsViewWidget::clearRegistrationReference()
+{
+    std::vector<std::complex<double> >().swap(registrationCoarse);
+    std::vector<std::complex<double> >().swap(registrationFine);
+
+    setRegistrationOffset(QPointF(0,0));
+}
+
+
+bool FitsViewWidget::registerImage()
+{
+    currentError = FitsViewWidget::OK;
+
+    if ( !imageIsLoaded || outOfCoreIsOn || registrationCoarse.empty() ||
+         (currentImage_dim[0] != registration_dim[0]) || (currentImage_dim[1] != registration_dim[1]) ) {
+        currentError = FitsViewWidget::BadRegistration;
+        emit fitsViewError(currentError);
+        return false;
+    }
+
+    double dx, dy;
+    double quality = fits_view_register(currentImage_pixels,currentImage_dim,registrationCoarse,registrationFine,&dx,&dy);
+
+    QPointF offset(dx,dy);
+
+    setRegistrationOffset(offset);
+
+    emit imageIsRegistered(offset,quality);
+
+    return true;
+}
+
+
+void FitsViewWidget::setAutoRegistration(const bool on)
+{
+    autoRegistrationIsOn = on;
+}
+
+
+QPointF FitsViewWidget::getRegistrationOffset() const
+{
+    return registrationOffset;
+}
+
+
+void FitsViewWidget::setDisplayRotation(const double angle, const bool flip)
+{
+    double a = std::fmod(angle,360.0);
+    displayRotation = ( a < 0.0 ) ? a + 360.0 : a;
+    displayFlip = flip;
+
+    if ( fitsImagePixmapItem ) {
+        if ( rubberBandIsShown ) { // the regions are not at the same image pixels after the rotation
+            scene->removeItem(rubberBand);
+            rubberBandIsActive = false;
+            rubberBandIsShown = false;
+            emit regionWasDeselected();
+        }
+        if ( profileLine ) {
+            scene->removeItem(profileLine);
+            delete profileLine;
+            profileLine = nullptr;
+            profileLineIsActive = false;
+        }
+
+        clearResampledTiles();
+        updateImageTransform();
+
+        // the same image point in the viewport center
+        if ( imageIsLoaded ) centerOn(currentViewedSubImageCenter.x(),currentViewedSubImageCenter.y());
+        updateResampledTiles();
+        syncCacheUsage();
+    }
+
+    emit rotationIsChanged(displayRotation,displayFlip);
+}
+
+
+double FitsViewWidget::getDisplayRotation() const
+{
+    return displayRotation;
+}
+
+
+bool FitsViewWidget::isDisplayFlipped() const
+{
+    return displayFlip;
+}
+
+
+bool FitsViewWidget::setNorthUp()
+{
+    if ( !imageIsLoaded || (currentNorthAngle != currentNorthAngle) ) return false;
+
+    setDisplayRotation(currentNorthAngle,currentNorthFlip);
+
+    return true;
+}
+
+
+void FitsViewWidget::setResampleInterpolation(FitsViewWidget::ResampleInterpolation interp)
+{
+    if ( interp == resampleInterpolation ) return;
+
+    resampleInterpolation = interp;
+
+    // the shown tiles stay until they are rendered by the new interpolation
+    for ( auto it = resampledTiles.begin(); it != resampledTiles.end(); ++it ) {
+        if ( interp == FitsViewWidget::RI_LANCZOS ) {
+            it->second.isDraft = true;
+        } else {
+            it->second.isDirty = true;
+        }
+    }
+
+    updateResampledTiles();
+}
+
+
+FitsViewWidget::ResampleInterpolation FitsViewWidget::getResampleInterpolation() const
+{
+    return resampleInterpolation;
+}
+
+
+void FitsViewWidget::getRenderStatistics(quint64 *renders, quint64 *merged, quint64 *cancelled) const
+{
+    if ( renders ) *renders = renderCount;
+    if ( merged ) *merged = renderMergedCount;
+    if ( cancelled ) *cancelled = renderCancelledCount;
+}
+
+
+size_t FitsViewWidget::getMemoryUsage() const
+{
+    return FitsViewMemoryGovernor::instance()->getUsage(this);
+}
+
+
+int FitsViewWidget::getDisplayBinning() const
+{
+    return displayBinning;
+}
+
+
+// called by the governor under memory pressure
+size_t FitsViewWidget::evictMemory(size_t bytes)
+{
+    size_t freed = 0;
+
+    // the scaled image is needed only to rebuild the pixmap and it is recomputed by scaleImage() on demand
+    if ( currentScaledImage_buffer && !currentPixmap.isNull() ) {
+        currentScaledImage_buffer = nullptr;
+        freed += outOfCoreIsOn ? overviewImage_buffer.size() : currentImage_npix;
+        setMemoryUsage(FitsViewMemoryGovernor::ScaledImage,0);
+    }
+
+    // tiles of out-of-core image are re-read from disk on demand, filtered tiles are recomputed
+    if ( tileCache->getUsage() || filterCacheUsage ) {
+        freed += tileCache->getUsage() + filterCacheUsage;
+        tileCache->shrink(0);
+        clearFilterCache();
+        setMemoryUsage(FitsViewMemoryGovernor::Cache,resampledTilesUsage + detailTilesUsage);
+    }
+
+    // the own request could come from the middle of the pixmap update, so the displayed pixmap
+    // is rebinned for the requests of other widgets only
+    if ( !memoryIsRequested ) {
+        while ( freed < bytes ) {
+            size_t n = increaseDisplayBinning();
+            if ( n == 0 ) break;
+            freed += n;
+        }
+    }
+
+    return freed;
+}
+
+
+void FitsViewWidget::zoomFitInView()
+{
+    // compute zoom factor for entire image viewing (the bounding box of rotated image)
+    double w, h;
+    rotated_extent(currentImage_dim,displayRotation,&w,&h);
+    qreal xzoom = 1.0*(this->viewport()->width()-2.0*FITS_VIEW_IMAGE_MARGIN)/w;
+    qreal yzoom = 1.0*(this->viewport()->height()-2.0*FITS_VIEW_IMAGE_MARGIN)/h;
+
+    // FITS coordinate system starts from (1,1) and its origin is at the center of pixel
+    currentViewedSubImageCenter = QPointF(0.5*currentImage_dim[0]+0.5,0.5*currentImage_dim[1]+0.5);
+    currentViewedSubImage.setWidth(currentImage_dim[0]);
+    currentViewedSubImage.setHeight(currentImage_dim[1]);
+
+    centerOn(currentViewedSubImageCenter);
+
+    setZoom(( xzoom < yzoom ) ? xzoom : yzoom);
+}
+
+
+        /*  PROTECTED METHODS  */
+
+void FitsViewWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    if ( !imageIsLoaded ) return;
+
+    QPointF pos = this->mapToScene(event->pos());
+
+    pos = mapSceneToImage(pos);
+
+    if ( pos.x() >= 0.0 && pos.y() >= 0.0 && pos.x() < currentImage_dim[0] && pos.y() < currentImage_dim[1] ) {
+        quint32 x = (quint32)pos.x();
+        quint32 y = (quint32)pos.y();
+
+        pos += QPointF(0.5,0.5); // convert to FITS pixel notation
+
+        size_t idx = x + y*currentImage_dim[0];
+
+        const quint64 *mask = activeBadPixelMask();
+
+        if ( mask && is_masked(mask,idx) ) {
+            emit imagePoint(pos,std::numeric_limits<double>::quiet_NaN());
+        } else if ( outOfCoreIsOn ) {
+            int fits_status;
+            double value = tileCache->getValue(x,y,&fits_status);
+            syncCacheUsage();
+
+            if ( fits_status ) {
+                currentError = fits_status;
+                emit fitsViewError(currentError);
+            } else {
+                emit imagePoint(pos,value);
+            }
+        } else {
+            double value = currentImage_pixels[idx];
+
+            emit imagePoint(pos,value);
+        }
+
+        if ( compositeIsOn ) {
+            emit compositePoint(pos,compositeImage_buffer[0][idx],compositeImage_buffer[1][idx],compositeImage_buffer[2][idx]);
+        }
+    }
+
+    if ( rubberBandIsActive && (event->buttons() & Qt::LeftButton) ) {
+
+        rubberBand->setVisible(true);
+        rubberBandIsShown = true;
+
+        pos = this->mapToScene(event->pos());
+
+        rubberBandEnd =  mapSceneToImage(pos);
+
+        if ( rubberBandEnd.x() < 0 ) {
+            rubberBandEnd.setX(0.0);
+        }
+        if ( rubberBandEnd.y() < 0 ) {
+            rubberBandEnd.setY(0.0);
+        }
+        if ( rubberBandEnd.x() >= currentImage_dim[0] ) {
+            rubberBandEnd.setX(currentImage_dim[0]-1);
+        }
+        if ( rubberBandEnd.y() >= currentImage_dim[1] ) {
+            rubberBandEnd.setY(currentImage_dim[1]-1);
+        }
+
+        rubberBandEnd =  mapImageToScene(rubberBandEnd);
+
+        // the band sides are along the image axes (the band is rotated with the image)
+        QTransform to_band = rubberBand->transform().inverted();
+        rubberBand->setRect(QRectF(to_band.map(rubberBandOrigin), to_band.map(rubberBandEnd)).normalized());
+    }
+
+    if ( profileLineIsActive && (event->buttons() & Qt::LeftButton) ) {
+        pos = this->mapToScene(event->pos());
+
+        profileLineEnd = mapSceneToImage(pos);
+
+        if ( profileLineEnd.x() < 0 ) {
+            profileLineEnd.setX(0.0);
+        }
+        if ( profileLineEnd.y() < 0 ) {
+            profileLineEnd.setY(0.0);
+        }
+        if ( profileLineEnd.x() >= currentImage_dim[0] ) {
+            profileLineEnd.setX(currentImage_dim[0]-1);
+        }
+        if ( profileLineEnd.y() >= currentImage_dim[1] ) {
+            profileLineEnd.setY(currentImage_dim[1]-1);
+        }
+
+        profileLine->setLine(QLineF(mapImageToScene(profileLineOrigin),
+                                    mapImageToScene(profileLineEnd)));
+        profileLine->setVisible(true);
+
+        getLineProfile(profileLineOrigin,profileLineEnd,profileBuffer);
+
+        emit lineProfile(profileLineOrigin + QPointF(0.5,0.5), profileLineEnd + QPointF(0.5,0.5), profileBuffer);
+    }
+
+
+//    qDebug() << pos;
+}
+
+
+void FitsViewWidget::mouseDoubleClickEvent(QMouseEvent *event)
+{
+    if ( !imageIsLoaded ) return;
+
+    currentViewedSubImageCenter =  this->mapToScene( event->pos() );
+
+    QGraphicsView::centerOn(currentViewedSubImageCenter);
+
+//    qDebug() << "doubleClick (mouse pos): " << event->pos();
+//    qDebug() << "doubleClick (imcenter scene): " << currentViewedSubImageCenter;
+//    qDebug() << "doubleClick: (image pixel)" << fitsImagePixmapItem->mapFromScene(currentViewedSubImageCenter);
+
+    // convert to FITS pixels coordinates
+    currentViewedSubImageCenter = mapSceneToImage(currentViewedSubImageCenter) + QPointF(0.5,0.5);
+
+
+    qreal incr;
+
+    if ( event->button() == Qt::LeftButton ) {
+            incr = zoomIncrement;
+    }
+    if ( event->button() == Qt::RightButton ) {
+            incr = 1.0/zoomIncrement;
+    }
+
+    incrementZoom(incr);
+}
+
+
+void FitsViewWidget::wheelEvent(QWheelEvent *event)
+{
+    if ( !imageIsLoaded ) return;
+    int numDegrees = event->delta() / 8;
+
+    int numSteps = numDegrees / 15; // see QWheelEvent documentation
+
+    qreal factor = 1.0+qreal(numSteps)*0.1;
+    qDebug() << "factor(wheel) = " << factor;
+    incrementZoom(factor);
+}
+
+
+void FitsViewWidget::mousePressEvent(QMouseEvent *event)
+{
+    if ( !imageIsLoaded ) return;
+
+    if ( profileLine ) { // only one region could be shown
+        scene->removeItem(profileLine);
+        delete profileLine;
+        profileLine = nullptr;
+        profileLineIsActive = false;
+    }
+
+    if ( (event->button() == Qt::LeftButton) && (currentRegionTool == FitsViewWidget::RT_LINE) ) {
+        if ( rubberBandIsShown ) {
+            scene->removeItem(rubberBand);
+            rubberBandIsActive = false;
+            rubberBandIsShown = false;
+            emit regionWasDeselected();
+        }
+
+        QPointF pos = mapSceneToImage(this->mapToScene(event->pos()));
+
+        if ( pos.x() < 0 ) {
+            pos.setX(0.0);
+        }
+        if ( pos.x() >= currentImage_dim[0] ) {
+            pos.setX(currentImage_dim[0]-1);
+        }
+
+        if ( pos.y() < 0 ) {
+            pos.setY(0.0);
+        }
+        if ( pos.y() >= currentImage_dim[1] ) {
+            pos.setY(currentImage_dim[1]-1);
+        }
+
+        profileLineOrigin = pos;
+        profileLineEnd = pos;
+
+        QPointF origin = mapImageToScene(pos);
+        profileLine = scene->addLine(QLineF(origin,origin),profileLinePen);
+        profileLine->setVisible(false);
+        profileLineIsActive = true;
+
+        return;
+    }
+
+    if ( event->button() == Qt::LeftButton ) {
+        if ( rubberBandIsShown ) {
+            scene->removeItem(rubberBand);
+            rubberBandIsShown = false;
+            emit regionWasDeselected();
+        }
+
+        rubberBandOrigin = this->mapToScene(event->pos());
+        rubberBandOrigin = mapSceneToImage(rubberBandOrigin);
+
+        // prevent rectangle conner is out of image
+        if ( rubberBandOrigin.x() < 0 ) {
+            rubberBandOrigin.setX(0.0);
+        }
+        if ( rubberBandOrigin.x() >= currentImage_dim[0] ) {
+            rubberBandOrigin.setX(currentImage_dim[0]-1);
+        }
+
+        if ( rubberBandOrigin.y() < 0 ) {
+            rubberBandOrigin.setY(0.0);
+        }
+        if ( rubberBandOrigin.y() >= currentImage_dim[1] ) {
+            rubberBandOrigin.setY(currentImage_dim[1]-1);
+        }
+
+        rubberBandOrigin = mapImageToScene(rubberBandOrigin);
+
+        rubberBandEnd = QPointF(rubberBandOrigin);
+        QTransform rotation = displayRotationTransform();
+        rubberBand = scene->addRect(QRectF(rotation.inverted().map(rubberBandOrigin), QSize()),rubberBandPen);
+        rubberBand->setTransform(rotation);
+
+        rubberBand->setVisible(false);
+        rubberBandIsActive = true;
+    }
+
+    if ( event->button() == Qt::RightButton ) {
+        if ( rubberBandIsShown ) {
+            scene->removeItem(rubberBand);
+            rubberBandIsActive = false;
+            rubberBandIsShown = false;
+            emit regionWasDeselected();
+
+            double lcut, hcut;
+
+            // create pixels sample
+            std::vector<double> sample;
+
+            QRectF region = rubberBandImageRect();
+
+            if ( compositeIsOn ) { // independent cuts for each channel
+                for ( int i = 0; i < 3; ++i ) {
+                    getSubImage(compositeImage_buffer[i].get(),sample,region);
+                    lcut = compositeLowCut[i];
+                    hcut = compositeHighCut[i];
+                    computeCuts(sample,&lcut,&hcut);
+                    setChannelCuts(i,lcut,hcut);
+                }
+                requestRender(RENDER_SCALE);
+                for ( int i = 0; i < 3; ++i ) {
+                    emit channelCutsAreChanged(static_cast<RGBChannel>(i),compositeLowCut[i],compositeHighCut[i]);
+                }
+            } else {
+                getSubImage(sample,region);
+                computeCuts(sample,&lcut,&hcut);
+                rescale(lcut,hcut);
+            }
+        }
+    }
+
+}
+
+
+void FitsViewWidget::mouseReleaseEvent(QMouseEvent *event)
+{
+    if ( event->button() == Qt::LeftButton ) {
+        profileLineIsActive = false;
+
+        if ( rubberBandIsShown ) {
+            rubberBandIsActive = false;
+            QRectF rect = rubberBandImageRect();
+
+            // convert to FITS notation: the first pixel has coordinates [1,1] and integer coordinate is at th center of pixel
+
+            rect.setX(rect.x()+0.5);
+            rect.setY(rect.y()+0.5);
+
+            emit regionWasSelected(rect);
+
+            if ( starMeasurementIsOn ) measureStar(rect);
+        } else if ( starMeasurementIsOn && fitsImagePixmapItem && (currentRegionTool == FitsViewWidget::RT_RECTANGLE) ) {
+            // just a click: measure around the clicked position
+            QPointF pos = mapSceneToImage(rubberBandOrigin) + QPointF(0.5,0.5);
+            measureStar(pos);
+        }
+    }
+}
+
+
+void FitsViewWidget::keyPressEvent(QKeyEvent *event)
+{
+    if ( !imageIsLoaded ) return;
+
+    switch ( event->key() ) {
+        case Qt::Key_Escape: {
+            zoomFitInView();
+            break;
+        }
+        default: {
+            qDebug() << "Pressed key: " << event->key();
+        }
+    }
+}
+
+
+void FitsViewWidget::resizeEvent(QResizeEvent *event)
+{
+    if ( !imageIsLoaded ) return;
+
+    if ( event->oldSize().width() < 0 || event->oldSize().height() < 0 ) return; // initial resizing (by calling show())
+
+    resizeTimer->stop();
+    resizeTimer->start(FITS_VIEW_DEFAULT_RESIZE_TIMEOUT);
+}
+
+
+// rect bottom-left coordinates must be in the QPixmap notation!
+// (integer coordinates are at the botom-left conner of pixel and pixels start from 0)
+//void FitsViewWidget::getSubImage(std::vector<double> *subImage, QRectF &rect)
+void FitsViewWidget::getSubImage(std::vector<double> &subImage, QRectF &rect)
+{
+    getSubImage(currentImage_pixels,subImage,rect);
+}
+
+
+// for out-of-core image (image == nullptr) the pixels are taken from the tile cache
+void FitsViewWidget::getSubImage(const double *image, std::vector<double> &subImage, QRectF &rect)
+{
+    if ( (image == nullptr) && !outOfCoreIsOn ) return;
+
+    QRectF area = rect.normalized();
+
+    if ( (area.x() < 0) || (area.y() < 0) ||
+         ((area.x() + area.width()) > currentImage_dim[0]) || ((area.y()+area.height()) > currentImage_dim[1]) ) {
+        currentError = FitsViewWidget::BadRegion;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+
+    quint32 xl = (quint32) area.x();
+    quint32 yl = (quint32) area.y();
+
+    quint32 xr = (quint32) (area.x() + area.width());
+    quint32 yr = (quint32) (area.y() + area.height());
+
+    if ( xr >= currentImage_dim[0] ) xr = currentImage_dim[0]-1;
+    if ( yr >= currentImage_dim[1] ) yr = currentImage_dim[1]-1;
+
+    size_t Npixels = (xr-xl+1)*(yr-yl+1);
+
+//    subImage->resize(Npixels);
+    subImage.resize(Npixels);
+
+    if ( image == nullptr ) {
+        int fits_status = tileCache->getRegion(xl,yl,xr,yr,subImage.data());
+        syncCacheUsage();
+        if ( fits_status ) {
+            currentError = fits_status;
+            emit fitsViewError(currentError);
+            subImage.clear();
+            return;
+        }
+    } else {
+        size_t i = 0;
+        for ( quint32 y = yl; y <= yr; ++y ) {
+            quint32 offset = y*currentImage_dim[0];
+            for ( quint32 x = xl; x <= xr; ++x ) {
+                subImage[i++] = image[offset + x];
+//                subImage->at(i++) = currentImage_buffer[offset + x];
+            }
+        }
+    }
+
+    // masked pixels are NaNs, so the region keeps its layout
+    const quint64 *mask = activeBadPixelMask();
+    if ( mask ) {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        size_t i = 0;
+        for ( quint32 y = yl; y <= yr; ++y ) {
+            size_t offset = static_cast<size_t>(y)*currentImage_dim[0];
+            for ( quint32 x = xl; x <= xr; ++x, ++i ) {
+                if ( is_masked(mask,offset + x) ) subImage[i] = nan;
+            }
+        }
+    }
+}
+
+
+// start and end points must be in the QPixmap notation (see getSubImage)
+void FitsViewWidget::getLineProfile(const QPointF &start, const QPointF &end, QVector<double> &profile)
+{
+    if ( !imageIsLoaded ) return;
+
+    QPointF delta = end - start;
+    int nsamples = static_cast<int>(std::sqrt(delta.x()*delta.x() + delta.y()*delta.y())) + 1;
+
+    profile.resize(nsamples); // no reallocation if capacity was reserved in load()
+
+    // convert to buffer index coordinates (the pixel center is at integer coordinate)
+    if ( outOfCoreIsOn ) {
+        CachedPixels pixels = {tileCache.get(),nullptr,0,0,0,0};
+        line_profile(pixels,currentImage_dim,
+                     start.x()-0.5,start.y()-0.5,end.x()-0.5,end.y()-0.5,
+                     profileWidth,profileInterpolation == FitsViewWidget::PI_BILINEAR,
+                     profile.data(),nsamples);
+        syncCacheUsage();
+
+        if ( pixels.status ) { // the failed samples are NaN
+            currentError = pixels.status;
+            emit fitsViewError(currentError);
+        }
+    } else {
+        BufferPixels pixels = {currentImage_pixels,currentImage_dim[0]};
+        line_profile(pixels,currentImage_dim,
+                     start.x()-0.5,start.y()-0.5,end.x()-0.5,end.y()-0.5,
+                     profileWidth,profileInterpolation == FitsViewWidget::PI_BILINEAR,
+                     profile.data(),nsamples);
+    }
+}
+
+
+        /*  PRIVATE SLOTS  */
+
+void FitsViewWidget::resizeTimeout()
+{
+    resizeTimer->stop();
+
+//    QRectF rr = view->mapToScene(view->geometry()).boundingRect();
+
+    centerOn(currentViewedSubImageCenter);
+    this->invalidateScene();
+
+    return;
+
+//    if ( (rr.height() < currentViewedSubImage.height()) || (rr.width() < currentViewedSubImage.width()) ) {
+//        qreal hfactor = 1.0*rr.height()/currentViewedSubImage.height();
+//        qreal wfactor = 1.0*rr.width()/currentViewedSubImage.width();
+
+//        qreal factor = (hfactor > wfactor) ? wfactor : hfactor;
+//        incrementZoom(factor);
+//    } else {
+//        setZoom(currentZoomFactor);
+//    }
+
+}
+
+void FitsViewWidget::changeZoom(qreal factor)
+{
+    currentZoomFactor *= factor;
+
+    // recompute current viewed sub-image
+    currentViewedSubImage = this->mapToScene(this->viewport()->rect()).boundingRect();
+    if ( currentViewedSubImage.width() > currentImage_dim[0] ) currentViewedSubImage.setWidth(currentImage_dim[0]);
+    if ( currentViewedSubImage.height() > currentImage_dim[1] ) currentViewedSubImage.setHeight(currentImage_dim[1]);
+
+    updateVisibleTiles();
+}
+
+
+// merged changes since the previous render: at most one conversion of the image
+void FitsViewWidget::renderImage()
+{
+    if ( renderGeneration != imageGeneration ) { // a load was started after the request
+        cancelRender();
+        return;
+    }
+
+    int flags = renderFlags;
+    int merged = std::max(renderRequests-1,0);
+
+    renderFlags = 0;
+    renderRequests = 0;
+
+    if ( !flags ) return;
+
+    if ( flags & (RENDER_SCALE | RENDER_PIXMAP) ) {
+        if ( compositeIsOn ) {
+            invalidateDisplayTiles();
+            updateCompositeTiles();
+        } else {
+            if ( (flags & RENDER_SCALE) && !scaleImage() ) return;
+            updateFitsPixmap();
+        }
+
+        for ( auto it = resampledTiles.begin(); it != resampledTiles.end(); ++it ) it->second.isDirty = true;
+    }
+
+    renderResampledTiles(); // the first pass, the next ones are requested by it
+
+    if ( flags & (RENDER_SCALE | RENDER_PIXMAP) ) {
+        ++renderCount;
+        renderMergedCount += merged;
+
+        emit imageIsRendered(merged);
+    }
+}
+
+
+void FitsViewWidget::updateFitsPixmap()
+{
+
+    if ( compositeIsOn ) return;
+    if ( !imageIsLoaded ) return;
+
+    if ( !currentScaledImage_buffer && !scaleImage() ) return; // it was evicted
+
+    // convert to pixmap
+    currentPixmap = scaledImageToPixmap();
+
+    if ( fitsImagePixmapItem ) fitsImagePixmapItem->setPixmap(currentPixmap);
+
+    if ( displayFilterIsOn() ) { // the filtered tiles are drawn over the unfiltered pixmap
+        displayTiles_dim[0] = (currentPixmap.width() + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+        displayTiles_dim[1] = (currentPixmap.height() + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+        displayTileIsDirty.assign(displayTiles_dim[0]*displayTiles_dim[1],1);
+        updateFilterTiles();
+    }
+
+    if ( outOfCoreIsOn ) { // cuts or color table were changed, redraw full-resolution tiles
+        removeDetailTiles();
+        updateDetailTiles();
+    }
+}
+
+
+void FitsViewWidget::updateVisibleTiles()
+{
+    updateCompositeTiles();
+    updateFilterTiles();
+    updateDetailTiles();
+    updateResampledTiles();
+}
+
+
+// render dirty tiles of composite image which are in the viewport
+void FitsViewWidget::updateCompositeTiles()
+{
+    if ( !compositeIsOn ) return;
+    if ( !fitsImagePixmapItem ) return;
+    if ( resampledDisplayIsOn() ) return; // the pixmap is hidden, the tiles stay dirty
+
+    QRect visible = visibleImageRect();
+    if ( visible.isEmpty() ) return;
+
+    // to pixmap pixels
+    visible = QRect(QPoint(visible.left()/displayBinning,visible.top()/displayBinning),
+                    QPoint(visible.right()/displayBinning,visible.bottom()/displayBinning));
+
+    std::vector<size_t> tiles;
+    for ( int ty = visible.top()/FITS_VIEW_TILE_SIZE; ty <= visible.bottom()/FITS_VIEW_TILE_SIZE; ++ty ) {
+        for ( int tx = visible.left()/FITS_VIEW_TILE_SIZE; tx <= visible.right()/FITS_VIEW_TILE_SIZE; ++tx ) {
+            size_t idx = tx + ty*displayTiles_dim[0];
+            if ( displayTileIsDirty[idx] ) tiles.push_back(idx);
+        }
+    }
+
+    if ( tiles.empty() ) return;
+
+    QRect image_rect = currentPixmap.rect();
+    std::vector<QRect> rects(tiles.size());
+    std::vector<QImage> images(tiles.size());
+
+    for ( size_t i = 0; i < tiles.size(); ++i ) {
+        int tx = tiles[i] % displayTiles_dim[0];
+        int ty = tiles[i] / displayTiles_dim[0];
+        rects[i] = QRect(tx*FITS_VIEW_TILE_SIZE,ty*FITS_VIEW_TILE_SIZE,
+                         FITS_VIEW_TILE_SIZE,FITS_VIEW_TILE_SIZE).intersected(image_rect);
+        images[i] = QImage(rects[i].size(),QImage::Format_ARGB32);
+        if ( images[i].isNull() ) {
+            currentError = FitsViewWidget::MemoryError;
+            emit fitsViewError(currentError);
+            return;
+        }
+    }
+
+    double lcut[3], scale[3];
+    for ( int i = 0; i < 3; ++i ) {
+        double range = compositeHighCut[i]-compositeLowCut[i];
+        lcut[i] = compositeLowCut[i];
+        scale[i] = ( range > 0.0 ) ? 255.0/range : 0.0;
+    }
+
+    const double *red = compositeImage_buffer[0].get();
+    const double *green = compositeImage_buffer[1].get();
+    const double *blue = compositeImage_buffer[2].get();
+
+    long ntiles = tiles.size();
+    size_t step = displayBinning;
+
+#pragma omp parallel for schedule(dynamic)
+    for ( long i = 0; i < ntiles; ++i ) {
+        QImage &im = images[i];
+        for ( int y = 0; y < rects[i].height(); ++y ) {
+            size_t offset = (rects[i].top()+y)*step*currentImage_dim[0] + rects[i].left()*step;
+            composite_row(red+offset,green+offset,blue+offset,rects[i].width(),step,lcut,scale,
+                          reinterpret_cast<QRgb*>(im.scanLine(y)));
+        }
+    }
+
+    // the item shares the pixmap, release it to avoid detaching of the whole pixmap while painting
+    fitsImagePixmapItem->setPixmap(QPixmap());
+
+    QPainter painter(&currentPixmap);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    for ( size_t i = 0; i < tiles.size(); ++i ) {
+        painter.drawImage(rects[i].topLeft(),images[i]);
+        displayTileIsDirty[tiles[i]] = 0;
+    }
+    painter.end();
+
+    fitsImagePixmapItem->setPixmap(currentPixmap);
+}
+
+
+
+// full-resolution tiles of out-of-core image over the overview pixmap.
+// they are shown if the overview is coarser than the screen pixels
+void FitsViewWidget::updateDetailTiles()
+{
+    if ( !outOfCoreIsOn ) return;
+    if ( !fitsImagePixmapItem ) return;
+    if ( resampledDisplayIsOn() ) return;
+
+    qreal zoom = std::abs(transform().m11());
+    if ( (zoom < FITS_VIEW_DETAIL_MIN_ZOOM) || (zoom*displayBinning <= 1.0) ) {
+        removeDetailTiles();
+        syncCacheUsage();
+        return;
+    }
+
+    QRect visible = visibleImageRect();
+    if ( visible.isEmpty() ) {
+        removeDetailTiles();
+        syncCacheUsage();
+        return;
+    }
+
+    size_t tiles_xdim = (currentImage_dim[0] + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+
+    std::map<size_t,QGraphicsPixmapItem*> tiles;
+    for ( int ty = visible.top()/FITS_VIEW_TILE_SIZE; ty <= visible.bottom()/FITS_VIEW_TILE_SIZE; ++ty ) {
+        for ( int tx = visible.left()/FITS_VIEW_TILE_SIZE; tx <= visible.right()/FITS_VIEW_TILE_SIZE; ++tx ) {
+            tiles[tx + ty*tiles_xdim] = nullptr;
+        }
+    }
+
+    // keep already rendered tiles, delete invisible ones
+    for ( auto it = detailTiles.begin(); it != detailTiles.end(); ++it ) {
+        auto tile = tiles.find(it->first);
+        if ( tile != tiles.end() ) tile->second = it->second; else delete it->second;
+    }
+    detailTiles.clear();
+
+    std::vector<uchar> scaled;
+    qreal k = displayBinning;
+
+    // after a read error the kept tiles are still tracked, the missing ones are not read
+    int read_status = 0;
+
+    detailTilesUsage = 0;
+    for ( auto it = tiles.begin(); it != tiles.end(); ++it ) {
+        if ( it->second ) {
+            detailTiles.insert(*it);
+            detailTilesUsage += static_cast<size_t>(it->second->pixmap().width())*it->second->pixmap().height()*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL;
+            continue;
+        }
+        if ( read_status ) continue;
+
+        size_t tx = it->first % tiles_xdim;
+        size_t ty = it->first / tiles_xdim;
+
+        const double *tile = tileCache->getTile(tx,ty,&read_status);
+        if ( read_status ) {
+            currentError = read_status;
+            emit fitsViewError(currentError);
+            continue;
+        }
+
+        int w = std::min((tx+1)*FITS_VIEW_TILE_SIZE,currentImage_dim[0]) - tx*FITS_VIEW_TILE_SIZE;
+        int h = std::min((ty+1)*FITS_VIEW_TILE_SIZE,currentImage_dim[1]) - ty*FITS_VIEW_TILE_SIZE;
+
+        scaled.resize(static_cast<size_t>(w)*h);
+        currentStretch.apply(tile,scaled.size(),scaled.data());
+
+        QImage im = QImage(scaled.data(),w,h,w,QImage::Format_Indexed8);
+        im.setColorTable(currentCT);
+
+        // a child of the overview item: tile pixel is 1/displayBinning of the overview pixel
+        QGraphicsPixmapItem *item = new QGraphicsPixmapItem(QPixmap::fromImage(im),fitsImagePixmapItem);
+        item->setPos(tx*FITS_VIEW_TILE_SIZE/k,ty*FITS_VIEW_TILE_SIZE/k);
+        item->setScale(1.0/k);
+
+        detailTiles[it->first] = item;
+        detailTilesUsage += static_cast<size_t>(w)*h*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL;
+    }
+
+    syncCacheUsage();
+}
+
+
+void FitsViewWidget::removeDetailTiles()
+{
+    for ( auto it = detailTiles.begin(); it != detailTiles.end(); ++it ) delete it->second;
+    detailTiles.clear();
+    detailTilesUsage = 0;
+}
+
+
+// report the tile cache, filtered tiles and tile pixmaps size to the memory governor,
+// drop the caches if they do not fit the budget
+void FitsViewWidget::syncCacheUsage()
+{
+    size_t pixmaps = resampledTilesUsage + detailTilesUsage; // the displayed tiles
+    size_t usage = tileCache->getUsage() + filterCacheUsage + pixmaps;
+
+    if ( setMemoryUsage(FitsViewMemoryGovernor::Cache,usage) ) {
+        // the own caches could be evicted to make room, then the reported usage is stale
+        if ( tileCache->getUsage() + filterCacheUsage + pixmaps != usage ) {
+            setMemoryUsage(FitsViewMemoryGovernor::Cache,tileCache->getUsage() + filterCacheUsage + pixmaps);
+        }
+        return;
+    }
+
+    tileCache->shrink(0);
+    clearFilterCache();
+    setMemoryUsage(FitsViewMemoryGovernor::Cache,pixmaps);
+}
+
+
+bool FitsViewWidget::displayFilterIsOn() const
+{
+    return (displayFilter.type != FitsViewDisplayFilter::DF_NONE) && !compositeIsOn && !outOfCoreIsOn;
+}
+
+
+// render dirty filtered tiles which are in the viewport.
+// filtered values are cached per filter setting, so the cuts and color table changes
+// and the return to the previous setting need only rescaling
+void FitsViewWidget::updateFilterTiles()
+{
+    if ( !displayFilterIsOn() ) return;
+    if ( !fitsImagePixmapItem || !currentImage_pixels ) return;
+    if ( resampledDisplayIsOn() ) return;
+    if ( displayTileIsDirty.empty() ) return;
+
+    QRect visible = visibleImageRect();
+    if ( visible.isEmpty() ) return;
+
+    // to pixmap pixels
+    visible = QRect(QPoint(visible.left()/displayBinning,visible.top()/displayBinning),
+                    QPoint(visible.right()/displayBinning,visible.bottom()/displayBinning));
+
+    std::vector<size_t> tiles;
+    for ( int ty = visible.top()/FITS_VIEW_TILE_SIZE; ty <= visible.bottom()/FITS_VIEW_TILE_SIZE; ++ty ) {
+        for ( int tx = visible.left()/FITS_VIEW_TILE_SIZE; tx <= visible.right()/FITS_VIEW_TILE_SIZE; ++tx ) {
+            size_t idx = tx + ty*displayTiles_dim[0];
+            if ( displayTileIsDirty[idx] ) tiles.push_back(idx);
+        }
+    }
+
+    if ( tiles.empty() ) return;
+
+    QRect image_rect = currentPixmap.rect();
+    std::vector<QRect> rects(tiles.size());
+    for ( size_t i = 0; i < tiles.size(); ++i ) {
+        int tx = tiles[i] % displayTiles_dim[0];
+        int ty = tiles[i] / displayTiles_dim[0];
+        rects[i] = QRect(tx*FITS_VIEW_TILE_SIZE,ty*FITS_VIEW_TILE_SIZE,
+                         FITS_VIEW_TILE_SIZE,FITS_VIEW_TILE_SIZE).intersected(image_rect);
+    }
+
+    // drop the other settings first, then invisible tiles of the current one
+    auto tiles_bytes = [](const FilterTiles &ft) -> size_t {
+        size_t bytes = 0;
+        for ( auto it = ft.begin(); it != ft.end(); ++it ) bytes += it->second.size()*sizeof(double);
+        return bytes;
+    };
+
+    size_t need = 0;
+    for ( size_t i = 0; i < rects.size(); ++i ) need += rects[i].width()*rects[i].height()*sizeof(double);
+
+    for ( auto it = filterCache.begin(); it != filterCache.end(); ) {
+        if ( (filterCacheUsage + need > FITS_VIEW_MAX_FILTER_CACHE_SIZE) && (it->first != displayFilter) ) {
+            filterCacheUsage -= tiles_bytes(it->second);
+            it = filterCache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    FilterTiles *cache = nullptr;
+    for ( size_t i = 0; i < filterCache.size(); ++i ) {
+        if ( filterCache[i].first == displayFilter ) cache = &filterCache[i].second;
+    }
+    if ( !cache ) {
+        filterCache.push_back(std::make_pair(displayFilter,FilterTiles()));
+        cache = &filterCache.back().second;
+    }
+
+    for ( auto it = cache->begin(); (filterCacheUsage + need > FITS_VIEW_MAX_FILTER_CACHE_SIZE) && (it != cache->end()); ) {
+        if ( std::find(tiles.begin(),tiles.end(),it->first) == tiles.end() ) {
+            filterCacheUsage -= it->second.size()*sizeof(double);
+            it = cache->erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // filter the tiles which are not in the cache
+    std::vector<std::vector<double>*> data(tiles.size(),nullptr);
+    std::vector<size_t> missing;
+    for ( size_t i = 0; i < tiles.size(); ++i ) {
+        auto it = cache->find(tiles[i]);
+        if ( it == cache->end() ) {
+            it = cache->insert(std::make_pair(tiles[i],std::vector<double>())).first;
+            missing.push_back(i);
+        }
+        data[i] = &it->second;
+    }
+
+    std::vector<QImage> images(tiles.size());
+    try {
+        for ( size_t i = 0; i < missing.size(); ++i ) {
+            std::vector<double> &values = *data[missing[i]];
+            values.resize(rects[missing[i]].width()*rects[missing[i]].height());
+            filterCacheUsage += values.size()*sizeof(double);
+        }
+        for ( size_t i = 0; i < tiles.size(); ++i ) {
+            images[i] = QImage(rects[i].size(),QImage::Format_Indexed8);
+            if ( images[i].isNull() ) throw std::bad_alloc();
+        }
+    } catch (std::bad_alloc &ex) {
+        clearFilterCache();
+        syncCacheUsage();
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
+
+    const double *image = currentImage_pixels;
+    const quint64 *mask = activeBadPixelMask();
+    size_t step = displayBinning;
+    long nmissing = missing.size();
+
+#pragma omp parallel for schedule(dynamic)
+    for ( long i = 0; i < nmissing; ++i ) {
+        const QRect &r = rects[missing[i]];
+        fits_view_filter_region(image,mask,currentImage_dim[0],currentImage_dim[1],
+                                r.left()*step,r.top()*step,r.width(),r.height(),step,
+                                displayFilter,data[missing[i]]->data());
+    }
+
+    long ntiles = tiles.size();
+
+#pragma omp parallel for schedule(dynamic)
+    for ( long i = 0; i < ntiles; ++i ) {
+        int w = rects[i].width();
+        for ( int y = 0; y < rects[i].height(); ++y ) {
+            currentStretch.apply(data[i]->data() + y*w,w,images[i].scanLine(y));
+        }
+        images[i].setColorTable(currentCT);
+    }
+
+    // the item shares the pixmap, release it to avoid detaching of the whole pixmap while painting
+    fitsImagePixmapItem->setPixmap(QPixmap());
+
+    QPainter painter(&currentPixmap);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    for ( size_t i = 0; i < tiles.size(); ++i ) {
+        painter.drawImage(rects[i].topLeft(),images[i]);
+        displayTileIsDirty[tiles[i]] = 0;
+    }
+    painter.end();
+
+    fitsImagePixmapItem->setPixmap(currentPixmap);
+
+    syncCacheUsage();
+}
 
-bool FitsViewWidget::isImageLoaded() const
+
+void FitsViewWidget::clearFilterCache()
 {
-    return imageIsLoaded;
+    filterCache.clear();
+    filterCacheUsage = 0;
 }
 
 
-QString FitsViewWidget::getCurrentFilename() const
+// screen-aligned tiles of the rotated image which are in the viewport. the image is resampled
+// at the screen resolution, so the view draws the tiles without transformation. the tiles are
+// kept while the zoom and the scene to image mapping are the same (panning renders new tiles only).
+// the tiles are rendered by the render scheduler, so panning and zooming are not blocked
+void FitsViewWidget::updateResampledTiles()
 {
-    return currentFilename;
+    if ( !resampledDisplayIsOn() ) return;
+    if ( !fitsImagePixmapItem ) return;
+
+    requestRender(RENDER_RESAMPLED);
 }
 
 
-void FitsViewWidget::getCuts(double *lcuts, double *hcuts)
+// a pass of the visible tiles from the viewport center: the missing and dirty tiles are resampled
+// bilinearly, then the drafts by Lanczos. batches of tiles are rendered until FITS_VIEW_RENDER_INTERVAL ms
+// are spent, the next pass is requested if there are tiles left
+void FitsViewWidget::renderResampledTiles()
 {
-    if ( lcuts != nullptr ) *lcuts = currentLowCut;
-    if ( hcuts != nullptr ) *hcuts = currentHighCut;
+    if ( !resampledDisplayIsOn() ) return;
+    if ( !fitsImagePixmapItem ) return;
+
+    // full-resolution pixels or the overview of out-of-core image
+    const double *channels[3] = {nullptr, nullptr, nullptr};
+    size_t src_dim[2] = {currentImage_dim[0], currentImage_dim[1]};
+    double step = 1.0;
+    int nchannels = 1;
+
+    if ( compositeIsOn ) {
+        for ( int i = 0; i < 3; ++i ) channels[i] = compositeImage_buffer[i].get();
+        nchannels = 3;
+    } else if ( outOfCoreIsOn ) {
+        if ( !overviewImage_buffer.empty() ) channels[0] = overviewImage_buffer.data();
+        src_dim[0] = overviewImage_dim[0], src_dim[1] = overviewImage_dim[1];
+        step = displayBinning;
+    } else {
+        channels[0] = currentImage_pixels;
+    }
+
+    for ( int i = 0; i < nchannels; ++i ) {
+        if ( !channels[i] ) return;
+    }
+
+    qreal zoom = std::abs(transform().m11());
+    if ( zoom <= 0.0 ) return;
+
+    QTransform to_image = fitsImagePixmapItem->sceneTransform().inverted()*QTransform::fromScale(displayBinning,displayBinning);
+    if ( (zoom != resampledZoom) || (to_image != resampledTransform) ) {
+        clearResampledTiles();
+        resampledZoom = zoom;
+        resampledTransform = to_image;
+    }
+
+    // tiles of FITS_VIEW_TILE_SIZE screen pixels which cover the image, the central ones first
+    const int tile_size = FITS_VIEW_TILE_SIZE;
+    qreal tile = tile_size/zoom;
+    QRectF visible = mapToScene(viewport()->rect()).boundingRect();
+    QRectF image_rect(0.0,0.0,currentImage_dim[0],currentImage_dim[1]);
+
+    std::vector<std::pair<long,long> > visible_tiles, tiles;
+    long tx_min = static_cast<long>(std::floor(visible.left()/tile));
+    long tx_max = static_cast<long>(std::floor(visible.right()/tile));
+    long ty_min = static_cast<long>(std::floor(visible.top()/tile));
+    long ty_max = static_cast<long>(std::floor(visible.bottom()/tile));
+
+    for ( long ty = ty_min; ty <= ty_max; ++ty ) {
+        for ( long tx = tx_min; tx <= tx_max; ++tx ) {
+            if ( to_image.mapRect(QRectF(tx*tile,ty*tile,tile,tile)).intersects(image_rect) ) visible_tiles.push_back(std::make_pair(tx,ty));
+        }
+    }
+
+    QPointF center = visible.center()/tile - QPointF(0.5,0.5);
+    std::sort(visible_tiles.begin(),visible_tiles.end(),[center](const std::pair<long,long> &a, const std::pair<long,long> &b) {
+        return std::hypot(a.first - center.x(),a.second - center.y()) < std::hypot(b.first - center.x(),b.second - center.y());
+    });
+
+    // image coordinates (QPixmap notation) of the center of the top-left tile pixel and the steps
+    // along the tile row and column (the rows go down on the screen, i.e. along -y of the scene).
+    // the source pixel k is displayed over the image pixels [k*step,(k+1)*step)
+    QPointF di = to_image.map(QPointF(1.0/zoom,0.0)) - to_image.map(QPointF(0.0,0.0));
+    QPointF dj = to_image.map(QPointF(0.0,-1.0/zoom)) - to_image.map(QPointF(0.0,0.0));
+
+    // Lanczos falls back to bilinear for minified image, so there is nothing to refine
+    bool lanczos = (resampleInterpolation == FitsViewWidget::RI_LANCZOS) &&
+                   (FitsViewAffineMap(0.0,0.0,di.x()/step,di.y()/step,dj.x()/step,dj.y()/step).scale() <= 1.0 + 1.0e-6);
+    bool refine = false;
+    size_t nmissing = 0;
+
+    for ( size_t i = 0; i < visible_tiles.size(); ++i ) {
+        auto it = resampledTiles.find(visible_tiles[i]);
+        if ( it == resampledTiles.end() ) ++nmissing;
+        if ( (it == resampledTiles.end()) || it->second.isDirty ) tiles.push_back(visible_tiles[i]);
+    }
+
+    if ( tiles.empty() && lanczos ) {
+        refine = true;
+        for ( size_t i = 0; i < visible_tiles.size(); ++i ) {
+            if ( resampledTiles[visible_tiles[i]].isDraft ) tiles.push_back(visible_tiles[i]);
+        }
+    }
+
+    if ( tiles.empty() ) return;
+
+    // drop invisible tiles if the new ones do not fit the cache
+    size_t tile_bytes = static_cast<size_t>(tile_size)*tile_size*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL;
+    size_t need = nmissing*tile_bytes;
+
+    for ( auto it = resampledTiles.begin(); (resampledTilesUsage + need > FITS_VIEW_MAX_RESAMPLED_CACHE_SIZE) && (it != resampledTiles.end()); ) {
+        if ( std::find(visible_tiles.begin(),visible_tiles.end(),it->first) == visible_tiles.end() ) {
+            delete it->second.item;
+            resampledTilesUsage -= tile_bytes;
+            it = resampledTiles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    std::vector<QPointF> origins(tiles.size());
+    std::vector<FitsViewAffineMap> maps(tiles.size());
+    for ( size_t i = 0; i < tiles.size(); ++i ) {
+        origins[i] = to_image.map(QPointF((tiles[i].first*tile_size + 0.5)/zoom,((tiles[i].second+1)*tile_size - 0.5)/zoom));
+        maps[i] = FitsViewAffineMap(origins[i].x()/step - 0.5,origins[i].y()/step - 0.5,
+                                    di.x()/step,di.y()/step,dj.x()/step,dj.y()/step);
+    }
+
+    double lcut[3], scale[3];
+    for ( int i = 0; i < 3; ++i ) {
+        double range = compositeHighCut[i]-compositeLowCut[i];
+        lcut[i] = compositeLowCut[i];
+        scale[i] = ( range > 0.0 ) ? 255.0/range : 0.0;
+    }
+
+    const QRgb *ct = currentCT.constData();
+    const quint64 *mask = activeBadPixelMask();
+    QRgb mask_color = badPixelMaskColor.rgba();
+    double nx = currentImage_dim[0];
+    double ny = currentImage_dim[1];
+    size_t npix = static_cast<size_t>(tile_size)*tile_size;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    size_t done = 0;
+    std::vector<QImage> images(FITS_VIEW_RESAMPLED_TILES_PER_BATCH);
+
+    while ( (done < tiles.size()) && ((done == 0) || (timer.elapsed() < FITS_VIEW_RENDER_INTERVAL)) ) {
+        long nbatch = std::min(tiles.size() - done,static_cast<size_t>(FITS_VIEW_RESAMPLED_TILES_PER_BATCH));
+
+        for ( long i = 0; i < nbatch; ++i ) {
+            images[i] = QImage(tile_size,tile_size,QImage::Format_ARGB32);
+            if ( images[i].isNull() ) {
+                syncCacheUsage();
+                currentError = FitsViewWidget::MemoryError;
+                emit fitsViewError(currentError);
+                return;
+            }
+        }
+
+#pragma omp parallel
+        {
+            std::vector<double> values(nchannels*npix);
+            std::vector<uchar> index(tile_size);
+
+#pragma omp for schedule(dynamic)
+            for ( long i = 0; i < nbatch; ++i ) {
+                size_t k = done + i;
+
+                for ( int c = 0; c < nchannels; ++c ) {
+                    if ( refine ) {
+                        fits_view_resample_lanczos(channels[c],src_dim[0],src_dim[1],maps[k],tile_size,tile_size,values.data() + c*npix);
+                    } else {
+                        fits_view_resample_bilinear(channels[c],src_dim[0],src_dim[1],maps[k],tile_size,tile_size,values.data() + c*npix);
+                    }
+                }
+
+                for ( int y = 0; y < tile_size; ++y ) {
+                    const double *row = values.data() + y*tile_size;
+                    QRgb *line = reinterpret_cast<QRgb*>(images[i].scanLine(y));
+
+                    if ( nchannels == 3 ) {
+                        composite_row(row,row+npix,row+2*npix,tile_size,1,lcut,scale,line);
+                    } else {
+                        currentStretch.apply(row,tile_size,index.data());
+                        for ( int x = 0; x < tile_size; ++x ) line[x] = ct[index[x]];
+                    }
+
+                    // transparent out of the image, the mask color over the bad pixels (the nearest ones)
+                    QPointF p = origins[k] + y*dj;
+                    for ( int x = 0; x < tile_size; ++x ) {
+                        double px = std::floor(p.x() + x*di.x());
+                        double py = std::floor(p.y() + x*di.y());
+                        if ( (px < 0.0) || (py < 0.0) || (px >= nx) || (py >= ny) ) {
+                            line[x] = 0;
+                        } else if ( mask && is_masked(mask,static_cast<size_t>(px) + static_cast<size_t>(py)*currentImage_dim[0]) ) {
+                            line[x] = blend_rgb(line[x],mask_color);
+                        }
+                    }
+                }
+            }
+        }
+
+        for ( long i = 0; i < nbatch; ++i ) {
+            const std::pair<long,long> &key = tiles[done + i];
+            auto it = resampledTiles.find(key);
+
+            if ( it == resampledTiles.end() ) {
+                ResampledTile rt;
+                rt.item = scene->addPixmap(QPixmap::fromImage(images[i]));
+                rt.item->setTransform(QTransform::fromScale(1.0/zoom,-1.0/zoom)); // the first row is the top one on the screen
+                rt.item->setPos(key.first*tile,(key.second+1)*tile);
+                rt.item->setZValue(-1.0); // under the regions
+
+                it = resampledTiles.insert(std::make_pair(key,rt)).first;
+                resampledTilesUsage += tile_bytes;
+            } else {
+                it->second.item->setPixmap(QPixmap::fromImage(images[i]));
+            }
+
+            it->second.isDirty = false;
+            it->second.isDraft = lanczos && !refine;
+        }
+
+        done += nbatch;
+    }
+
+    syncCacheUsage();
+
+    if ( (done < tiles.size()) || (lanczos && !refine) ) requestRender(RENDER_RESAMPLED);
 }
 
 
-void FitsViewWidget::setCutSigma(const double lcut_sigmas, const double hcut_sigmas)
+// the cuts, the color table or the mask were changed: the shown tiles are replaced when they are rendered
+void FitsViewWidget::redrawResampledTiles()
 {
-    if ( lcut_sigmas > 0.0 ) lowCutSigmas = lcut_sigmas;
-    if ( hcut_sigmas > 0.0 ) highCutSigmas = hcut_sigmas;
+    for ( auto it = resampledTiles.begin(); it != resampledTiles.end(); ++it ) it->second.isDirty = true;
+
+    updateResampledTiles();
 }
 
 
-void FitsViewWidget::setColorTable(FitsViewWidget::ColorTable ct)
+void FitsViewWidget::clearResampledTiles()
 {
-    generateCT(ct);
-    if ( currentError != FitsViewWidget::OK ) return;
-    currentCT_name = ct;
+    for ( auto it = resampledTiles.begin(); it != resampledTiles.end(); ++it ) delete it->second.item;
+    resampledTiles.clear();
+    resampledTilesUsage = 0;
+}
 
-    if ( !currentImage_buffer ) return;
 
-//    QImage im = QImage(currentScaledImage_buffer.get(),currentImage_dim[0],currentImage_dim[1],currentImage_dim[0],QImage::Format_Indexed8);
-//    im.setColorTable(currentCT);
 
-//    currentPixmap = QPixmap::fromImage(im);
-//    fitsImagePixmapItem->setPixmap(currentPixmap);
+        /*  PRIVATE METHODS  */
 
-    emit ColorTableIsChanged(ct);
+// scene size, zoom and center for entire image viewing
+void FitsViewWidget::resetView()
+{
+    // redefine scene size
+    scene->setSceneRect(-1.0*currentImage_dim[0],-1.0*currentImage_dim[1],2.0*currentImage_dim[0],2.0*currentImage_dim[1]);
+
+//    // compute zoom factor for entire image viewing
+////    qDebug() << view->viewport()->width();
+    double w, h;
+    rotated_extent(currentImage_dim,displayRotation,&w,&h);
+    qreal xzoom = 1.0*(this->viewport()->width()-2.0*FITS_VIEW_IMAGE_MARGIN)/w;
+    qreal yzoom = 1.0*(this->viewport()->height()-2.0*FITS_VIEW_IMAGE_MARGIN)/h;
+    currentZoomFactor = ( xzoom < yzoom ) ? xzoom : yzoom;
+
+//    qDebug() << xzoom << yzoom;
+
+    currentViewedSubImage.setWidth(currentImage_dim[0]);
+    currentViewedSubImage.setHeight(currentImage_dim[1]);
+    currentViewedSubImageCenter = QPointF(0.5*currentImage_dim[0]+0.5,0.5*currentImage_dim[1]+0.5);
+//    currentZoomFactor = 0.0; // full image
 }
 
 
-FitsViewWidget::ColorTable FitsViewWidget::getColorTable() const
+// free all image buffers and the pixmap
+void FitsViewWidget::releaseImage()
 {
-    return currentCT_name;
+    cancelRender();
+    ++imageGeneration;
+    clearResampledTiles();
+
+    compositeIsOn = false;
+    for ( int i = 0; i < 3; ++i ) compositeImage_buffer[i] = nullptr;
+    displayTileIsDirty.clear();
+    clearFilterCache();
+
+    currentImage_buffer = nullptr;
+    currentImage_pixels = nullptr;
+    currentScaledImage_buffer = nullptr;
+    currentImage_npix = 0;
+    currentImageIsInteger = false;
+    currentStretch.clearHistogram();
+
+    sidecarData = FitsViewSidecarData();
+    sidecarFilename = "";
+    sidecarIsModified = false;
+
+    registrationOffset = QPointF(0,0); // the next image is not registered yet
+    updateImageTransform();
+    currentNorthAngle = std::numeric_limits<double>::quiet_NaN();
+
+    if ( sharedMemory_ptr ) { // the image was displayed from shared memory segment
+        unmap_shared_memory(sharedMemory_ptr,sharedMemory_size);
+        sharedMemory_ptr = nullptr;
+        sharedMemory_size = 0;
+    }
+
+    outOfCoreIsOn = false;
+    tileCache->close();
+    std::vector<double>().swap(overviewImage_buffer);
+    overviewImage_dim[0] = 0, overviewImage_dim[1] = 0;
+    removeDetailTiles();
+
+    currentPixmap = QPixmap();
+    if ( fitsImagePixmapItem ) fitsImagePixmapItem->setPixmap(currentPixmap);
+
+    setMemoryUsage(FitsViewMemoryGovernor::ImageData,0);
+    setMemoryUsage(FitsViewMemoryGovernor::ScaledImage,0);
+    setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,0);
+    setMemoryUsage(FitsViewMemoryGovernor::Cache,0);
 }
 
 
-void FitsViewWidget::setMaxSampleLength(size_t nelem)
+// the displayed image is moved, so the reference pixel (x,y) and the image pixel (x,y)+offset coincide
+void FitsViewWidget::setRegistrationOffset(const QPointF &offset)
 {
-    maxSampleLength = nelem;
+    registrationOffset = offset;
+
+    updateImageTransform();
+    updateResampledTiles();
 }
 
 
-void FitsViewWidget::centerOn(qreal x, qreal y)
+bool FitsViewWidget::resampledDisplayIsOn() const
 {
-    currentViewedSubImageCenter.setX(x);
-    currentViewedSubImageCenter.setY(y);
+    return (displayRotation != 0.0) || displayFlip;
+}
 
-    // convert from FITS image pixel cordinates to the scene ones
-    QPointF cen = QPointF(x-0.5,y-0.5);
-    cen = fitsImagePixmapItem->mapToScene(currentViewedSubImageCenter);
 
-//    view->centerOn(x,y);
-    QGraphicsView::centerOn(cen);
-//    qDebug() << "recentering: " << cen;
+// flip of the x-axis and counter-clockwise rotation (the scene y-axis is up on the screen)
+QTransform FitsViewWidget::displayRotationTransform() const
+{
+    QTransform tr;
+    if ( displayFlip ) tr = QTransform::fromScale(-1.0,1.0);
+
+    return tr*QTransform().rotate(displayRotation);
 }
 
 
-void FitsViewWidget::centerOn(QPointF &pos)
+// registration offset, flip and rotation about the image center are the transformation of the pixmap item.
+// it acts after the item scale (displayBinning), i.e. in image pixels. the image coordinates are mapped
+// through the item, so they stay native
+void FitsViewWidget::updateImageTransform()
 {
-    centerOn(pos.x(),pos.y());
+    if ( !fitsImagePixmapItem ) return;
+
+    QPointF c(0.5*currentImage_dim[0],0.5*currentImage_dim[1]);
+
+    QTransform tr = QTransform::fromTranslate(-registrationOffset.x() - c.x(),-registrationOffset.y() - c.y());
+    tr *= displayRotationTransform();
+    tr *= QTransform::fromTranslate(c.x(),c.y());
+
+    fitsImagePixmapItem->setTransform(tr);
+    fitsImagePixmapItem->setVisible(!resampledDisplayIsOn()); // the resampled tiles are shown instead
 }
 
 
-QPointF FitsViewWidget::getImageCenter() const
+
+// the requests are merged into one render of the current image. rotation and filter changes
+// do not make a pending render stale: the render reads the display state when it runs
+void FitsViewWidget::requestRender(int flags)
 {
-    return currentViewedSubImageCenter;
+    if ( renderGeneration != imageGeneration ) cancelRender(); // requested for the released image
+    renderGeneration = imageGeneration;
+
+    renderFlags |= flags;
+    if ( flags != RENDER_RESAMPLED ) ++renderRequests; // the passes of the resampled tiles are not renders
+
+    if ( !renderTimer->isActive() ) renderTimer->start();
 }
 
 
-void FitsViewWidget::setRubberBandPen(const QPen &pen)
+// render pending changes (and 'flags') immediately
+void FitsViewWidget::flushRender(int flags)
 {
-    if ( rubberBand ) rubberBand->setPen(pen);
+    if ( renderGeneration != imageGeneration ) cancelRender();
+    renderGeneration = imageGeneration;
+
+    renderFlags |= flags;
+    renderTimer->stop();
+
+    renderImage();
 }
 
 
-void FitsViewWidget::setZoom(const qreal zoom_factor)
+// pending render of the released image is stale
+void FitsViewWidget::cancelRender()
 {
-    if ( !currentScaledImage_buffer ) return;
+    if ( !renderFlags ) return;
 
-    if ( zoom_factor <= 0.0 ) return;
+    renderTimer->stop();
+    renderCancelledCount += renderRequests;
+    renderFlags = 0;
+    renderRequests = 0;
+}
 
-    currentZoomFactor = zoom_factor;
-    QTransform tr(zoom_factor,0.0,0.0,-zoom_factor,0.0,0.0);
-    this->setTransform(tr);
+
+// 8-bit color table indices of displayed image for the current cuts
+bool FitsViewWidget::scaleImage()
+{
+    // the overview is displayed for out-of-core image
+    const double *image = outOfCoreIsOn ? overviewImage_buffer.data() : currentImage_pixels;
+    size_t npix = outOfCoreIsOn ? overviewImage_buffer.size() : currentImage_npix;
+
+    if ( (image == nullptr) || (npix == 0) ) return false;
+
+    if ( !currentScaledImage_buffer ) { // it could be evicted under memory pressure
+        try {
+            if ( !setMemoryUsage(FitsViewMemoryGovernor::ScaledImage,npix) ) throw std::bad_alloc();
+            currentScaledImage_buffer = std::unique_ptr<uchar[]>(new uchar[npix]);
+        } catch (std::bad_alloc &ex) {
+            setMemoryUsage(FitsViewMemoryGovernor::ScaledImage,0);
+            currentError = FitsViewWidget::MemoryError;
+            emit fitsViewError(currentError);
+            return false;
+        }
+    }
+
+    // the histogram is computed once per image, a stretch change costs the table build and the gather pass
+    if ( (currentStretch.getType() == FitsViewStretch::ST_HISTEQ) && !currentStretch.hasHistogram() ) {
+        currentStretch.computeHistogram(image,npix,currentImageMinVal,currentImageMaxVal,currentImageIsInteger,
+                                        outOfCoreIsOn ? nullptr : activeBadPixelMask());
+        sidecarIsModified = true;
+        storeSidecar();
+    }
+
+    currentStretch.build(currentLowCut,currentHighCut,currentImageIsInteger);
+    currentStretch.apply(image,npix,currentScaledImage_buffer.get());
+
+    return true;
 }
 
 
-void FitsViewWidget::incrementZoom(const qreal zoom_inc)
+bool FitsViewWidget::setMemoryUsage(FitsViewMemoryGovernor::Category cat, size_t bytes)
 {
-    if ( !currentScaledImage_buffer ) return;
+    FitsViewMemoryGovernor *governor = FitsViewMemoryGovernor::instance();
 
-    if ( zoom_inc <= 0.0 ) return;
+    bool is_requested = memoryIsRequested; // evictMemory could be called from inside for this widget
+    memoryIsRequested = true;
+    bool ok = governor->setUsage(this,cat,bytes);
+    memoryIsRequested = is_requested;
 
-//    qDebug() << "inc: " << zoom_inc;
+    if ( !ok ) return false;
 
-    this->scale(zoom_inc,zoom_inc);
+    emit memoryUsageIsChanged(governor->getUsage(this),governor->getUsage());
 
-    emit zoomIsChanged(zoom_inc);
+    return true;
+}
 
-//    currentZoomFactor *= zoom_inc;
 
-//    // recompute current viewed sub-image
-//    currentViewedSubImage = view->mapToScene(view->viewport()->rect()).boundingRect();
-//    if ( currentViewedSubImage.width() > currentImage_dim[0] ) currentViewedSubImage.setWidth(currentImage_dim[0]);
-//    if ( currentViewedSubImage.height() > currentImage_dim[1] ) currentViewedSubImage.setHeight(currentImage_dim[1]);
+// the finest pixmap resolution (power of 2 binning) which fits the memory budget
+bool FitsViewWidget::chooseDisplayBinning()
+{
+    for ( int bin = 1; bin <= FITS_VIEW_MAX_DISPLAY_BINNING; bin *= 2 ) {
+        size_t w = (currentImage_dim[0]+bin-1)/bin;
+        size_t h = (currentImage_dim[1]+bin-1)/bin;
 
-//    qDebug() << view->transform();
+        if ( setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,w*h*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL) ) {
+            displayBinning = bin;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// twice coarser pixmap of displayed in-core image under memory pressure, returns the number of freed bytes.
+// the nearest pixels of the current pixmap are shown until the pending render rebuilds it
+size_t FitsViewWidget::increaseDisplayBinning()
+{
+    if ( !imageIsLoaded || outOfCoreIsOn || !fitsImagePixmapItem || currentPixmap.isNull() ) return 0;
+    if ( 2*displayBinning > FITS_VIEW_MAX_DISPLAY_BINNING ) return 0;
+
+    size_t layers = activeBadPixelMask() ? 2 : 1; // the mask overlay has the pixmap resolution
+    size_t old_bytes = layers*currentPixmap.width()*currentPixmap.height()*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL;
+
+    displayBinning *= 2;
+    int w = (currentImage_dim[0]+displayBinning-1)/displayBinning;
+    int h = (currentImage_dim[1]+displayBinning-1)/displayBinning;
+    size_t new_bytes = layers*w*h*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL;
+
+    currentPixmap = currentPixmap.scaled(w,h,Qt::IgnoreAspectRatio,Qt::FastTransformation);
+    fitsImagePixmapItem->setPixmap(currentPixmap);
+    fitsImagePixmapItem->setScale(displayBinning);
+    updateImageTransform();
+
+    // composite and filtered tiles are rendered again at the new resolution
+    if ( !displayTileIsDirty.empty() ) {
+        displayTiles_dim[0] = (w + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+        displayTiles_dim[1] = (h + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+        displayTileIsDirty.assign(displayTiles_dim[0]*displayTiles_dim[1],1);
+    }
+    clearFilterCache();
+
+    setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,new_bytes);
+    updateBadPixelMaskItem();
+
+    requestRender(RENDER_PIXMAP);
+
+    return old_bytes - new_bytes;
+}
+
+
+// convert scaled image to pixmap. for displayBinning > 1 every displayBinning-th pixel is taken
+QPixmap FitsViewWidget::scaledImageToPixmap()
+{
+    if ( outOfCoreIsOn ) { // the overview is already decimated
+        QImage im = QImage(currentScaledImage_buffer.get(),overviewImage_dim[0],overviewImage_dim[1],overviewImage_dim[0],QImage::Format_Indexed8);
+        im.setColorTable(currentCT);
+
+        return QPixmap::fromImage(im);
+    }
+
+    if ( displayBinning == 1 ) {
+        QImage im = QImage(currentScaledImage_buffer.get(),currentImage_dim[0],currentImage_dim[1],currentImage_dim[0],QImage::Format_Indexed8);
+        im.setColorTable(currentCT);
+
+        return QPixmap::fromImage(im);
+    }
+
+    int w = (currentImage_dim[0]+displayBinning-1)/displayBinning;
+    int h = (currentImage_dim[1]+displayBinning-1)/displayBinning;
+
+    QImage im = QImage(w,h,QImage::Format_Indexed8);
+    if ( im.isNull() ) return QPixmap();
+
+    for ( int y = 0; y < h; ++y ) {
+        const uchar *src = currentScaledImage_buffer.get() + static_cast<size_t>(y)*displayBinning*currentImage_dim[0];
+        uchar *dst = im.scanLine(y);
+        for ( int x = 0; x < w; ++x ) dst[x] = src[x*displayBinning];
+    }
+    im.setColorTable(currentCT);
+
+    return QPixmap::fromImage(im);
+}
+
+
+QPointF FitsViewWidget::mapSceneToImage(const QPointF &pos) const
+{
+    return fitsImagePixmapItem->mapFromScene(pos)*displayBinning;
+}
+
+
+QRectF FitsViewWidget::mapSceneToImage(const QRectF &rect) const
+{
+    QRectF r = fitsImagePixmapItem->mapFromScene(rect).boundingRect();
+
+    return QRectF(r.topLeft()*displayBinning,r.bottomRight()*displayBinning);
+}
+
+
+QPointF FitsViewWidget::mapImageToScene(const QPointF &pos) const
+{
+    return fitsImagePixmapItem->mapToScene(pos/displayBinning);
+}
+
+
+QRect FitsViewWidget::visibleImageRect() const
+{
+    if ( !fitsImagePixmapItem ) return QRect();
+
+    QRectF rect = mapSceneToImage(mapToScene(viewport()->rect()).boundingRect());
+
+    return rect.toAlignedRect().intersected(QRect(0,0,currentImage_dim[0],currentImage_dim[1]));
+}
+
+
+// the band is rotated with the image, so its sides are along the image axes
+QRectF FitsViewWidget::rubberBandImageRect() const
+{
+    QRectF r = fitsImagePixmapItem->mapFromItem(rubberBand,rubberBand->rect().normalized()).boundingRect();
+
+    return QRectF(r.topLeft()*displayBinning,r.bottomRight()*displayBinning);
+}
+
+
+// read 2D image from the opened file into currentImage_buffer, the file is closed.
+// returns CFITSIO status, std::bad_alloc is propagated to the caller
+int FitsViewWidget::readImage(fitsfile *FITS_fptr, double *exptime)
+{
+    int fits_status = 0;
+    FitsViewCfitsioLock cfitsio_lock;
+
+    // THE ONLY 2D-images is support now!!!
+    int maxdim = 2;
+    long naxes[maxdim];
+    int naxis, bitpix;
+    LONGLONG nelem = 1;
+
+    try {
+        fits_read_imghdr(FITS_fptr, maxdim, NULL, &bitpix, &naxis, naxes, NULL, NULL, NULL, &fits_status);
+        if ( fits_status ) throw fits_status;
+
+        *exptime = read_fits_exptime(FITS_fptr);
+        read_fits_north(FITS_fptr,&currentNorthAngle,&currentNorthFlip); // NaN if there is no WCS
+
+        int equiv_bitpix; // BSCALE and BZERO are taken into account
+        fits_get_img_equivtype(FITS_fptr, &equiv_bitpix, &fits_status);
+        if ( fits_status ) throw fits_status;
+        currentImageIsInteger = equiv_bitpix > 0;
+
+        for ( int i = 0; i < maxdim; ++i ) {
+            nelem *= naxes[i];
+            currentImage_dim[i] = naxes[i];
+        }
+
+        currentImage_npix = nelem;
+        if ( !setMemoryUsage(FitsViewMemoryGovernor::ImageData,currentImage_npix*sizeof(double)) ) throw std::bad_alloc();
+        currentImage_buffer = std::unique_ptr<double[]>(new double[currentImage_npix]);
+        currentImage_pixels = currentImage_buffer.get();
+        double *buffer = currentImage_buffer.get();
+
+        fits_read_img(FITS_fptr, TDOUBLE, 1, nelem, NULL, (void*) buffer, NULL, &fits_status);
+        if ( fits_status ) throw fits_status;
+
+        fits_close_file(FITS_fptr, &fits_status);
+
+    } catch (std::bad_alloc &ex) {
+        int status = 0;
+        fits_close_file(FITS_fptr, &status);
+        throw;
+    } catch (int err) {
+        int status = 0;
+        fits_close_file(FITS_fptr, &status);
+        return err;
+    }
+
+    return fits_status;
+}
+
+
+// the buffer for image of the given dimensions: own one or the caller's pixels (external != nullptr)
+bool FitsViewWidget::prepareBuffer(const size_t nx, const size_t ny, const double *external)
+{
+    cancelRender();
+    imageIsLoaded = false;
+    currentError = FitsViewWidget::OK;
+
+    releaseImage();
+
+    if ( (nx == 0) || (ny == 0) ) {
+        currentError = FitsViewWidget::BadRegion;
+        emit fitsViewError(currentError);
+        return false;
+    }
+
+    currentImage_dim[0] = nx;
+    currentImage_dim[1] = ny;
+    currentImage_npix = nx*ny;
+    currentFilename = "";
+
+    if ( external ) { // the caller guarantees the pixels are alive until the next load, there is no own buffer
+        currentImage_pixels = external;
+        return true;
+    }
+
+    try {
+        if ( !setMemoryUsage(FitsViewMemoryGovernor::ImageData,currentImage_npix*sizeof(double)) ) throw std::bad_alloc();
+        currentImage_buffer = std::unique_ptr<double[]>(new double[currentImage_npix]);
+        currentImage_pixels = currentImage_buffer.get();
+    } catch (std::bad_alloc &ex) {
+        releaseImage();
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return false;
+    }
+
+    return true;
 }
 
 
-qreal FitsViewWidget::getZoom() const
+// calibration, the image range, the cuts and the pixmap for the pixels of currentImage_dim dimensions.
+// the pixels are converted into currentImage_buffer in the same pass
+// (if they are the buffer itself and there is no calibration, they are not written)
+template<class T>
+void FitsViewWidget::ingestImage(const T *pixels, const double exptime, const bool autoscale,
+                                 const FitsViewSidecarData *cached)
 {
-    return currentZoomFactor;
-}
+    imageIsLoaded = true;
 
+    // the longest possible profile is along the image diagonal,
+    // so there will be no allocations while the line is dragged
+    profileBuffer.reserve(static_cast<int>(std::hypot(currentImage_dim[0],currentImage_dim[1])) + 2);
 
-void FitsViewWidget::zoomFitInView()
-{
-    // compute zoom factor for entire image viewing
-    qreal xzoom = 1.0*(this->viewport()->width()-2.0*FITS_VIEW_IMAGE_MARGIN)/currentImage_dim[0];
-    qreal yzoom = 1.0*(this->viewport()->height()-2.0*FITS_VIEW_IMAGE_MARGIN)/currentImage_dim[1];
+    const double *bias = calibrationBias.get();
+    const double *dark = calibrationDark.get();
+    const double *flat = calibrationFlat.get();
+    double dark_scale = 1.0;
 
-    // FITS coordinate system starts from (1,1) and its origin is at the center of pixel
-    currentViewedSubImageCenter = QPointF(0.5*currentImage_dim[0]+0.5,0.5*currentImage_dim[1]+0.5);
-    currentViewedSubImage.setWidth(currentImage_dim[0]);
-    currentViewedSubImage.setHeight(currentImage_dim[1]);
+    if ( calibrationIsOn && (bias || dark || flat) ) {
+        if ( !calibrationIsApplied(currentImage_dim[0],currentImage_dim[1]) ) {
+            currentError = FitsViewWidget::BadCalibrationFrame; // the raw image is shown
+            emit fitsViewError(currentError);
+            bias = dark = flat = nullptr;
+        }
+        if ( (calibrationDarkExptime > 0.0) && (exptime > 0.0) ) {
+            dark_scale = exptime/calibrationDarkExptime;
+        } else if ( dark ) {
+            currentError = FitsViewWidget::UnknownExposureTime; // the dark is subtracted unscaled
+            emit fitsViewError(currentError);
+        }
+    } else {
+        bias = dark = flat = nullptr;
+    }
 
-    centerOn(currentViewedSubImageCenter);
+    const quint64 *mask = activeBadPixelMask();
+    if ( !badPixelMask.empty() && !mask ) {
+        currentError = FitsViewWidget::BadPixelMask; // the mask does not match the image
+        emit fitsViewError(currentError);
+    }
 
-    setZoom(( xzoom < yzoom ) ? xzoom : yzoom);
-}
+    if ( std::numeric_limits<T>::is_integer ) currentImageIsInteger = true;
+    if ( bias || dark || flat ) currentImageIsInteger = false; // calibrated values are not integer
 
+    // the caller's pixels (there is no own buffer) are never written, loadBuffer keeps them uncalibrated
+    double *buffer = currentImage_buffer.get();
+    if ( !buffer ) bias = dark = flat = nullptr;
 
-        /*  PROTECTED METHODS  */
+    bool in_place = static_cast<const void*>(pixels) == static_cast<const void*>(currentImage_pixels);
+    double *dst = ( in_place && !bias && !dark && !flat ) ? nullptr : buffer;
 
-void FitsViewWidget::mouseMoveEvent(QMouseEvent *event)
-{
-    if ( !currentScaledImage_buffer ) return;
+    if ( dst || bias || dark || flat || mask ) cached = nullptr; // the cached products are of the raw pixels
 
-    QPointF pos = this->mapToScene(event->pos());
+    sidecarData.sourceStep = 1;
+    sidecarIsModified = !cached;
 
-    pos = fitsImagePixmapItem->mapFromScene(pos);
+    if ( cached ) { // nothing to convert, the image range is known
+        currentImageMinVal = cached->minVal;
+        currentImageMaxVal = cached->maxVal;
+        currentStretch.setHistogram(cached->histogram,cached->histogramMin,cached->histogramStep);
+    } else { // conversion, calibration and the image range in the single pass
+        calibrate_image(pixels,dst,currentImage_npix,bias,dark,dark_scale,flat,mask,&currentImageMinVal,&currentImageMaxVal);
+    }
 
-    if ( pos.x() >= 0.0 && pos.y() >= 0.0 && pos.x() < currentImage_dim[0] && pos.y() < currentImage_dim[1] ) {
-        quint32 x = (quint32)pos.x();
-        quint32 y = (quint32)pos.y();
+    currentLowCut = currentImageMinVal;
+    currentHighCut = currentImageMaxVal;
 
-        pos += QPointF(0.5,0.5); // convert to FITS pixel notation
+    if ( autoscale ) autoCuts(currentImage_pixels,currentImage_npix,mask,cached);
+    rescale(currentLowCut,currentHighCut);
 
-        double value = currentImage_buffer[x + y*currentImage_dim[0]];
+    // convert to pixmap (reduced resolution if the full one does not fit the memory budget).
+    // the only conversion of the image is made here
+    if ( chooseDisplayBinning() ) flushRender(RENDER_SCALE);
 
-        emit imagePoint(pos,value);
+    if ( currentPixmap.isNull() ) {
+        releaseImage();
+        imageIsLoaded = false;
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return;
     }
 
-    if ( rubberBandIsActive && (event->buttons() & Qt::LeftButton) ) {
+    resetView();
 
-        rubberBand->setVisible(true);
-        rubberBandIsShown = true;
+    if ( autoRegistrationIsOn && !registrationCoarse.empty() ) registerImage();
+}
 
-        pos = this->mapToScene(event->pos());
 
-        rubberBandEnd =  fitsImagePixmapItem->mapFromScene(pos);
+// cuts from the sample of the buffer or the cached ones if they were computed with the same parameters
+void FitsViewWidget::autoCuts(const double *buffer, size_t npix, const quint64 *mask, const FitsViewSidecarData *cached)
+{
+    if ( cached && cached->hasAutocut && (cached->sampleLength == maxSampleLength) &&
+         (cached->lowCutSigmas == lowCutSigmas) && (cached->highCutSigmas == highCutSigmas) ) {
+        currentLowCut = cached->lowCut;
+        currentHighCut = cached->highCut;
+    } else {
+        std::vector<double> sample;
+
+        strided_sample(buffer,npix,maxSampleLength,sample,mask);
+        computeCuts(sample,&currentLowCut,&currentHighCut);
+        sidecarIsModified = true;
+    }
+
+    sidecarData.hasAutocut = true;
+    sidecarData.sampleLength = maxSampleLength;
+    sidecarData.lowCutSigmas = lowCutSigmas;
+    sidecarData.highCutSigmas = highCutSigmas;
+    sidecarData.lowCut = currentLowCut;
+    sidecarData.highCut = currentHighCut;
+}
 
-        if ( rubberBandEnd.x() < 0 ) {
-            rubberBandEnd.setX(0.0);
-        }
-        if ( rubberBandEnd.y() < 0 ) {
-            rubberBandEnd.setY(0.0);
-        }
-        if ( rubberBandEnd.x() >= currentImage_dim[0] ) {
-            rubberBandEnd.setX(currentImage_dim[0]-1);
-        }
-        if ( rubberBandEnd.y() >= currentImage_dim[1] ) {
-            rubberBandEnd.setY(currentImage_dim[1]-1);
-        }
 
-        rubberBandEnd =  fitsImagePixmapItem->mapToScene(rubberBandEnd);
+// write the products of the current file if they were computed (not taken from the cache)
+void FitsViewWidget::storeSidecar()
+{
+    if ( sidecarFilename.isEmpty() || !sidecarIsModified ) return;
+
+    sidecarData.minVal = currentImageMinVal;
+    sidecarData.maxVal = currentImageMaxVal;
+    currentStretch.getHistogram(sidecarData.histogram,&sidecarData.histogramMin,&sidecarData.histogramStep);
 
-        rubberBand->setRect(QRectF(rubberBandOrigin, rubberBandEnd).normalized());
+    // the overview is lent to the record, it is not copied
+    if ( outOfCoreIsOn ) {
+        sidecarData.overview.swap(overviewImage_buffer);
+        sidecarData.overviewDim[0] = overviewImage_dim[0];
+        sidecarData.overviewDim[1] = overviewImage_dim[1];
     }
 
+    sidecarCache.write(sidecarFilename,sidecarData); // the cache is optional, failures are ignored
 
-//    qDebug() << pos;
+    if ( outOfCoreIsOn ) sidecarData.overview.swap(overviewImage_buffer);
+
+    sidecarIsModified = false;
 }
 
 
-void FitsViewWidget::mouseDoubleClickEvent(QMouseEvent *event)
+bool FitsViewWidget::calibrationIsApplied(const size_t nx, const size_t ny) const
 {
-    if ( !currentScaledImage_buffer ) return;
+    if ( !calibrationIsOn ) return false;
+    if ( !calibrationBias && !calibrationDark && !calibrationFlat ) return false;
 
-    currentViewedSubImageCenter =  this->mapToScene( event->pos() );
+    return (calibration_dim[0] == nx) && (calibration_dim[1] == ny);
+}
 
-    QGraphicsView::centerOn(currentViewedSubImageCenter);
 
-//    qDebug() << "doubleClick (mouse pos): " << event->pos();
-//    qDebug() << "doubleClick (imcenter scene): " << currentViewedSubImageCenter;
-//    qDebug() << "doubleClick: (image pixel)" << fitsImagePixmapItem->mapFromScene(currentViewedSubImageCenter);
+// read master frame. all master frames must have the same dimensions
+bool FitsViewWidget::loadCalibrationFrame(const QString &filename, std::unique_ptr<double[]> &frame, double *exptime)
+{
+    currentError = FitsViewWidget::OK;
 
-    // convert to FITS pixels coordinates
-    currentViewedSubImageCenter = fitsImagePixmapItem->mapFromScene(currentViewedSubImageCenter) + QPointF(0.5,0.5);
+    size_t dim[2];
+    std::unique_ptr<double[]> buffer;
+    int fits_status;
 
+    // the other frames (the replaced one does not matter)
+    size_t nframes = 0;
+    if ( calibrationBias && (&frame != &calibrationBias) ) ++nframes;
+    if ( calibrationDark && (&frame != &calibrationDark) ) ++nframes;
+    if ( calibrationFlat && (&frame != &calibrationFlat) ) ++nframes;
 
-    qreal incr;
+    // master frames are resident and are not evicted under memory pressure.
+    // the budget is reserved before the frame is allocated
+    auto reserve = [this,nframes](size_t nx, size_t ny) -> int {
+        if ( nframes && ((nx != calibration_dim[0]) || (ny != calibration_dim[1])) ) return FitsViewWidget::BadCalibrationFrame;
 
-    if ( event->button() == Qt::LeftButton ) {
-            incr = zoomIncrement;
+        size_t bytes = (nframes+1)*nx*ny*sizeof(double) + badPixelMask.size()*sizeof(quint64);
+        if ( !setMemoryUsage(FitsViewMemoryGovernor::Calibration,bytes) ) return FitsViewWidget::MemoryError;
+        return 0;
+    };
+
+    try {
+        fits_status = read_fits_image(filename,1,buffer,dim,exptime,reserve);
+    } catch (std::bad_alloc &ex) {
+        fits_status = FitsViewWidget::MemoryError;
     }
-    if ( event->button() == Qt::RightButton ) {
-            incr = 1.0/zoomIncrement;
+
+    if ( fits_status ) {
+        updateCalibrationUsage(); // the reserved budget is returned
+        currentError = fits_status;
+        emit fitsViewError(currentError);
+        return false;
     }
 
-    incrementZoom(incr);
+    calibration_dim[0] = dim[0];
+    calibration_dim[1] = dim[1];
+    frame = std::move(buffer);
+
+    return true;
 }
 
 
-void FitsViewWidget::wheelEvent(QWheelEvent *event)
+void FitsViewWidget::updateCalibrationUsage()
 {
-    if ( !currentImage_buffer ) return;
-    int numDegrees = event->delta() / 8;
+    size_t nframes = (calibrationBias ? 1 : 0) + (calibrationDark ? 1 : 0) + (calibrationFlat ? 1 : 0);
+    size_t bytes = nframes*calibration_dim[0]*calibration_dim[1]*sizeof(double) + badPixelMask.size()*sizeof(quint64);
 
-    int numSteps = numDegrees / 15; // see QWheelEvent documentation
-
-    qreal factor = 1.0+qreal(numSteps)*0.1;
-    qDebug() << "factor(wheel) = " << factor;
-    incrementZoom(factor);
+    setMemoryUsage(FitsViewMemoryGovernor::Calibration,bytes);
 }
 
 
-void FitsViewWidget::mousePressEvent(QMouseEvent *event)
+const quint64* FitsViewWidget::activeBadPixelMask() const
 {
-    if ( !currentImage_buffer ) return;
-
-    if ( event->button() == Qt::LeftButton ) {
-        if ( rubberBandIsShown ) {
-            scene->removeItem(rubberBand);
-            rubberBandIsShown = false;
-            emit regionWasDeselected();
-        }
-
-        rubberBandOrigin = this->mapToScene(event->pos());
-        rubberBandOrigin = fitsImagePixmapItem->mapFromScene(rubberBandOrigin);
-
-        // prevent rectangle conner is out of image
-        if ( rubberBandOrigin.x() < 0 ) {
-            rubberBandOrigin.setX(0.0);
-        }
-        if ( rubberBandOrigin.x() >= currentImage_dim[0] ) {
-            rubberBandOrigin.setX(currentImage_dim[0]-1);
-        }
-
-        if ( rubberBandOrigin.y() < 0 ) {
-            rubberBandOrigin.setY(0.0);
-        }
-        if ( rubberBandOrigin.y() >= currentImage_dim[1] ) {
-            rubberBandOrigin.setY(currentImage_dim[1]-1);
-        }
+    if ( badPixelMask.empty() ) return nullptr;
+    if ( (badPixelMask_dim[0] != currentImage_dim[0]) || (badPixelMask_dim[1] != currentImage_dim[1]) ) return nullptr;
 
-        rubberBandOrigin = fitsImagePixmapItem->mapToScene(rubberBandOrigin);
+    return badPixelMask.data();
+}
 
-        rubberBandEnd = QPointF(rubberBandOrigin);
-        rubberBand = scene->addRect(QRectF(rubberBandOrigin, QSize()),rubberBandPen);
 
-        rubberBand->setVisible(false);
-        rubberBandIsActive = true;
+// masked pixels are drawn by the mask color over the image pixmap (the same resolution).
+// the overlay does not depend on the cuts and the color table
+void FitsViewWidget::updateBadPixelMaskItem()
+{
+    if ( badPixelMaskItem ) {
+        delete badPixelMaskItem;
+        badPixelMaskItem = nullptr;
     }
 
-    if ( event->button() == Qt::RightButton ) {
-        if ( rubberBandIsShown ) {
-            scene->removeItem(rubberBand);
-            rubberBandIsActive = false;
-            rubberBandIsShown = false;
-            emit regionWasDeselected();
-
-            double lcut, hcut;
+    if ( !fitsImagePixmapItem || currentPixmap.isNull() ) return;
 
-            // create pixels sample
-            std::vector<double> sample;
+    size_t pixmap_bytes = static_cast<size_t>(currentPixmap.width())*currentPixmap.height()*FITS_VIEW_PIXMAP_BYTES_PER_PIXEL;
 
-            QRectF region = fitsImagePixmapItem->mapFromScene(rubberBand->rect()).boundingRect();
-            getSubImage(sample,region);
-            computeCuts(sample,&lcut,&hcut);
-            rescale(lcut,hcut);
-        }
+    const quint64 *mask = activeBadPixelMask();
+    if ( !mask ) {
+        setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,pixmap_bytes);
+        return;
     }
 
-}
+    int w = currentPixmap.width();
+    int h = currentPixmap.height();
 
+    QImage im;
+    if ( setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,2*pixmap_bytes) ) im = QImage(w,h,QImage::Format_MonoLSB);
 
-void FitsViewWidget::mouseReleaseEvent(QMouseEvent *event)
-{
-    if ( event->button() == Qt::LeftButton ) {
-        if ( rubberBandIsShown ) {
-            rubberBandIsActive = false;
-            QRectF rect = rubberBand->rect().normalized();
-            rect = fitsImagePixmapItem->mapFromScene(rect).boundingRect();
+    if ( im.isNull() ) {
+        setMemoryUsage(FitsViewMemoryGovernor::DisplayPixmap,pixmap_bytes);
+        currentError = FitsViewWidget::MemoryError;
+        emit fitsViewError(currentError);
+        return;
+    }
 
-            // convert to FITS notation: the first pixel has coordinates [1,1] and integer coordinate is at th center of pixel
+    QVector<QRgb> ct(2);
+    ct[0] = qRgba(0,0,0,0); // transparent
+    ct[1] = badPixelMaskColor.rgba();
+    im.setColorTable(ct);
 
-            rect.setX(rect.x()+0.5);
-            rect.setY(rect.y()+0.5);
+    size_t step = displayBinning;
+    for ( int y = 0; y < h; ++y ) {
+        uchar *line = im.scanLine(y);
+        std::fill(line,line+im.bytesPerLine(),0);
 
-            emit regionWasSelected(rect);
+        size_t offset = y*step*currentImage_dim[0];
+        for ( int x = 0; x < w; ++x ) {
+            line[x >> 3] |= static_cast<uchar>(is_masked(mask,offset + x*step)) << (x & 7);
         }
     }
+
+    badPixelMaskItem = new QGraphicsPixmapItem(QPixmap::fromImage(im),fitsImagePixmapItem);
+    badPixelMaskItem->setZValue(1.0); // over the detail tiles of out-of-core image
 }
 
 
-void FitsViewWidget::keyPressEvent(QKeyEvent *event)
+void FitsViewWidget::loadComposite(const QString filename[3], const long plane[3], const bool autoscale)
 {
-    if ( !currentScaledImage_buffer ) return;
+    cancelRender();
+    imageIsLoaded = false;
 
-    switch ( event->key() ) {
-        case Qt::Key_Escape: {
-            zoomFitInView();
-            break;
-        }
-        default: {
-            qDebug() << "Pressed key: " << event->key();
-        }
-    }
-}
+    releaseImage();
 
+    currentError = FitsViewWidget::OK;
 
-void FitsViewWidget::resizeEvent(QResizeEvent *event)
-{
-    if ( !currentScaledImage_buffer ) return;
+    size_t dim[2];
 
-    if ( event->oldSize().width() < 0 || event->oldSize().height() < 0 ) return; // initial resizing (by calling show())
+    try {
+        for ( int i = 0; i < 3; ++i ) {
+            // the budget of the channel is reserved before it is allocated
+            auto reserve = [this,i](size_t nx, size_t ny) -> int {
+                if ( (i > 0) && ((nx != currentImage_dim[0]) || (ny != currentImage_dim[1])) ) return FitsViewWidget::BadCompositeImage;
+                if ( !setMemoryUsage(FitsViewMemoryGovernor::ImageData,(i+1)*nx*ny*sizeof(double)) ) return FitsViewWidget::MemoryError;
+                return 0;
+            };
+
+            int fits_status = read_fits_image(filename[i],plane[i],compositeImage_buffer[i],dim,nullptr,reserve);
+            if ( fits_status ) throw fits_status;
+
+            if ( i == 0 ) {
+                currentImage_dim[0] = dim[0];
+                currentImage_dim[1] = dim[1];
+            }
+        }
 
-    resizeTimer->stop();
-    resizeTimer->start(FITS_VIEW_DEFAULT_RESIZE_TIMEOUT);
-}
+        currentImage_npix = currentImage_dim[0]*currentImage_dim[1];
 
+        // channels and their mean
+        if ( !setMemoryUsage(FitsViewMemoryGovernor::ImageData,4*currentImage_npix*sizeof(double)) ) throw std::bad_alloc();
+        currentImage_buffer = std::unique_ptr<double[]>(new double[currentImage_npix]);
+        currentImage_pixels = currentImage_buffer.get();
 
-// rect bottom-left coordinates must be in the QPixmap notation!
-// (integer coordinates are at the botom-left conner of pixel and pixels start from 0)
-//void FitsViewWidget::getSubImage(std::vector<double> *subImage, QRectF &rect)
-void FitsViewWidget::getSubImage(std::vector<double> &subImage, QRectF &rect)
-{
-    if ( !currentImage_buffer ) return;
+        if ( !chooseDisplayBinning() ) throw std::bad_alloc();
+        currentPixmap = QPixmap((currentImage_dim[0]+displayBinning-1)/displayBinning,
+                                (currentImage_dim[1]+displayBinning-1)/displayBinning);
+        if ( currentPixmap.isNull() ) throw std::bad_alloc();
 
-    QRectF area = rect.normalized();
+    } catch (std::bad_alloc &ex) {
+        currentError = FitsViewWidget::MemoryError;
+    } catch (int err) {
+        currentError = err;
+    }
 
-    if ( (area.x() < 0) || (area.y() < 0) ||
-         ((area.x() + area.width()) > currentImage_dim[0]) || ((area.y()+area.height()) > currentImage_dim[1]) ) {
-        currentError = FitsViewWidget::BadRegion;
+    if ( currentError != FitsViewWidget::OK ) {
+        releaseImage();
         emit fitsViewError(currentError);
         return;
     }
 
+    currentPixmap.fill(Qt::black);
 
-    quint32 xl = (quint32) area.x();
-    quint32 yl = (quint32) area.y();
+    // the mean of channels is used for single-image tools (cursor readout, profiles, star measurement)
 
-    quint32 xr = (quint32) (area.x() + area.width());
-    quint32 yr = (quint32) (area.y() + area.height());
+    double *buffer = currentImage_buffer.get();
+    const double *red = compositeImage_buffer[0].get();
+    const double *green = compositeImage_buffer[1].get();
+    const double *blue = compositeImage_buffer[2].get();
+    long npix = currentImage_npix;
+
+#pragma omp parallel for
+    for ( long i = 0; i < npix; ++i ) {
+        buffer[i] = (red[i] + green[i] + blue[i])/3.0;
+    }
 
-    size_t Npixels = (xr-xl+1)*(yr-yl+1);
+    const quint64 *mask = activeBadPixelMask();
 
-//    subImage->resize(Npixels);
-    subImage.resize(Npixels);
+    calibrate_image(buffer,nullptr,currentImage_npix,nullptr,nullptr,1.0,nullptr,mask,&currentImageMinVal,&currentImageMaxVal);
+    currentLowCut = currentImageMinVal;
+    currentHighCut = currentImageMaxVal;
 
-    size_t i = 0;
-    for ( quint32 y = yl; y <= yr; ++y ) {
-        quint32 offset = y*currentImage_dim[0];
-        for ( quint32 x = xl; x <= xr; ++x ) {
-            subImage[i++] = currentImage_buffer[offset + x];
-//            subImage->at(i++) = currentImage_buffer[offset + x];
-        }
-    }
-}
+    currentScaledImage_buffer = nullptr; // not used for composite image
 
+    std::vector<double> sample;
 
-        /*  PRIVATE SLOTS  */
+    for ( int i = 0; i < 3; ++i ) {
+        double *channel = compositeImage_buffer[i].get();
 
-void FitsViewWidget::resizeTimeout()
-{
-    resizeTimer->stop();
+        calibrate_image(channel,nullptr,currentImage_npix,nullptr,nullptr,1.0,nullptr,mask,&compositeMinVal[i],&compositeMaxVal[i]);
 
-//    QRectF rr = view->mapToScene(view->geometry()).boundingRect();
+        compositeLowCut[i] = compositeMinVal[i];
+        compositeHighCut[i] = compositeMaxVal[i];
 
-    centerOn(currentViewedSubImageCenter);
-    this->invalidateScene();
+        if ( autoscale ) {
+            double lcut = compositeLowCut[i];
+            double hcut = compositeHighCut[i];
 
-    return;
+            strided_sample(channel,currentImage_npix,maxSampleLength,sample,mask);
+            computeCuts(sample,&lcut,&hcut);
+            setChannelCuts(i,lcut,hcut);
+        }
+    }
 
-//    if ( (rr.height() < currentViewedSubImage.height()) || (rr.width() < currentViewedSubImage.width()) ) {
-//        qreal hfactor = 1.0*rr.height()/currentViewedSubImage.height();
-//        qreal wfactor = 1.0*rr.width()/currentViewedSubImage.width();
+    displayTiles_dim[0] = (currentPixmap.width() + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+    displayTiles_dim[1] = (currentPixmap.height() + FITS_VIEW_TILE_SIZE - 1)/FITS_VIEW_TILE_SIZE;
+    displayTileIsDirty.assign(displayTiles_dim[0]*displayTiles_dim[1],1);
 
-//        qreal factor = (hfactor > wfactor) ? wfactor : hfactor;
-//        incrementZoom(factor);
-//    } else {
-//        setZoom(currentZoomFactor);
-//    }
+    profileBuffer.reserve(static_cast<int>(std::hypot(currentImage_dim[0],currentImage_dim[1])) + 2);
 
-}
+    compositeIsOn = true;
+    imageIsLoaded = true;
 
-void FitsViewWidget::changeZoom(qreal factor)
-{
-    currentZoomFactor *= factor;
+    currentError = FitsViewWidget::OK; // bad autocut of a channel is not an error here
 
-    // recompute current viewed sub-image
-    currentViewedSubImage = this->mapToScene(this->viewport()->rect()).boundingRect();
-    if ( currentViewedSubImage.width() > currentImage_dim[0] ) currentViewedSubImage.setWidth(currentImage_dim[0]);
-    if ( currentViewedSubImage.height() > currentImage_dim[1] ) currentViewedSubImage.setHeight(currentImage_dim[1]);
+    resetView();
+
+    if ( autoRegistrationIsOn && !registrationCoarse.empty() ) registerImage();
+
+    for ( int i = 0; i < 3; ++i ) {
+        emit channelCutsAreChanged(static_cast<RGBChannel>(i),compositeLowCut[i],compositeHighCut[i]);
+    }
 }
 
 
-void FitsViewWidget::updateFitsPixmap()
+// check and set cuts of composite channel, nothing is rendered here
+bool FitsViewWidget::setChannelCuts(int ch, const double lcuts, const double hcuts)
 {
+    currentError = FitsViewWidget::OK;
 
-    if ( !currentScaledImage_buffer ) return;
-    if ( !fitsImagePixmapItem ) return;
-
-    // convert to pixmap
-    QImage im = QImage(currentScaledImage_buffer.get(),currentImage_dim[0],currentImage_dim[1],currentImage_dim[0],QImage::Format_Indexed8);
-    im.setColorTable(currentCT);
+    if ( (lcuts >= hcuts) || (lcuts >= compositeMaxVal[ch]) || (hcuts <= compositeMinVal[ch]) ) {
+        currentError = FitsViewWidget::BadCutValue;
+        emit fitsViewError(currentError);
+        return false;
+    }
 
-    currentPixmap = QPixmap::fromImage(im);
+    compositeLowCut[ch] = ( lcuts < compositeMinVal[ch] ) ? compositeMinVal[ch] : lcuts;
+    compositeHighCut[ch] = ( hcuts > compositeMaxVal[ch] ) ? compositeMaxVal[ch] : hcuts;
 
-    fitsImagePixmapItem->setPixmap(currentPixmap);
+    return true;
 }
 
 
-
-        /*  PRIVATE METHODS  */
+void FitsViewWidget::invalidateDisplayTiles()
+{
+    std::fill(displayTileIsDirty.begin(),displayTileIsDirty.end(),1);
+}
 
 
 void FitsViewWidget::computeCuts(std::vector<double> &sample, double *lcut, double *hcut)
@@ -817,6 +3890,10 @@ void FitsViewWidget::computeCuts(std::vector<double> &sample, double *lcut, doub
 
     double sigma, median;
 
+    // NaNs (and masked pixels of region, see getSubImage) are excluded
+    sample.erase(std::remove_if(sample.begin(),sample.end(),[](double v){ return v != v; }),sample.end());
+    if ( sample.empty() ) return;
+
     random_sample(sample,maxSampleLength);
 
     int status = robust_sigma(sample,&sigma,&median);
@@ -848,6 +3925,27 @@ void FitsViewWidget::generateCT(FitsViewWidget::ColorTable ct)
             }
             break;
         }
+        case FitsViewWidget::CT_HEAT: { // black-red-yellow-white
+            const int nodes[][4] = {{0,0,0,0}, {87,255,87,0}, {166,255,166,0}, {250,255,250,255}, {255,255,255,255}};
+            interpolate_color_table(nodes,5,currentCT);
+            break;
+        }
+        case FitsViewWidget::CT_COOL: { // cyan-magenta
+            const int nodes[][4] = {{0,0,255,255}, {255,255,0,255}};
+            interpolate_color_table(nodes,2,currentCT);
+            break;
+        }
+        case FitsViewWidget::CT_RAINBOW: { // blue-cyan-green-yellow-red
+            const int nodes[][4] = {{0,0,0,255}, {64,0,255,255}, {128,0,255,0}, {191,255,255,0}, {255,255,0,0}};
+            interpolate_color_table(nodes,5,currentCT);
+            break;
+        }
+        case FitsViewWidget::CT_VIRIDIS: { // perceptually uniform
+            const int nodes[][4] = {{0,68,1,84}, {32,71,44,122}, {64,59,82,139}, {96,44,113,142}, {128,33,145,140},
+                                    {159,39,173,129}, {191,92,200,99}, {223,170,220,50}, {255,253,231,37}};
+            interpolate_color_table(nodes,9,currentCT);
+            break;
+        }
         default: {
             currentError = FitsViewWidget::BadColorTable;
             emit fitsViewError(currentError);
@@ -2,6 +2,13 @@
 #define FITSVIEWWIDGET_H
 
 #include "fitsviewwidget_global.h"
+#include "FitsViewStarMeasurement.h"
+#include "FitsViewMemoryGovernor.h"
+#include "FitsViewDisplayFilter.h"
+#include "FitsViewStretch.h"
+#include "FitsViewSidecarCache.h"
+#include "FitsViewRegistration.h"
+#include "FitsViewResample.h"
 //#include "viewpanel.h"
 
 #include<memory>
@@ -10,31 +17,56 @@
 #include<QGraphicsScene>
 #include<QGraphicsItem>
 #include<QGraphicsRectItem>
+#include<QGraphicsLineItem>
 #include<QGraphicsPixmapItem>
 #include<QVector>
 #include<vector>
+#include<map>
 #include<QRgb>
 #include<QPixmap>
+#include<QColor>
+#include<QByteArray>
 #include<QPointer>
 #include<QMouseEvent>
 #include<QTimer>
 #include<QRectF>
 #include<QPointF>
+#include<QTransform>
 #include<QPen>
 
+#include<fitsio.h>
+
 #define FITS_VIEW_COLOR_TABLE_LENGTH 256
 #define FITS_VIEW_MAX_SAMPLE_LENGTH 10000
 #define FITS_VIEW_DEFAULT_RESIZE_TIMEOUT 250 // 1/4 second
 #define FITS_VIEW_IMAGE_MARGIN 2 // margin between viewed image and border of viewport
-
-class FITSVIEWWIDGETSHARED_EXPORT FitsViewWidget: public QGraphicsView
+#define FITS_VIEW_TILE_SIZE 256 // size of display tile in pixmap pixels
+#define FITS_VIEW_MAX_DISPLAY_BINNING 16 // the coarsest pixmap resolution under memory pressure
+#define FITS_VIEW_PIXMAP_BYTES_PER_PIXEL 4
+#define FITS_VIEW_MAX_OVERVIEW_SIZE 4096 // maximal size of the overview pixmap of out-of-core image
+#define FITS_VIEW_DETAIL_MIN_ZOOM 0.5 // full-resolution tiles of out-of-core image are shown starting from this zoom
+#define FITS_VIEW_DEFAULT_STAR_RADIUS 10 // half-size of the box around clicked position for star measurement
+#define FITS_VIEW_MAX_FILTER_CACHE_SIZE 134217728 // 128 MBytes of filtered tiles for all filter settings
+#define FITS_VIEW_EXPTIME_KEY "EXPTIME" // exposure keyword for dark frame scaling
+#define FITS_VIEW_RENDER_INTERVAL 16 // ms, changes during this interval are merged into a single render
+#define FITS_VIEW_MAX_RESAMPLED_CACHE_SIZE 67108864 // 64 MBytes of display tiles of rotated image
+#define FITS_VIEW_RESAMPLED_TILES_PER_BATCH 4 // tiles of rotated image resampled in parallel between the checks of the time budget
+
+class FitsViewTileCache;
+
+class FITSVIEWWIDGETSHARED_EXPORT FitsViewWidget: public QGraphicsView, public FitsViewMemoryClient
 {
 
     Q_OBJECT
 
 public:
-    enum ColorTable {CT_BW, CT_NEGBW};
-    enum Error {OK, MemoryError = 10000, BadColorTable, BadCutValue, BadRegion};
+    enum ColorTable {CT_BW, CT_NEGBW, CT_HEAT, CT_COOL, CT_RAINBOW, CT_VIRIDIS};
+    enum Error {OK, MemoryError = 10000, BadColorTable, BadCutValue, BadRegion, BadCompositeImage, BadCalibrationFrame, BadPixelMask, SharedMemoryError, BadRegistration, UnknownExposureTime};
+    enum RGBChannel {RGB_RED, RGB_GREEN, RGB_BLUE};
+    enum RegionTool {RT_RECTANGLE, RT_LINE};
+    enum ProfileInterpolation {PI_NEAREST, PI_BILINEAR};
+    enum ResampleInterpolation {RI_BILINEAR, RI_LANCZOS};
+    enum PixelType {PT_UINT8, PT_INT16, PT_UINT16, PT_INT32, PT_FLOAT, PT_DOUBLE};
 
     FitsViewWidget(QWidget *parent = nullptr);
 
@@ -43,8 +75,11 @@ public:
     int getError() const;
 
     bool isImageLoaded() const;
+    bool isCompositeImage() const;
+    bool isOutOfCore() const;
 
     void getCuts(double *lcuts, double *hcuts);
+    void getChannelCuts(FitsViewWidget::RGBChannel ch, double *lcuts, double *hcuts);
 
     QString getCurrentFilename() const;
 
@@ -53,6 +88,11 @@ public:
     void setColorTable(FitsViewWidget::ColorTable ct);
     FitsViewWidget::ColorTable getColorTable() const;
 
+    // non-linear mapping of values between the cuts (parameter <= 0 is the default one, see FitsViewStretch.h)
+    void setStretch(FitsViewStretch::StretchType type, const double parameter = 0.0);
+    FitsViewStretch::StretchType getStretch() const;
+    double getStretchParameter() const;
+
     void setMaxSampleLength(size_t nelem);
 
     void centerOn(qreal x, qreal y);
@@ -62,24 +102,147 @@ public:
 
     void setRubberBandPen(const QPen &pen);
 
+    void setRegionTool(FitsViewWidget::RegionTool tool);
+    FitsViewWidget::RegionTool getRegionTool() const;
+
+    void setLineProfilePen(const QPen &pen);
+    void setLineProfileInterpolation(FitsViewWidget::ProfileInterpolation interp);
+    void setLineProfileWidth(const int width); // in pixels, perpendicular to the line
+
+    void setStarMeasurement(const bool on); // measure star in selected region or around clicked position
+    void setStarPSFModel(FitsViewStarMeasurement::PSFModel model);
+    void setStarMeasurementRadius(const int radius);
+
     void zoomFitInView();
     void setZoom(const qreal zoom_factor);  // absolute zoom factor
     void incrementZoom(const qreal zoom_inc);
     qreal getZoom() const;
 
+    // memory budget is shared by all widgets (see FitsViewMemoryGovernor)
+    static void setMemoryBudget(size_t bytes); // 0 means unlimited
+    static size_t getMemoryBudget();
+    static size_t getTotalMemoryUsage();
+    size_t getMemoryUsage() const;
+
+    // number of renders, of updates merged into them and of cancelled (stale) updates
+    void getRenderStatistics(quint64 *renders, quint64 *merged, quint64 *cancelled) const;
+    int getDisplayBinning() const; // > 1 if pixmap resolution was reduced to fit the memory budget
+    void setTileCacheSize(size_t bytes); // for out-of-core images
+
+    // directory of the on-disk cache of image statistics, autocut, histogram and out-of-core overview.
+    // the cache is used by load() and loadOutOfCore(), empty directory disables it (default)
+    void setSidecarCacheDir(const QString &dir);
+    QString getSidecarCacheDir() const;
+
+    // master frames are applied by load() as (raw - bias - dark*t_raw/t_dark)/flat.
+    // they are kept until cleared and may be set in any combination
+    void setCalibration(const bool on);
+    bool isCalibrationOn() const;
+
+    // masked pixels (and NaNs) are excluded from the image range, the autocut and
+    // the region statistics, imagePoint reports NaN for them.
+    // the mask is applied to images of the same dimensions, so set it before load()
+    void setBadPixelMaskColor(const QColor &color);
+    bool isBadPixelMaskApplied() const;
+
+    // the filter is computed for visible tiles only and changes the displayed pixmap,
+    // not pixel values (readout, cuts and statistics use the original image).
+    // it is not applied to composite and out-of-core images
+    void setDisplayFilter(const FitsViewDisplayFilter &filter);
+    FitsViewDisplayFilter getDisplayFilter() const;
+
+    // translation of the current image relative to the reference one (FFT phase correlation of
+    // downsampled central region, refined at full resolution). the offset is applied to the display
+    // only (the image is not resampled), so aligned frames could be blinked. the images must have
+    // the same dimensions, out-of-core images are not supported
+    bool setRegistrationReference(); // the current image is the reference
+    void clearRegistrationReference();
+    bool registerImage();
+    void setAutoRegistration(const bool on); // register every loaded image
+    QPointF getRegistrationOffset() const;   // the reference pixel (x,y) is the pixel (x,y)+offset of the image
+
+    // the image is displayed rotated counter-clockwise by angle (degrees) about its center, flip mirrors
+    // its x-axis before the rotation. the visible region is resampled into screen-aligned tiles, which are
+    // cached until the angle, the flip or the zoom are changed. the tiles are rendered by the render scheduler
+    // in passes of FITS_VIEW_RENDER_INTERVAL ms from the viewport center, bilinearly first; RI_LANCZOS
+    // tiles replace them when there are no other tiles to render. imagePoint, regions and line profiles
+    // are in native pixel coordinates. the display filter is not applied to the rotated image
+    void setDisplayRotation(const double angle, const bool flip = false);
+    double getDisplayRotation() const;
+    bool isDisplayFlipped() const;
+    bool setNorthUp(); // north up and east left from WCS of the current file (false if there is no WCS)
+    void setResampleInterpolation(FitsViewWidget::ResampleInterpolation interp);
+    FitsViewWidget::ResampleInterpolation getResampleInterpolation() const;
+
+    // caches are dropped first, then the pixmap of displayed image is rebinned (twice coarser per step)
+    // until 'bytes' are freed. the finest binning which fits the budget is chosen again on the next load
+    virtual size_t evictMemory(size_t bytes);
+
+    // load row-major nx*ny pixels from memory. the pixels are converted to double (with the calibration)
+    // in a single pass. with keep_pointer double pixels are displayed without copying if there is no
+    // calibration: the caller guarantees they are not changed and alive until the next load
+    void loadBuffer(const double *pixels, const size_t nx, const size_t ny,
+                    const bool autoscale = true, const bool keep_pointer = false);
+    void loadBuffer(const float *pixels, const size_t nx, const size_t ny, const bool autoscale = true);
+    void loadBuffer(const qint32 *pixels, const size_t nx, const size_t ny, const bool autoscale = true);
+    void loadBuffer(const quint16 *pixels, const size_t nx, const size_t ny, const bool autoscale = true);
+    void loadBuffer(const qint16 *pixels, const size_t nx, const size_t ny, const bool autoscale = true);
+    void loadBuffer(const quint8 *pixels, const size_t nx, const size_t ny, const bool autoscale = true);
+
 public slots:
-    void load(const QString fits_filename, const bool autoscale = true);
+    void load(const QString fits_filename, const bool autoscale = true); // falls back to out-of-core mode if image does not fit the memory budget
+    void loadOutOfCore(const QString fits_filename, const bool autoscale = true);
+    void loadMemory(const QByteArray fits_data, const bool autoscale = true); // FITS file content, no temporary file
+
+    // POSIX shared memory segment (shm_open name): FITS file content or raw row-major pixels.
+    // double pixels are displayed directly from the segment (mapped until the next load)
+    void loadSharedMemory(const QString shm_name, const bool autoscale = true);
+    void loadSharedMemory(const QString shm_name, FitsViewWidget::PixelType type,
+                          const size_t nx, const size_t ny, const bool autoscale = true);
     void rescale(const double lcuts, const double hcuts);
+
+    // composite image: each channel is a file or a plane of 3D cube (planes start from 1)
+    void loadComposite(const QString red_filename, const QString green_filename, const QString blue_filename,
+                       const bool autoscale = true);
+    void loadComposite(const QString cube_filename, const int red_plane, const int green_plane, const int blue_plane,
+                       const bool autoscale = true);
+    void rescaleChannel(FitsViewWidget::RGBChannel ch, const double lcuts, const double hcuts);
+
+    void loadMasterBias(const QString fits_filename);
+    // exptime <= 0: from FITS header. the dark is scaled by the ratio of exposures; if the exposure of the dark
+    // or of the image is unknown, the dark is subtracted unscaled and UnknownExposureTime is reported
+    void loadMasterDark(const QString fits_filename, const double exptime = 0.0);
+    void loadMasterFlat(const QString fits_filename); // normalized by the mean of its finite positive pixels
+    void clearCalibration();
+
+    // non-zero pixels (bits of bad_flags for DQ extension, e.g. "frame.fits[DQ]") are bad
+    void loadBadPixelMask(const QString fits_filename, const int bad_flags = ~0);
+    void clearBadPixelMask();
+
     void showImage();
+    void measureStar(const QRectF region); // region in FITS notation (as in regionWasSelected)
+    void measureStar(const QPointF pos);   // the box of the measurement radius around position (FITS notation)
 
 signals:
     void fitsViewError(int err);
     void cutsAreChanged(double lcut, double hcut);
+    void channelCutsAreChanged(FitsViewWidget::RGBChannel ch, double lcut, double hcut);
     void ColorTableIsChanged(FitsViewWidget::ColorTable ct);
+    void stretchIsChanged(FitsViewStretch::StretchType type, double parameter);
     void zoomIsChanged(qreal factor);
     void regionWasSelected(QRectF region);
     void regionWasDeselected();
-    void imagePoint(QPointF pos, double value);
+    void imagePoint(QPointF pos, double value); // for composite image the value is the mean of channels
+    void compositePoint(QPointF pos, double red, double green, double blue);
+    void memoryUsageIsChanged(qint64 widget_usage, qint64 total_usage);
+    // FITS notation. profile is the internal buffer which is reused on every mouse move: it is valid
+    // during the emission only, so connect directly and copy the values. a queued connection or
+    // a stored copy shares the buffer and makes the next update reallocate it
+    void lineProfile(QPointF start, QPointF end, const QVector<double> &profile);
+    void starWasMeasured(FitsViewStarMeasurement result);
+    void imageIsRendered(int merged_updates); // number of updates merged into the render
+    void imageIsRegistered(QPointF offset, double quality); // quality is the correlation peak in [0,1]
+    void rotationIsChanged(double angle, bool flip);
 
 protected:
     virtual void mouseMoveEvent(QMouseEvent* event);
@@ -98,24 +261,61 @@ protected:
     bool rubberBandIsShown;
 
 
+    RegionTool currentRegionTool;
+
+    QGraphicsLineItem *profileLine;
+    QPointF profileLineOrigin, profileLineEnd; // in QPixmap notation
+    QPen profileLinePen;
+    bool profileLineIsActive;
+    ProfileInterpolation profileInterpolation;
+    int profileWidth;
+    QVector<double> profileBuffer;
+
+    bool starMeasurementIsOn;
+    FitsViewStarMeasurement::PSFModel starPSFModel;
+    int starMeasurementRadius;
+
+
     void getSubImage(std::vector<double> &subImage, QRectF &rect);
+    void getLineProfile(const QPointF &start, const QPointF &end, QVector<double> &profile);
 
 private slots:
     void resizeTimeout();
     void changeZoom(qreal factor);
     void updateFitsPixmap();
+    void updateVisibleTiles();
+    void renderImage();
 
 private:
     int currentError;
     QString currentFilename;
 
     bool imageIsLoaded;
-    std::unique_ptr<double[]> currentImage_buffer;
+    std::unique_ptr<double[]> currentImage_buffer; // own pixels, nullptr if the caller's ones are displayed
+    const double *currentImage_pixels;             // the displayed pixels: currentImage_buffer or the caller's (never written)
     std::unique_ptr<uchar[]> currentScaledImage_buffer;
     size_t currentImage_npix;
     size_t currentImage_dim[2];
     double currentImageMinVal;
     double currentImageMaxVal;
+    bool currentImageIsInteger; // exact lookup table of the stretch could be used
+
+    void resetView();
+    void releaseImage();
+
+    bool setMemoryUsage(FitsViewMemoryGovernor::Category cat, size_t bytes);
+    bool memoryIsRequested; // the governor evicts on behalf of this widget: only caches are dropped
+    bool chooseDisplayBinning();
+    size_t increaseDisplayBinning();
+    QPixmap scaledImageToPixmap();
+
+    QPointF mapSceneToImage(const QPointF &pos) const; // image coordinates are in QPixmap notation
+    QRectF mapSceneToImage(const QRectF &rect) const;
+    QPointF mapImageToScene(const QPointF &pos) const;
+    QRect visibleImageRect() const; // in QPixmap notation
+    QRectF rubberBandImageRect() const;
+
+    void getSubImage(const double *image, std::vector<double> &subImage, QRectF &rect);
 
     void computeCuts(std::vector<double> &sample, double *lcut, double *hcut);
     double lowCutSigmas, highCutSigmas;
@@ -124,8 +324,127 @@ private:
     void generateCT(FitsViewWidget::ColorTable ct);
     QVector<QRgb> currentCT;
     ColorTable currentCT_name;
+    FitsViewStretch currentStretch;
+
+    void loadComposite(const QString filename[3], const long plane[3], const bool autoscale);
+    bool setChannelCuts(int ch, const double lcuts, const double hcuts);
+    void invalidateDisplayTiles();
+    void updateCompositeTiles();
+
+    bool compositeIsOn;
+    std::unique_ptr<double[]> compositeImage_buffer[3];
+    double compositeMinVal[3], compositeMaxVal[3];
+    double compositeLowCut[3], compositeHighCut[3];
+    std::vector<char> displayTileIsDirty; // composite or filtered tiles of the pixmap which are not rendered yet
+    size_t displayTiles_dim[2];
+
+    bool outOfCoreIsOn;
+    std::unique_ptr<FitsViewTileCache> tileCache;
+    std::vector<double> overviewImage_buffer; // every displayBinning-th pixel of out-of-core image
+    size_t overviewImage_dim[2];
+    std::map<size_t,QGraphicsPixmapItem*> detailTiles; // full-resolution tiles over the overview
+    size_t detailTilesUsage; // bytes of the tile pixmaps
+
+    void updateDetailTiles();
+    void removeDetailTiles();
+    void syncCacheUsage();
+
+    bool calibrationIsOn;
+    std::unique_ptr<double[]> calibrationBias;
+    std::unique_ptr<double[]> calibrationDark;
+    std::unique_ptr<double[]> calibrationFlat; // inverse of normalized flat
+    size_t calibration_dim[2];
+    double calibrationDarkExptime; // 0 if unknown
+
+    bool loadCalibrationFrame(const QString &filename, std::unique_ptr<double[]> &frame, double *exptime);
+    void updateCalibrationUsage();
+
+    std::vector<quint64> badPixelMask; // packed bitmap, bit (x + y*width) is set for bad pixel
+    size_t badPixelMask_dim[2];
+    QColor badPixelMaskColor;
+    QGraphicsPixmapItem *badPixelMaskItem; // overlay over the image pixmap
+
+    const quint64* activeBadPixelMask() const; // nullptr if the mask does not match the image
+    void updateBadPixelMaskItem();
+
+    void *sharedMemory_ptr; // mapped segment which the image is displayed from
+    size_t sharedMemory_size;
+
+    int readImage(fitsfile *FITS_fptr, double *exptime);
+    bool prepareBuffer(const size_t nx, const size_t ny, const double *external);
+    bool calibrationIsApplied(const size_t nx, const size_t ny) const;
+    template<class T> void ingestImage(const T *pixels, const double exptime, const bool autoscale,
+                                       const FitsViewSidecarData *cached = nullptr);
+
+    FitsViewSidecarCache sidecarCache;
+    FitsViewSidecarData sidecarData; // products of the current file (the overview is in overviewImage_buffer)
+    QString sidecarFilename; // empty if the products are not cached (e.g. calibrated image)
+    bool sidecarIsModified;
+
+    void autoCuts(const double *buffer, size_t npix, const quint64 *mask, const FitsViewSidecarData *cached);
+    void storeSidecar();
+
+    std::vector<std::complex<double> > registrationCoarse; // spectra of the reference regions
+    std::vector<std::complex<double> > registrationFine;
+    size_t registration_dim[2];
+    QPointF registrationOffset;
+    bool autoRegistrationIsOn;
+
+    void setRegistrationOffset(const QPointF &offset);
+
+    double displayRotation; // degrees, counter-clockwise
+    bool displayFlip;
+    ResampleInterpolation resampleInterpolation;
+    double currentNorthAngle; // rotation for north up of the current image, NaN if there is no WCS
+    bool currentNorthFlip;
+
+    struct ResampledTile {
+        QGraphicsPixmapItem *item;
+        bool isDirty; // the cuts, the color table or the mask were changed, shown until it is rendered again
+        bool isDraft; // bilinear, to be rendered by Lanczos
+    };
+
+    typedef std::map<std::pair<long,long>,ResampledTile> ResampledTiles; // by tile column and row in the scene
+
+    ResampledTiles resampledTiles;
+    QTransform resampledTransform; // scene to image mapping of the cached tiles
+    qreal resampledZoom;
+    size_t resampledTilesUsage;
+
+    bool resampledDisplayIsOn() const;
+    QTransform displayRotationTransform() const;
+    void updateImageTransform();
+    void updateResampledTiles();
+    void renderResampledTiles();
+    void redrawResampledTiles();
+    void clearResampledTiles();
+
+    typedef std::map<size_t,std::vector<double> > FilterTiles; // filtered values of pixmap tiles
+
+    FitsViewDisplayFilter displayFilter;
+    std::vector<std::pair<FitsViewDisplayFilter,FilterTiles> > filterCache; // per filter setting
+    size_t filterCacheUsage;
+
+    bool displayFilterIsOn() const;
+    void updateFilterTiles();
+    void clearFilterCache();
+
+    enum RenderFlag {RENDER_SCALE = 1, RENDER_PIXMAP = 2, // cuts or data changed, color table or filter changed
+                     RENDER_RESAMPLED = 4};               // tiles of rotated image are missing or outdated
+    int renderFlags; // pending changes
+    int renderRequests;
+    quint64 imageGeneration;  // incremented when the image is released (every load)
+    quint64 renderGeneration; // the image generation of the pending render
+    quint64 renderCount, renderMergedCount, renderCancelledCount;
+    QPointer<QTimer> renderTimer;
+
+    void requestRender(int flags);
+    void flushRender(int flags);
+    void cancelRender();
+    bool scaleImage();
 
     QPixmap currentPixmap;
+    int displayBinning; // pixmap pixel is displayBinning x displayBinning image pixels
     QPointer<QGraphicsScene> scene;
 //    QGraphicsScene *scene;
     QGraphicsPixmapItem *fitsImagePixmapItem;
@@ -139,4 +458,6 @@ private:
     QPointF currentViewedSubImageCenter; // in image pixels
 };
 
+Q_DECLARE_METATYPE(FitsViewStarMeasurement)
+
 #endif // FITSVIEWWIDGET_H
@@ -9,17 +9,35 @@ QT       += widgets
 TARGET = FitsViewWidget
 TEMPLATE = lib
 
-QMAKE_CXXFLAGS += -std=c++11
-#QMAKE_CXXFLAGS += -std=c++11 -fopenmp
-#LIBS += -fopenmp
+#QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -std=c++11 -fopenmp
+LIBS += -fopenmp
 #QMAKE_LFLAGS += -fopenmp
 
 DEFINES += FITSVIEWWIDGET_LIBRARY
 
-SOURCES += FitsViewWidget.cpp
+SOURCES += FitsViewWidget.cpp \
+        FitsViewStarMeasurement.cpp \
+        FitsViewMemoryGovernor.cpp \
+        FitsViewTileCache.cpp \
+        FitsViewDisplayFilter.cpp \
+        FitsViewStretch.cpp \
+        FitsViewSidecarCache.cpp \
+        FitsViewPhotometry.cpp \
+        FitsViewRegistration.cpp \
+        FitsViewResample.cpp
 
 HEADERS += FitsViewWidget.h\
-        fitsviewwidget_global.h
+        fitsviewwidget_global.h \
+        FitsViewStarMeasurement.h \
+        FitsViewMemoryGovernor.h \
+        FitsViewTileCache.h \
+        FitsViewDisplayFilter.h \
+        FitsViewStretch.h \
+        FitsViewSidecarCache.h \
+        FitsViewPhotometry.h \
+        FitsViewRegistration.h \
+        FitsViewResample.h
 
 unix {
     target.path = /usr/lib
@@ -28,6 +46,7 @@ unix {
 
 
 unix:!macx: LIBS += -L/usr/lib64/ -lcfitsio
+unix:!macx: LIBS += -lrt # shm_open
 
 INCLUDEPATH += /usr/include
 DEPENDPATH += /usr/include
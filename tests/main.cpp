@@ -0,0 +1,25 @@
+#include "tests.h"
+
+#include<cstdio>
+
+int main()
+{
+    struct {
+        const char *name;
+        int (*run)();
+    } tests[] = {
+        {"star measurement", test_star_measurement},
+        {"display filter", test_display_filter},
+        {"stretch", test_stretch},
+        {"registration", test_registration}
+    };
+
+    int failures = 0;
+    for ( auto &test: tests ) {
+        int n = test.run();
+        std::printf("%s: %s\n",test.name,n ? "FAILED" : "OK");
+        failures += n;
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+#ifndef FITSVIEW_TESTS_H
+#define FITSVIEW_TESTS_H
+
+#include<cstdio>
+
+// the check prints the failed condition and increments the failure counter
+#define FITS_VIEW_CHECK(cond, failures) \
+    do { if ( !(cond) ) { std::printf("  FAILED: %s (%s:%d)\n",#cond,__FILE__,__LINE__); ++(failures); } } while (0)
+
+
+// each test returns the number of failed checks
+int test_star_measurement();
+int test_display_filter();
+int test_stretch();
+int test_registration();
+
+#endif // FITSVIEW_TESTS_H
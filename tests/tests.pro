@@ -0,0 +1,32 @@
+#-------------------------------------------------
+#
+# Unit tests of the image processing modules (no GUI):
+#   qmake && make && ./FitsViewTests
+#
+#-------------------------------------------------
+
+QT       -= gui
+
+TARGET = FitsViewTests
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -std=c++11 -fopenmp
+LIBS += -fopenmp
+
+DEFINES += FITSVIEWWIDGET_LIBRARY
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+        tst_starmeasurement.cpp \
+        tst_displayfilter.cpp \
+        tst_stretch.cpp \
+        tst_registration.cpp \
+        ../FitsViewStarMeasurement.cpp \
+        ../FitsViewDisplayFilter.cpp \
+        ../FitsViewStretch.cpp \
+        ../FitsViewRegistration.cpp
+
+HEADERS += tests.h
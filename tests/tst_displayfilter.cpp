@@ -0,0 +1,127 @@
+#include "tests.h"
+#include "FitsViewDisplayFilter.h"
+
+#include<vector>
+#include<algorithm>
+#include<cmath>
+#include<limits>
+
+// brute-force median of valid pixels in the window (edge pixels are replicated)
+static double reference_median(const std::vector<double> &image, size_t nx, size_t ny, long x, long y, long r)
+{
+    std::vector<double> window;
+    for ( long dy = -r; dy <= r; ++dy ) {
+        for ( long dx = -r; dx <= r; ++dx ) {
+            long cx = std::min(std::max(x+dx,0L),static_cast<long>(nx)-1);
+            long cy = std::min(std::max(y+dy,0L),static_cast<long>(ny)-1);
+            double v = image[cx + cy*nx];
+            if ( std::isfinite(v) ) window.push_back(v);
+        }
+    }
+    if ( window.empty() ) return std::numeric_limits<double>::quiet_NaN();
+
+    std::nth_element(window.begin(),window.begin()+window.size()/2,window.end());
+    return window[window.size()/2];
+}
+
+
+static int test_median_outlier()
+{
+    int failures = 0;
+
+    const size_t nx = 64, ny = 48;
+    const FitsViewDisplayFilter median(FitsViewDisplayFilter::DF_MEDIAN,9.0); // the running-histogram median
+
+    // smooth ramp: the median of a window is its central value
+    std::vector<double> ramp(nx*ny);
+    for ( size_t y = 0; y < ny; ++y ) {
+        for ( size_t x = 0; x < nx; ++x ) ramp[x + y*nx] = 0.25*x + 0.5*y;
+    }
+
+    std::vector<double> expected(nx*ny), out(nx*ny);
+    fits_view_filter_region(ramp.data(),nullptr,nx,ny,0,0,nx,ny,1,median,expected.data());
+
+    // one outlier must not posterize the tile
+    std::vector<double> image = ramp;
+    image[30 + 20*nx] = 1.0e9;
+    fits_view_filter_region(image.data(),nullptr,nx,ny,0,0,nx,ny,1,median,out.data());
+
+    size_t ndiff = 0;
+    for ( size_t i = 0; i < nx*ny; ++i ) {
+        if ( out[i] != expected[i] ) ++ndiff;
+    }
+    FITS_VIEW_CHECK(ndiff == 0,failures);
+
+    // exact median (no quantization) in a sub-region
+    size_t x0 = 5, y0 = 7, w = 40, h = 30;
+    std::vector<double> sub(w*h);
+    image[12 + 15*nx] = std::numeric_limits<double>::quiet_NaN();
+    fits_view_filter_region(image.data(),nullptr,nx,ny,x0,y0,w,h,1,median,sub.data());
+
+    size_t nbad = 0;
+    for ( size_t j = 0; j < h; ++j ) {
+        for ( size_t i = 0; i < w; ++i ) {
+            if ( sub[i + j*w] != reference_median(image,nx,ny,x0+i,y0+j,median.radius()) ) ++nbad;
+        }
+    }
+    FITS_VIEW_CHECK(nbad == 0,failures);
+
+    return failures;
+}
+
+
+// NaN and masked pixels do not contribute: a flat image stays flat for all filters
+static int test_invalid_pixels()
+{
+    int failures = 0;
+
+    const size_t nx = 40, ny = 40;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    std::vector<double> image(nx*ny,5.0);
+    image[10 + 10*nx] = nan;
+    image[0] = nan; // at the edge (replicated)
+
+    std::vector<quint64> mask((nx*ny + 63)/64,0);
+    size_t bad = 25 + 20*nx;
+    image[bad] = 1.0e6;
+    mask[bad >> 6] |= static_cast<quint64>(1) << (bad & 63);
+
+    const FitsViewDisplayFilter filters[] = {
+        FitsViewDisplayFilter(FitsViewDisplayFilter::DF_BOX,5.0),
+        FitsViewDisplayFilter(FitsViewDisplayFilter::DF_GAUSSIAN,1.5),
+        FitsViewDisplayFilter(FitsViewDisplayFilter::DF_MEDIAN,3.0),
+        FitsViewDisplayFilter(FitsViewDisplayFilter::DF_MEDIAN,9.0),
+        FitsViewDisplayFilter(FitsViewDisplayFilter::DF_BIN2)
+    };
+
+    std::vector<double> out(nx*ny);
+
+    for ( auto &filter: filters ) {
+        for ( size_t step = 1; step <= 2; ++step ) {
+            size_t w = nx/step, h = ny/step;
+            fits_view_filter_region(image.data(),mask.data(),nx,ny,0,0,w,h,step,filter,out.data());
+
+            size_t nbad = 0;
+            for ( size_t i = 0; i < w*h; ++i ) {
+                if ( !(std::abs(out[i] - 5.0) < 1.0e-12) ) ++nbad;
+            }
+            FITS_VIEW_CHECK(nbad == 0,failures);
+        }
+    }
+
+    // no valid pixels in the window
+    std::vector<double> empty(16*16,nan);
+    for ( auto &filter: filters ) {
+        fits_view_filter_region(empty.data(),nullptr,16,16,0,0,16,16,1,filter,out.data());
+        FITS_VIEW_CHECK(std::isnan(out[0]) && std::isnan(out[255]),failures);
+    }
+
+    return failures;
+}
+
+
+int test_display_filter()
+{
+    return test_median_outlier() + test_invalid_pixels();
+}
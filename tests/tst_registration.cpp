@@ -0,0 +1,68 @@
+#include "tests.h"
+#include "FitsViewRegistration.h"
+
+#include<vector>
+#include<random>
+#include<cmath>
+
+// star field (Gaussian stars, sigma = 1.5) moved by (dx,dy): the star at (x,y) of the
+// unmoved field is at (x+dx,y+dy). the star positions are the same for the same seed
+static std::vector<double> star_field(size_t nx, size_t ny, double dx, double dy)
+{
+    std::vector<double> image(nx*ny,100.0);
+    std::mt19937 gen(12345);
+
+    for ( int i = 0; i < 400; ++i ) {
+        double x0 = 1.0*gen()/gen.max()*nx + dx;
+        double y0 = 1.0*gen()/gen.max()*ny + dy;
+        double flux = 200.0 + 1.0*gen()/gen.max()*2000.0;
+
+        long xmin = std::max(0L,static_cast<long>(x0) - 8), xmax = std::min(static_cast<long>(nx)-1,static_cast<long>(x0) + 8);
+        long ymin = std::max(0L,static_cast<long>(y0) - 8), ymax = std::min(static_cast<long>(ny)-1,static_cast<long>(y0) + 8);
+        for ( long y = ymin; y <= ymax; ++y ) {
+            for ( long x = xmin; x <= xmax; ++x ) {
+                double r2 = (x-x0)*(x-x0) + (y-y0)*(y-y0);
+                image[x + y*nx] += flux*std::exp(-0.5*r2/(1.5*1.5));
+            }
+        }
+    }
+
+    return image;
+}
+
+
+// the registration offset is the shift of the image: the reference pixel (x,y) is the image pixel (x,y)+offset
+static int check_shift(size_t nx, size_t ny, double dx, double dy)
+{
+    int failures = 0;
+    size_t dim[2] = {nx, ny};
+
+    std::vector<double> reference = star_field(nx,ny,0.0,0.0);
+    std::vector<double> image = star_field(nx,ny,dx,dy);
+
+    std::vector<std::complex<double> > coarse, fine;
+    fits_view_registration_reference(reference.data(),dim,coarse,fine);
+
+    double ox, oy;
+    double quality = fits_view_register(reference.data(),dim,coarse,fine,&ox,&oy);
+    FITS_VIEW_CHECK(std::abs(ox) < 0.05 && std::abs(oy) < 0.05,failures); // aligned with itself
+    FITS_VIEW_CHECK(quality > 0.5,failures);
+
+    quality = fits_view_register(image.data(),dim,coarse,fine,&ox,&oy);
+    FITS_VIEW_CHECK(std::abs(ox - dx) < 0.2,failures);
+    FITS_VIEW_CHECK(std::abs(oy - dy) < 0.2,failures);
+    FITS_VIEW_CHECK(quality > 0.1,failures);
+
+    return failures;
+}
+
+
+int test_registration()
+{
+    int failures = 0;
+
+    failures += check_shift(700,520,37.4,-21.7);   // full resolution (256 x 256 region)
+    failures += check_shift(1100,1040,-53.6,18.3); // coarse 2 x 2 blocks and the refinement
+
+    return failures;
+}
@@ -0,0 +1,97 @@
+#include "tests.h"
+#include "FitsViewStarMeasurement.h"
+
+#include<vector>
+#include<cmath>
+#include<limits>
+
+// star (Gaussian: sigma = 1.5, FWHM = 3.53; Moffat: alpha = 2.5, beta = 3, FWHM = 2.55)
+// on the flat background with a small deterministic ripple, so the background sigma is not zero
+static std::vector<double> star_image(size_t nx, size_t ny, double x0, double y0,
+                                      FitsViewStarMeasurement::PSFModel model)
+{
+    std::vector<double> image(nx*ny);
+
+    for ( size_t y = 0; y < ny; ++y ) {
+        for ( size_t x = 0; x < nx; ++x ) {
+            double r2 = (x-x0)*(x-x0) + (y-y0)*(y-y0);
+            double psf = ( model == FitsViewStarMeasurement::PSF_MOFFAT ) ? std::pow(1.0 + r2/(2.5*2.5),-3.0) :
+                                                                            std::exp(-0.5*r2/(1.5*1.5));
+            image[x + y*nx] = 100.0 + ((x*7 + y*13) % 5 - 2.0) + 1000.0*psf;
+        }
+    }
+
+    return image;
+}
+
+
+static int check_star(const std::vector<double> &image, size_t nx, size_t ny, double x0, double y0,
+                      FitsViewStarMeasurement::PSFModel model)
+{
+    int failures = 0;
+    FitsViewStarMeasurement result;
+
+    int ret = fits_view_measure_star(image.data(),nx,ny,0,0,nx-1,ny-1,model,result);
+
+    FITS_VIEW_CHECK(ret == 0,failures);
+    FITS_VIEW_CHECK(result.isValid,failures);
+    FITS_VIEW_CHECK(result.fitIsConverged,failures);
+    FITS_VIEW_CHECK(std::isfinite(result.background) && std::abs(result.background - 100.0) < 2.0,failures);
+    FITS_VIEW_CHECK(std::isfinite(result.flux),failures);
+    FITS_VIEW_CHECK(std::abs(result.fitXc - (x0+1.0)) < 0.05,failures); // FITS notation
+    FITS_VIEW_CHECK(std::abs(result.fitYc - (y0+1.0)) < 0.05,failures);
+    FITS_VIEW_CHECK(std::isfinite(result.fitChi2),failures);
+    if ( model == FitsViewStarMeasurement::PSF_MOFFAT ) {
+        FITS_VIEW_CHECK(std::abs(result.fitFWHMx - 2.0*2.5*std::sqrt(std::pow(2.0,1.0/3.0)-1.0)) < 0.1,failures);
+        FITS_VIEW_CHECK(std::abs(result.fitBeta - 3.0) < 0.3,failures);
+    } else {
+        FITS_VIEW_CHECK(std::abs(result.fitFWHMx - 1.5*2.3548) < 0.1,failures);
+    }
+    for ( double v: result.radialProfile ) FITS_VIEW_CHECK(std::isfinite(v),failures);
+
+    return failures;
+}
+
+
+int test_star_measurement()
+{
+    const size_t nx = 21, ny = 21;
+    const double x0 = 10.3, y0 = 9.8;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const FitsViewStarMeasurement::PSFModel models[] = {FitsViewStarMeasurement::PSF_GAUSSIAN,
+                                                        FitsViewStarMeasurement::PSF_MOFFAT};
+
+    int failures = 0;
+
+    for ( auto model: models ) {
+        std::vector<double> image = star_image(nx,ny,x0,y0,model);
+        failures += check_star(image,nx,ny,x0,y0,model);
+
+        // NaN in the border: the background median must not be poisoned
+        image[5] = nan;
+        image[nx*(ny-1) + 3] = nan;
+        failures += check_star(image,nx,ny,x0,y0,model);
+
+        // NaN in the core (next to the peak)
+        image = star_image(nx,ny,x0,y0,model);
+        image[11 + 10*nx] = nan;
+        failures += check_star(image,nx,ny,x0,y0,model);
+    }
+
+    FitsViewStarMeasurement result;
+
+    // too few usable pixels
+    std::vector<double> empty(nx*ny,nan);
+    empty[10 + 10*nx] = 1000.0;
+    FITS_VIEW_CHECK(fits_view_measure_star(empty.data(),nx,ny,0,0,nx-1,ny-1,
+                                           FitsViewStarMeasurement::PSF_GAUSSIAN,result) != 0,failures);
+    FITS_VIEW_CHECK(!result.isValid,failures);
+
+    // flat region: no star
+    std::vector<double> flat(nx*ny,100.0);
+    FITS_VIEW_CHECK(fits_view_measure_star(flat.data(),nx,ny,0,0,nx-1,ny-1,
+                                           FitsViewStarMeasurement::PSF_GAUSSIAN,result) != 0,failures);
+    FITS_VIEW_CHECK(!result.isValid,failures);
+
+    return failures;
+}
@@ -0,0 +1,51 @@
+#include "tests.h"
+#include "FitsViewStretch.h"
+
+#include<vector>
+#include<limits>
+
+// constant image (bias or zero frame): lcut == hcut. every stretch gives the linear mapping,
+// the values at the cut are black, the ones above it are white
+static int test_equal_cuts()
+{
+    int failures = 0;
+
+    const FitsViewStretch::StretchType types[] = {FitsViewStretch::ST_LINEAR, FitsViewStretch::ST_LOG, FitsViewStretch::ST_SQRT,
+                                                  FitsViewStretch::ST_POWER, FitsViewStretch::ST_ASINH, FitsViewStretch::ST_HISTEQ};
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const double values[] = {99.0, 100.0, 101.0, nan};
+
+    for ( auto type: types ) {
+        for ( int integer = 0; integer < 2; ++integer ) {
+            FitsViewStretch stretch;
+            stretch.setType(type);
+            stretch.computeHistogram(values,3,100.0,100.0,integer);
+            stretch.build(100.0,100.0,integer);
+
+            unsigned char index[4] = {1,1,1,1};
+            stretch.apply(values,4,index);
+
+            FITS_VIEW_CHECK(index[0] == 0,failures);
+            FITS_VIEW_CHECK(index[1] == 0,failures);
+            FITS_VIEW_CHECK(index[2] == 255,failures);
+            FITS_VIEW_CHECK(index[3] == 0,failures);
+        }
+    }
+
+    // undefined cuts are not a table either
+    FitsViewStretch stretch;
+    stretch.setType(FitsViewStretch::ST_SQRT);
+    stretch.build(nan,nan,false);
+
+    unsigned char index[4] = {1,1,1,1};
+    stretch.apply(values,4,index);
+    for ( int i = 0; i < 4; ++i ) FITS_VIEW_CHECK(index[i] == 0,failures);
+
+    return failures;
+}
+
+
+int test_stretch()
+{
+    return test_equal_cuts();
+}